@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "adaptive_sampler.h"
+
+#include "instruments_stats.h"
+
+#if defined(__ANDROID__)
+#	include "mali_counter.h"
+#endif
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits>
+#include <poll.h>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+#include <utility>
+
+namespace
+{
+uint64_t clock_ns(clockid_t clock)
+{
+	timespec time;
+	clock_gettime(clock, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+constexpr MeasurementsSnapshot::Id unresolved = std::numeric_limits<MeasurementsSnapshot::Id>::max();
+}        // namespace
+
+SamplingRateController::SamplingRateController(const AdaptiveSamplerConfig &config, size_t signals) :
+    _min_interval_ns(std::max<uint64_t>(config.min_interval_ns, 1)),
+    _max_interval_ns(std::max(config.max_interval_ns, _min_interval_ns)),
+    _initial_interval_ns(std::min(std::max(config.initial_interval_ns, _min_interval_ns), _max_interval_ns)),
+    _window(std::max<size_t>(config.window, 2)),
+    _fast_threshold(config.fast_threshold),
+    _stable_threshold(config.stable_threshold),
+    _growth(std::max(config.growth, 1.0)),
+    _overhead_budget(config.overhead_budget),
+    _signals(signals),
+    _rates(signals * _window, 0.0),
+    _interval_ns(_initial_interval_ns)
+{
+}
+
+void SamplingRateController::reset()
+{
+	_count       = 0;
+	_interval_ns = _initial_interval_ns;
+	_variation   = 0.0;
+	_cost_ns     = 0.0;
+}
+
+uint64_t SamplingRateController::update(const double *rates, uint64_t cost_ns)
+{
+	const size_t slot = _count % _window;
+	for (size_t signal = 0; signal < _signals; ++signal)
+	{
+		_rates[signal * _window + slot] = rates[signal];
+	}
+	_count++;
+
+	// Smooth the cost, a single sample can be delayed by preemption
+	_cost_ns = _count == 1 ? cost_ns : 0.875 * _cost_ns + 0.125 * cost_ns;
+
+	const size_t count = std::min(_count, _window);
+	if (count < 2)
+	{
+		return _interval_ns;
+	}
+
+	_variation = 0.0;
+	for (size_t signal = 0; signal < _signals; ++signal)
+	{
+		OnlineStats stats;
+		for (size_t i = 0; i < count; ++i)
+		{
+			stats.add(_rates[signal * _window + i]);
+		}
+
+		// A counter that stays at 0, e.g. an idle GPU, is stable
+		if (stats.mean() > 0.0)
+		{
+			_variation = std::max(_variation, stats.relative_standard_deviation());
+		}
+	}
+
+	double interval = static_cast<double>(_interval_ns);
+	if (_variation > _fast_threshold)
+	{
+		interval /= 2.0;
+	}
+	else if (_variation < _stable_threshold)
+	{
+		interval *= _growth;
+	}
+	interval = std::min(std::max(interval, static_cast<double>(_min_interval_ns)), static_cast<double>(_max_interval_ns));
+
+	if (_overhead_budget > 0.0)
+	{
+		interval = std::max(interval, _cost_ns / _overhead_budget);
+	}
+
+	_interval_ns = static_cast<uint64_t>(interval);
+	return _interval_ns;
+}
+
+AdaptiveSampler::AdaptiveSampler(PMUCounter *pmu, MaliCounter *mali, const AdaptiveSamplerConfig &config, size_t ring_capacity) :
+    _pmu(pmu),
+    _mali(mali),
+    _config(config),
+    _controller(config, config.watched.size() + (pmu != nullptr && config.watch_cpu ? 2 : 0)),
+    _samples(ring_capacity),
+    _watched_ids(config.watched.size(), unresolved),
+    _rates(config.watched.size() + (pmu != nullptr && config.watch_cpu ? 2 : 0), 0.0)
+{
+}
+
+AdaptiveSampler::~AdaptiveSampler()
+{
+	stop();
+}
+
+void AdaptiveSampler::start()
+{
+	if (_running)
+	{
+		throw std::runtime_error("Adaptive sampler already started.");
+	}
+
+	if (pipe2(_stop_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		throw std::runtime_error("Failed to create the adaptive sampler pipe.");
+	}
+
+	if (_pmu != nullptr)
+	{
+		_pmu->start();
+		_pmu->sample(_previous_cpu);
+	}
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		_mali->start();
+		_last_dump_ns = _mali->start_time();
+		_dump.assign(_mali->dump_size(), 0);
+	}
+#endif
+
+	_controller.reset();
+	std::fill(_watched_ids.begin(), _watched_ids.end(), unresolved);
+	_previous_ns     = clock_ns(CLOCK_MONOTONIC);
+	_interval_ns     = _controller.interval_ns();
+	_dropped_samples = 0;
+
+	_running = true;
+	_worker  = std::thread(&AdaptiveSampler::worker_loop, this);
+}
+
+void AdaptiveSampler::stop()
+{
+	if (!_running)
+	{
+		return;
+	}
+
+	_running = false;
+
+	const char wake = 0;
+	if (write(_stop_pipe[1], &wake, 1) != 1)
+	{
+		HWCPIPE_LOG("Failed to wake the adaptive sampler thread.");
+	}
+	_worker.join();
+
+	close(_stop_pipe[0]);
+	close(_stop_pipe[1]);
+	_stop_pipe[0] = -1;
+	_stop_pipe[1] = -1;
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		_mali->stop();
+	}
+#endif
+
+	if (_pmu != nullptr)
+	{
+		_pmu->stop();
+	}
+}
+
+bool AdaptiveSampler::pop_sample(AdaptiveSample &sample)
+{
+	AdaptiveSample *slot = _samples.front();
+	if (slot == nullptr)
+	{
+		return false;
+	}
+
+	std::swap(sample, *slot);
+	_samples.pop();
+	return true;
+}
+
+void AdaptiveSampler::worker_loop()
+{
+	uint64_t next_ns = _previous_ns + _controller.interval_ns();
+
+	while (_running)
+	{
+		const uint64_t now = clock_ns(CLOCK_MONOTONIC);
+		const uint64_t wait = next_ns > now ? next_ns - now : 0;
+
+		timespec timeout;
+		timeout.tv_sec  = static_cast<time_t>(wait / 1000000000ull);
+		timeout.tv_nsec = static_cast<long>(wait % 1000000000ull);
+
+		pollfd poll_fd;
+		poll_fd.fd     = _stop_pipe[0];
+		poll_fd.events = POLLIN;
+		if (ppoll(&poll_fd, 1, &timeout, nullptr) > 0)
+		{
+			return;
+		}
+
+		const uint64_t cost_begin = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+		AdaptiveSample *slot   = _samples.write_slot();
+		AdaptiveSample &sample = slot != nullptr ? *slot : _scratch;
+		take_sample(sample);
+
+		const uint64_t interval = _controller.update(_rates.data(), clock_ns(CLOCK_THREAD_CPUTIME_ID) - cost_begin);
+		sample.interval_ns      = interval;
+		sample.variation        = _controller.variation();
+
+		if (slot != nullptr)
+		{
+			_samples.push();
+		}
+		else
+		{
+			_dropped_samples++;
+		}
+		_interval_ns = interval;
+
+		// Don't try to catch up after a late sample, only keep the spacing
+		next_ns = std::max(next_ns + interval, sample.end_ns);
+	}
+}
+
+void AdaptiveSampler::take_sample(AdaptiveSample &sample)
+{
+	sample.begin_ns = _previous_ns;
+	sample.end_ns   = clock_ns(CLOCK_MONOTONIC);
+	_previous_ns    = sample.end_ns;
+
+	const double timespan = static_cast<double>(std::max<uint64_t>(sample.end_ns - sample.begin_ns, 1));
+	size_t       signal   = 0;
+
+	for (; signal < _config.watched.size(); ++signal)
+	{
+		_rates[signal] = 0.0;
+	}
+
+	if (_pmu != nullptr)
+	{
+		_pmu->sample(_current_cpu);
+		sample.cpu = _current_cpu - _previous_cpu;
+		std::swap(_previous_cpu, _current_cpu);
+
+		if (_config.watch_cpu)
+		{
+			_rates[signal++] = sample.cpu.cycles / timespan;
+			_rates[signal++] = sample.cpu.instructions / timespan;
+		}
+	}
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		try
+		{
+			_mali->request_dump();
+			MaliSampleView dump = _mali->next_dump();
+
+			for (size_t i = 0; i < _dump.size() && i < dump.size(); ++i)
+			{
+				_dump[i] = dump.counters()[i];
+			}
+			const uint64_t timestamp = dump.timestamp();
+			dump.release();
+
+			const uint64_t dump_timespan = std::max<uint64_t>(timestamp - _last_dump_ns, 1);
+			_mali->decode(_dump.data(), dump_timespan, sample.gpu);
+			_last_dump_ns = timestamp;
+
+			for (size_t i = 0; i < _config.watched.size(); ++i)
+			{
+				if (_watched_ids[i] == unresolved && !sample.gpu.find(_config.watched[i], _watched_ids[i]))
+				{
+					continue;
+				}
+
+				const Measurement::Value &value = sample.gpu.value(_watched_ids[i]);
+				_rates[i]                       = (value.is_floating_point ? value.v.floating_point : static_cast<double>(value.v.integer)) / dump_timespan;
+			}
+		}
+		catch (const std::runtime_error &error)
+		{
+			HWCPIPE_LOG("Failed to sample the GPU counters: %s", error.what());
+			sample.gpu.clear();
+		}
+	}
+#endif
+}
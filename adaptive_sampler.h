@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurements_snapshot.h"
+#include "pmu_counter.h"
+#include "ring_buffer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MaliCounter;
+
+/** Configuration of an @ref AdaptiveSampler. */
+struct AdaptiveSamplerConfig
+{
+	uint64_t                 min_interval_ns{1000000};                                      /**< Shortest interval, used while the counters change quickly. */
+	uint64_t                 max_interval_ns{100000000};                                    /**< Longest interval, used while the counters are stable. */
+	uint64_t                 initial_interval_ns{10000000};                                 /**< Interval of the first samples. */
+	size_t                   window{8};                                                     /**< Number of recent samples the variation is measured over. */
+	double                   fast_threshold{20.0};                                          /**< Relative standard deviation (%) above which the interval is halved. */
+	double                   stable_threshold{5.0};                                         /**< Relative standard deviation (%) below which the interval grows. */
+	double                   growth{1.25};                                                  /**< Factor the interval grows by at each stable sample. */
+	double                   overhead_budget{0.01};                                         /**< Fraction of a CPU the sampling thread may use, 0 for no limit. */
+	std::vector<std::string> watched{"GPU cycles", "L2 cache external read stalls"};        /**< GPU measurements whose rate drives the interval. */
+	bool                     watch_cpu{true};                                               /**< Also drive the interval with the CPU cycles and instructions. */
+};
+
+/** Choose the sampling interval from the variation of the counter rates.
+ *
+ * The rate of each watched counter, in events per nanosecond, is kept over a
+ * window of recent samples. While the largest relative standard deviation is
+ * above the fast threshold the interval is halved, to catch short bursts;
+ * while it is below the stable threshold the interval grows slowly, so idle
+ * or steady periods produce few samples. The interval is then lengthened if
+ * needed so that the measured cost of a sample stays within the overhead
+ * budget, which takes precedence over the maximum interval.
+ */
+class SamplingRateController
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] config  Interval bounds, thresholds and budget.
+	 * @param[in] signals Number of rates passed to @ref update.
+	 */
+	SamplingRateController(const AdaptiveSamplerConfig &config, size_t signals);
+
+	/** Forget the previous rates and go back to the initial interval. */
+	void reset();
+
+	/** Add the rates of a sample and choose the next interval.
+	 *
+	 * @param[in] rates   One rate per signal.
+	 * @param[in] cost_ns CPU time spent taking the sample, in nanoseconds.
+	 *
+	 * @return the interval until the next sample, in nanoseconds.
+	 */
+	uint64_t update(const double *rates, uint64_t cost_ns);
+
+	/** Current interval.
+	 *
+	 * @return the interval until the next sample, in nanoseconds.
+	 */
+	uint64_t interval_ns() const
+	{
+		return _interval_ns;
+	}
+
+	/** Variation of the last window.
+	 *
+	 * @return the largest relative standard deviation of the signals, as a percentage.
+	 */
+	double variation() const
+	{
+		return _variation;
+	}
+
+	/** Estimated sampling overhead.
+	 *
+	 * @return the average cost of a sample divided by the current interval.
+	 */
+	double overhead() const
+	{
+		return _interval_ns > 0 ? _cost_ns / _interval_ns : 0.0;
+	}
+
+  private:
+	uint64_t            _min_interval_ns;
+	uint64_t            _max_interval_ns;
+	uint64_t            _initial_interval_ns;
+	size_t              _window;
+	double              _fast_threshold;
+	double              _stable_threshold;
+	double              _growth;
+	double              _overhead_budget;
+	size_t              _signals;
+	std::vector<double> _rates;       /**< Last @ref _window rates of each signal, signal by signal. */
+	size_t              _count{0};    /**< Number of samples added since reset. */
+	uint64_t            _interval_ns; /**< Current interval. */
+	double              _variation{0.0};
+	double              _cost_ns{0.0}; /**< Moving average of the cost of a sample. */
+};
+
+/** Counters of one adaptive sample. */
+struct AdaptiveSample
+{
+	uint64_t             begin_ns{0};    /**< Previous sample, on CLOCK_MONOTONIC. */
+	uint64_t             end_ns{0};      /**< This sample, on CLOCK_MONOTONIC. */
+	uint64_t             interval_ns{0}; /**< Interval chosen for the next sample. */
+	double               variation{0.0}; /**< Variation that chose the interval, as a percentage. */
+	PMUCounterValues     cpu{};          /**< CPU events since the previous sample. */
+	MeasurementsSnapshot gpu{};          /**< GPU measurements since the previous sample, empty without a Mali counter. */
+};
+
+/** Sample the counters on a background thread at a rate that follows their variation.
+ *
+ * The thread dumps the Mali counters and reads the PMU counters, hands the
+ * sample to @ref SamplingRateController, then sleeps for the interval it
+ * chose. Samples are pushed into a lock-free ring buffer which the
+ * application drains with @ref pop_sample. Compared to the fixed rate of
+ * MaliCounter::start_streaming, bursts are sampled finely while long stable
+ * periods only produce a few samples, keeping the trace volume and the
+ * overhead bounded.
+ *
+ * The PMU counters are read from the background thread, so they should count
+ * in PerThread or PerCPU mode. The Mali counter must not have a top up
+ * interval, as the sampler takes the dumps itself.
+ */
+class AdaptiveSampler
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] pmu           CPU counters, or nullptr.
+	 * @param[in] mali          GPU counters, or nullptr. They can't be used by the application while sampling.
+	 * @param[in] config        Interval bounds, thresholds and budget.
+	 * @param[in] ring_capacity (Optional) Number of samples the ring can hold, rounded up to a power of two.
+	 */
+	AdaptiveSampler(PMUCounter *pmu, MaliCounter *mali, const AdaptiveSamplerConfig &config = AdaptiveSamplerConfig(), size_t ring_capacity = 256);
+
+	/** Default destructor, stops sampling. */
+	~AdaptiveSampler();
+
+	/** Prevent instances of this class from being copy constructed */
+	AdaptiveSampler(const AdaptiveSampler &) = delete;
+	/** Prevent instances of this class from being copied */
+	AdaptiveSampler &operator=(const AdaptiveSampler &) = delete;
+
+	/** Start the counters and the background thread. */
+	void start();
+
+	/** Stop the background thread, then the counters. */
+	void stop();
+
+	/** Take the oldest sample.
+	 *
+	 * The storage of @p sample is exchanged with the ring's slot, so a caller
+	 * that keeps reusing the same sample doesn't allocate.
+	 *
+	 * @param[out] sample The sample.
+	 *
+	 * @return false if no sample is available.
+	 */
+	bool pop_sample(AdaptiveSample &sample);
+
+	/** Number of samples discarded because the ring was full.
+	 *
+	 * @return the number of dropped samples since start.
+	 */
+	uint64_t dropped_samples() const
+	{
+		return _dropped_samples;
+	}
+
+	/** Current interval, for display.
+	 *
+	 * @return the interval until the next sample, in nanoseconds.
+	 */
+	uint64_t interval_ns() const
+	{
+		return _interval_ns;
+	}
+
+  private:
+	void worker_loop();
+	void take_sample(AdaptiveSample &sample);
+
+	PMUCounter *           _pmu;
+	MaliCounter *          _mali;
+	AdaptiveSamplerConfig  _config;
+	SamplingRateController _controller;
+
+	SPSCRingBuffer<AdaptiveSample> _samples;
+	std::thread                    _worker{};
+	int                            _stop_pipe[2]{-1, -1};
+	std::atomic<bool>              _running{false};
+	std::atomic<uint64_t>          _dropped_samples{0};
+	std::atomic<uint64_t>          _interval_ns{0};
+
+	uint64_t                              _previous_ns{0};
+	PMUCounterValues                      _previous_cpu{};
+	PMUCounterValues                      _current_cpu{};
+	uint64_t                              _last_dump_ns{0};
+	std::vector<uint64_t>                 _dump{};        /**< Mali dump widened to 64-bit for decoding. */
+	std::vector<MeasurementsSnapshot::Id> _watched_ids{}; /**< Index of each watched measurement, resolved on the first dump. */
+	std::vector<double>                   _rates{};
+	AdaptiveSample                        _scratch{}; /**< Sample taken when the ring is full. */
+};
@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Measure the cost of sampling counters with HWCPipe on a device.
+ *
+ * For each call, reports the latency distribution, the syscalls made and the
+ * heap allocations done, then measures how much counting perturbs the cycles
+ * of a workload. Usage: hwcpipe_bench [iterations]
+ */
+
+#include "instruments_stats.h"
+#include "pmu.h"
+#include "pmu_counter.h"
+
+#if defined(__ANDROID__)
+#	include "mali_counter.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace
+{
+std::atomic<uint64_t> allocation_count{0};
+}        // namespace
+
+void *operator new(size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+	if (void *ptr = malloc(size > 0 ? size : 1))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+namespace
+{
+uint64_t monotonic_time_ns()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+/** Count the syscalls of the calling thread with the raw_syscalls:sys_enter tracepoint */
+class SyscallCounter
+{
+  public:
+	SyscallCounter()
+	{
+		const char *const paths[] = {
+		    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+		};
+
+		for (const char *path : paths)
+		{
+			std::ifstream file(path);
+			uint64_t      id = 0;
+			if (file >> id)
+			{
+				_pmu.set_event_type(PERF_TYPE_TRACEPOINT);
+				_pmu.open(id);
+				break;
+			}
+		}
+	}
+
+	bool available() const
+	{
+		return _pmu.is_open();
+	}
+
+	uint64_t value() const
+	{
+		return _pmu.is_open() ? _pmu.get_value<uint64_t>() : 0;
+	}
+
+  private:
+	PMU _pmu{};
+};
+
+struct BenchResult
+{
+	std::string name{};
+	OnlineStats latency_ns{};
+	uint64_t    calls{0};
+	uint64_t    syscalls{0};
+	uint64_t    allocations{0};
+};
+
+/** Time @p call, after an untimed @p setup, for each iteration */
+template <typename Setup, typename Call>
+BenchResult run(const char *name, size_t iterations, const SyscallCounter &syscalls, Setup setup, Call call)
+{
+	BenchResult result;
+	result.name = name;
+
+	// Warm the caches and let the instruments allocate their buffers
+	for (size_t i = 0; i < 10; ++i)
+	{
+		setup();
+		call();
+	}
+
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		setup();
+
+		const uint64_t syscalls_before    = syscalls.value();
+		const uint64_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+		const uint64_t begin              = monotonic_time_ns();
+		call();
+		const uint64_t end                = monotonic_time_ns();
+		const uint64_t allocations_after  = allocation_count.load(std::memory_order_relaxed);
+		const uint64_t syscalls_after     = syscalls.value();
+
+		result.latency_ns.add(static_cast<double>(end - begin));
+		result.allocations += allocations_after - allocations_before;
+		// The second read of the syscall counter counts itself
+		result.syscalls += syscalls_after - syscalls_before - (syscalls.available() ? 1 : 0);
+		result.calls++;
+	}
+
+	return result;
+}
+
+template <typename Call>
+BenchResult run(const char *name, size_t iterations, const SyscallCounter &syscalls, Call call)
+{
+	return run(name, iterations, syscalls, [] {}, call);
+}
+
+void print_header(bool syscalls_available)
+{
+	printf("%-32s %10s %10s %10s %10s %10s\n", "Call", "p50 ns", "p99 ns", "mean ns", "syscalls", "allocs");
+	if (!syscalls_available)
+	{
+		printf("(raw_syscalls tracepoint unavailable, syscalls aren't counted)\n");
+	}
+}
+
+void print(const BenchResult &result)
+{
+	printf("%-32s %10.0f %10.0f %10.0f %10.2f %10.2f\n", result.name.c_str(), result.latency_ns.median(), result.latency_ns.p99(),
+	       result.latency_ns.mean(), static_cast<double>(result.syscalls) / result.calls,
+	       static_cast<double>(result.allocations) / result.calls);
+}
+
+/** Workload whose cycles are compared with the counters on and off: strided reads and arithmetic over 4MB */
+uint64_t workload(std::vector<uint32_t> &buffer)
+{
+	uint64_t checksum = 0;
+	for (size_t stride = 1; stride <= 16; stride *= 2)
+	{
+		for (size_t i = 0; i < buffer.size(); i += stride)
+		{
+			checksum = checksum * 31 + buffer[i];
+			buffer[i] ^= static_cast<uint32_t>(checksum);
+		}
+	}
+	return checksum;
+}
+
+/** Cost of a workload, in cycles if the PMU is available, otherwise in nanoseconds */
+class WorkloadMeter
+{
+  public:
+	WorkloadMeter() :
+	    _cycles(PERF_COUNT_HW_CPU_CYCLES)
+	{
+	}
+
+	const char *unit() const
+	{
+		return _cycles.is_open() ? "cycles" : "ns";
+	}
+
+	uint64_t now() const
+	{
+		return _cycles.is_open() ? _cycles.get_value<uint64_t>() : monotonic_time_ns();
+	}
+
+  private:
+	PMU _cycles;
+};
+
+volatile uint64_t workload_sink = 0;
+}        // namespace
+
+int main(int argc, char *argv[])
+{
+	const size_t iterations = argc > 1 ? std::max(1, atoi(argv[1])) : 1000;
+
+	const SyscallCounter     syscalls;
+	std::vector<BenchResult> results;
+
+	// The counters count from construction, they must be gone before the perturbation runs
+	{
+		PMUCounter pmu;
+		results.push_back(run("PMUCounter::start", iterations, syscalls, [&] { pmu.start(); }));
+		results.push_back(run("PMUCounter::stop", iterations, syscalls, [&] { pmu.start(); }, [&] { pmu.stop(); }));
+
+		PMUCounterValues values;
+		results.push_back(run("PMUCounter::sample", iterations, syscalls, [&] { pmu.sample(values); }));
+		results.push_back(run("PMUCounter::measurements", iterations, syscalls, [&] { pmu.measurements(); }));
+
+		MeasurementsSnapshot pmu_snapshot;
+		results.push_back(run("PMUCounter::snapshot", iterations, syscalls, [&] { pmu.snapshot(pmu_snapshot); }));
+	}
+
+	// Thread mode reads the counters from userspace when the kernel allows it, the syscalls column shows whether it does
+	{
+		PMUCounter       pmu(PMUCounterMode::Thread);
+		PMUCounterValues values;
+		results.push_back(run("PMUCounter::sample (Thread)", iterations, syscalls, [&] { pmu.sample(values); }));
+	}
+
+#if defined(__ANDROID__)
+	try
+	{
+		MaliCounter mali;
+		results.push_back(run("MaliCounter::start", iterations, syscalls, [&] { mali.start(); }));
+		results.push_back(run("MaliCounter::stop", iterations, syscalls, [&] { mali.start(); }, [&] { mali.stop(); }));
+		results.push_back(run("MaliCounter::measurements", iterations, syscalls, [&] { mali.measurements(); }));
+
+		MeasurementsSnapshot mali_snapshot;
+		results.push_back(run("MaliCounter::snapshot", iterations, syscalls, [&] { mali.snapshot(mali_snapshot); }));
+	}
+	catch (const std::runtime_error &error)
+	{
+		printf("Skipping the Mali counters: %s\n", error.what());
+	}
+#endif
+
+	std::vector<Measurement> measurements;
+	for (int i = 0; i < 100; ++i)
+	{
+		measurements.emplace_back(static_cast<long long>(1000 + (i * 37) % 101), "ns");
+	}
+	results.push_back(run("InstrumentsStats (100 values)", iterations, syscalls, [&] { InstrumentsStats stats(measurements); }));
+
+	OnlineStats online_stats;
+	results.push_back(run("OnlineStats::add", iterations, syscalls, [&] { online_stats.add(1000.0); }));
+
+	print_header(syscalls.available());
+	for (const auto &result : results)
+	{
+		print(result);
+	}
+
+	// Perturbation: cost of the same workload without counters and while they count
+	std::vector<uint32_t> buffer(1 << 20, 1);
+	const WorkloadMeter   meter;
+	OnlineStats           off;
+	OnlineStats           on;
+
+	const size_t runs = std::max<size_t>(iterations / 10, 10);
+	for (size_t i = 0; i < runs; ++i)
+	{
+		// Alternate the runs so that frequency changes affect both sides alike
+		uint64_t begin = meter.now();
+		workload_sink  = workload(buffer);
+		off.add(static_cast<double>(meter.now() - begin));
+
+		// perf events count and the Mali reader is set up from construction to
+		// destruction, so the instruments only exist around the "on" runs
+		PMUCounter pmu;
+#if defined(__ANDROID__)
+		std::unique_ptr<MaliCounter> mali;
+		try
+		{
+			mali.reset(new MaliCounter());
+		}
+		catch (const std::runtime_error &)
+		{
+		}
+#endif
+
+		pmu.start();
+#if defined(__ANDROID__)
+		if (mali)
+		{
+			mali->start();
+		}
+#endif
+		begin         = meter.now();
+		workload_sink = workload(buffer);
+		on.add(static_cast<double>(meter.now() - begin));
+#if defined(__ANDROID__)
+		if (mali)
+		{
+			mali->stop();
+		}
+#endif
+		pmu.stop();
+	}
+
+	printf("\nWorkload %s, counters off: p50 %.0f, p99 %.0f\n", meter.unit(), off.median(), off.p99());
+	printf("Workload %s, counters on:  p50 %.0f, p99 %.0f\n", meter.unit(), on.median(), on.p99());
+	printf("Perturbation: %+.2f%%\n", off.median() > 0 ? (on.median() - off.median()) * 100.0 / off.median() : 0.0);
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "cpu_info.h"
+
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace
+{
+constexpr uint32_t implementer_arm = 0x41;
+
+struct CPUPartName
+{
+	uint32_t    implementer;
+	uint32_t    part;
+	const char *name;
+};
+
+const CPUPartName cpu_part_names[] = {
+    {implementer_arm, 0xc07, "Cortex-A7"},
+    {implementer_arm, 0xc0d, "Cortex-A12"},
+    {implementer_arm, 0xc0e, "Cortex-A17"},
+    {implementer_arm, 0xc0f, "Cortex-A15"},
+    {implementer_arm, 0xd03, "Cortex-A53"},
+    {implementer_arm, 0xd04, "Cortex-A35"},
+    {implementer_arm, 0xd05, "Cortex-A55"},
+    {implementer_arm, 0xd07, "Cortex-A57"},
+    {implementer_arm, 0xd08, "Cortex-A72"},
+    {implementer_arm, 0xd09, "Cortex-A73"},
+    {implementer_arm, 0xd0a, "Cortex-A75"},
+    {implementer_arm, 0xd0b, "Cortex-A76"},
+    {implementer_arm, 0xd0d, "Cortex-A77"},
+    {implementer_arm, 0xd41, "Cortex-A78"},
+    {implementer_arm, 0xd44, "Cortex-X1"},
+    {implementer_arm, 0xd46, "Cortex-A510"},
+    {implementer_arm, 0xd47, "Cortex-A710"},
+    {implementer_arm, 0xd48, "Cortex-X2"},
+};
+
+/** Parse a kernel CPU list such as "0-3,6" */
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+	std::vector<int>  cpus;
+	std::stringstream stream(list);
+	std::string       range;
+
+	while (std::getline(stream, range, ','))
+	{
+		const size_t dash  = range.find('-');
+		const int    first = std::stoi(range.substr(0, dash));
+		const int    last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+		for (int cpu = first; cpu <= last; ++cpu)
+		{
+			cpus.push_back(cpu);
+		}
+	}
+
+	return cpus;
+}
+
+std::vector<int> get_online_cpus()
+{
+	std::ifstream file("/sys/devices/system/cpu/online");
+	std::string   list;
+
+	if (std::getline(file, list) && !list.empty())
+	{
+		try
+		{
+			return parse_cpu_list(list);
+		}
+		catch (const std::exception &)
+		{
+		}
+	}
+
+	std::vector<int> cpus;
+	const long       count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int cpu = 0; cpu < count; ++cpu)
+	{
+		cpus.push_back(cpu);
+	}
+
+	return cpus;
+}
+
+/** Read the implementer and part of each CPU from /proc/cpuinfo */
+std::map<int, std::pair<uint32_t, uint32_t>> read_cpu_parts()
+{
+	std::map<int, std::pair<uint32_t, uint32_t>> parts;
+	std::ifstream                                file("/proc/cpuinfo");
+	std::string                                  line;
+	int                                          processor = -1;
+
+	while (std::getline(file, line))
+	{
+		const size_t colon = line.find(':');
+		if (colon == std::string::npos)
+		{
+			continue;
+		}
+
+		const std::string key   = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+		const std::string value = line.substr(colon + 1);
+
+		try
+		{
+			if (key == "processor")
+			{
+				processor = std::stoi(value);
+			}
+			else if (key == "CPU implementer" && processor >= 0)
+			{
+				parts[processor].first = static_cast<uint32_t>(std::stoul(value, nullptr, 16));
+			}
+			else if (key == "CPU part" && processor >= 0)
+			{
+				parts[processor].second = static_cast<uint32_t>(std::stoul(value, nullptr, 16));
+			}
+		}
+		catch (const std::exception &)
+		{
+		}
+	}
+
+	return parts;
+}
+}        // namespace
+
+const char *cpu_part_name(uint32_t implementer, uint32_t part)
+{
+	for (const auto &entry : cpu_part_names)
+	{
+		if (entry.implementer == implementer && entry.part == part)
+		{
+			return entry.name;
+		}
+	}
+
+	return nullptr;
+}
+
+std::vector<CPUInfo> get_cpu_info()
+{
+	const auto           parts = read_cpu_parts();
+	std::vector<CPUInfo> cpus;
+
+	for (const int cpu : get_online_cpus())
+	{
+		CPUInfo info;
+		info.id = cpu;
+
+		const auto part = parts.find(cpu);
+		if (part != parts.end())
+		{
+			info.implementer = part->second.first;
+			info.part        = part->second.second;
+		}
+
+		const char *name = cpu_part_name(info.implementer, info.part);
+		if (name != nullptr)
+		{
+			info.name = name;
+		}
+		else if (info.part != 0)
+		{
+			// Keep unknown parts apart so their cluster can still be told apart
+			std::stringstream stream;
+			stream << "CPU part 0x" << std::hex << info.part;
+			info.name = stream.str();
+		}
+		else
+		{
+			info.name = "CPU";
+		}
+
+		cpus.push_back(info);
+	}
+
+	return cpus;
+}
+
+std::vector<ThreadInfo> get_threads()
+{
+	std::vector<ThreadInfo> threads;
+
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == nullptr)
+	{
+		return threads;
+	}
+
+	while (const dirent *entry = readdir(dir))
+	{
+		ThreadInfo thread;
+		thread.tid = static_cast<pid_t>(atoi(entry->d_name));
+		if (thread.tid <= 0)
+		{
+			continue;
+		}
+
+		std::ifstream file(std::string("/proc/self/task/") + entry->d_name + "/comm");
+		std::getline(file, thread.name);
+
+		threads.push_back(thread);
+	}
+
+	closedir(dir);
+	return threads;
+}
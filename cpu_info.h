@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/** Description of a CPU core, as reported by the kernel. */
+struct CPUInfo
+{
+	int         id{-1};          /**< Logical CPU number, as passed to perf_event_open. */
+	uint32_t    implementer{0};  /**< MIDR implementer code, 0 if unknown. */
+	uint32_t    part{0};         /**< MIDR part number, 0 if unknown. */
+	std::string name{};          /**< Core name, e.g. "Cortex-A55", or "CPU" if unknown. */
+};
+
+/** Get the name of a CPU core from its MIDR implementer and part numbers.
+ *
+ * @param[in] implementer MIDR implementer code.
+ * @param[in] part        MIDR part number.
+ *
+ * @return the core name, or nullptr if the part is unknown.
+ */
+const char *cpu_part_name(uint32_t implementer, uint32_t part);
+
+/** Get the online CPU cores of the system.
+ *
+ * Cores of a big.LITTLE system report different parts, so grouping cores by
+ * name gives the clusters.
+ *
+ * @return the online cores, sorted by logical CPU number.
+ */
+std::vector<CPUInfo> get_cpu_info();
+
+/** Description of a thread of the calling process. */
+struct ThreadInfo
+{
+	pid_t       tid{0};  /**< Thread id, as passed to perf_event_open. */
+	std::string name{}; /**< Thread name, from /proc/self/task/<tid>/comm. */
+};
+
+/** Get the threads of the calling process.
+ *
+ * @return the threads running when called, empty if /proc/self/task can't be read.
+ */
+std::vector<ThreadInfo> get_threads();
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "dvfs.h"
+
+#include "cpu_info.h"
+#include "pmu.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace
+{
+/** Names of the entries of a directory, sorted, without "." and ".." */
+std::vector<std::string> list_directory(const std::string &path)
+{
+	std::vector<std::string> names;
+
+	DIR *dir = opendir(path.c_str());
+	if (dir == nullptr)
+	{
+		return names;
+	}
+
+	while (const dirent *entry = readdir(dir))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			names.push_back(entry->d_name);
+		}
+	}
+
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+bool file_exists(const std::string &path)
+{
+	return access(path.c_str(), F_OK) == 0;
+}
+
+/** Find the current frequency file of the GPU devfreq device */
+std::string find_gpu_frequency_file()
+{
+	// The devfreq device of the GPU hangs off the kbase device
+	const std::string mali = "/sys/class/misc/mali0/device/devfreq/";
+	for (const auto &name : list_directory(mali))
+	{
+		if (file_exists(mali + name + "/cur_freq"))
+		{
+			return mali + name + "/cur_freq";
+		}
+	}
+
+	// Otherwise look for a devfreq device named after the GPU, e.g. "13000000.mali"
+	const std::string devfreq = "/sys/class/devfreq/";
+	for (const auto &name : list_directory(devfreq))
+	{
+		if ((name.find("mali") != std::string::npos || name.find("gpu") != std::string::npos) && file_exists(devfreq + name + "/cur_freq"))
+		{
+			return devfreq + name + "/cur_freq";
+		}
+	}
+
+	return std::string();
+}
+
+/** Parse a space separated CPU list, e.g. the related_cpus of a cpufreq policy */
+std::vector<int> read_cpus(const std::string &path)
+{
+	std::ifstream    file(path);
+	std::vector<int> cpus;
+	int              cpu;
+
+	while (file >> cpu)
+	{
+		cpus.push_back(cpu);
+	}
+
+	return cpus;
+}
+}        // namespace
+
+DVFSMonitor::DVFSMonitor()
+{
+	const std::string gpu = find_gpu_frequency_file();
+	if (!gpu.empty())
+	{
+		FrequencyDomain domain;
+		domain.name   = "GPU";
+		domain.path   = gpu;
+		domain.is_gpu = true;
+		add_domain(std::move(domain), 1);
+	}
+
+	// One cpufreq policy per cluster, named after its cores
+	std::map<int, std::string> core_names;
+	for (const auto &info : get_cpu_info())
+	{
+		core_names[info.id] = info.name;
+	}
+
+	std::vector<std::pair<int, std::string>> policies;
+	const std::string                        cpufreq = "/sys/devices/system/cpu/cpufreq/";
+	for (const auto &name : list_directory(cpufreq))
+	{
+		if (name.compare(0, 6, "policy") == 0)
+		{
+			policies.emplace_back(atoi(name.c_str() + 6), cpufreq + name + "/");
+		}
+	}
+	std::sort(policies.begin(), policies.end());
+
+	std::map<std::string, int> name_count;
+	for (const auto &policy : policies)
+	{
+		FrequencyDomain domain;
+		domain.path = policy.second + "scaling_cur_freq";
+		domain.cpus = read_cpus(policy.second + "related_cpus");
+		if (domain.cpus.empty())
+		{
+			domain.cpus.push_back(policy.first);
+		}
+
+		const auto core = core_names.find(domain.cpus.front());
+		domain.name     = (core != core_names.end() ? core->second : std::string("CPU")) + " cluster";
+
+		// Clusters of the same cores, e.g. a prime core, are told apart by their first CPU
+		if (name_count[domain.name]++ > 0)
+		{
+			domain.name += " " + std::to_string(domain.cpus.front());
+		}
+
+		add_domain(std::move(domain), 1000);
+	}
+}
+
+DVFSMonitor::~DVFSMonitor()
+{
+	for (const int fd : _fds)
+	{
+		close(fd);
+	}
+}
+
+void DVFSMonitor::add_domain(FrequencyDomain domain, uint64_t hz_per_unit)
+{
+	const int fd = open(domain.path.c_str(), O_RDONLY | O_CLOEXEC);        // NOLINT
+	if (fd < 0)
+	{
+		HWCPIPE_LOG("Can't read the frequency of %s from %s.", domain.name.c_str(), domain.path.c_str());
+		return;
+	}
+
+	_domains.push_back(std::move(domain));
+	_fds.push_back(fd);
+	_hz_per_unit.push_back(hz_per_unit);
+	_power_models.emplace_back();
+}
+
+int DVFSMonitor::gpu_domain() const
+{
+	for (size_t i = 0; i < _domains.size(); ++i)
+	{
+		if (_domains[i].is_gpu)
+		{
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+int DVFSMonitor::cpu_domain(int cpu) const
+{
+	for (size_t i = 0; i < _domains.size(); ++i)
+	{
+		if (std::find(_domains[i].cpus.begin(), _domains[i].cpus.end(), cpu) != _domains[i].cpus.end())
+		{
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+void DVFSMonitor::read(std::vector<uint64_t> &frequencies_hz) const
+{
+	frequencies_hz.resize(_fds.size());
+
+	for (size_t i = 0; i < _fds.size(); ++i)
+	{
+		// sysfs regenerates the file on each read from offset 0, no need to reopen or seek it
+		char          buffer[32];
+		const ssize_t size = pread(_fds[i], buffer, sizeof(buffer) - 1, 0);
+
+		frequencies_hz[i] = 0;
+		if (size > 0)
+		{
+			buffer[size]      = '\0';
+			frequencies_hz[i] = strtoull(buffer, nullptr, 10) * _hz_per_unit[i];
+		}
+	}
+}
+
+void DVFSMonitor::set_power_model(size_t domain, std::vector<OperatingPoint> points)
+{
+	std::sort(points.begin(), points.end(), [](const OperatingPoint &a, const OperatingPoint &b) {
+		return a.frequency_hz < b.frequency_hz;
+	});
+	_power_models.at(domain) = std::move(points);
+}
+
+bool DVFSMonitor::has_power_model(size_t domain) const
+{
+	return !_power_models.at(domain).empty();
+}
+
+double DVFSMonitor::power_mw(size_t domain, uint64_t frequency_hz) const
+{
+	const std::vector<OperatingPoint> &points = _power_models.at(domain);
+
+	if (points.empty())
+	{
+		return 0.0;
+	}
+
+	const auto above = std::lower_bound(points.begin(), points.end(), frequency_hz, [](const OperatingPoint &point, uint64_t frequency) {
+		return point.frequency_hz < frequency;
+	});
+
+	if (above == points.begin())
+	{
+		return points.front().power_mw;
+	}
+	if (above == points.end())
+	{
+		return points.back().power_mw;
+	}
+
+	const auto   below = above - 1;
+	const double t     = static_cast<double>(frequency_hz - below->frequency_hz) / static_cast<double>(above->frequency_hz - below->frequency_hz);
+	return below->power_mw + t * (above->power_mw - below->power_mw);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Clock domain whose frequency is scaled by the kernel. */
+struct FrequencyDomain
+{
+	std::string      name{};        /**< "GPU", or the name of the CPU cluster, e.g. "Cortex-A55 cluster". */
+	std::string      path{};        /**< sysfs file holding the current frequency. */
+	std::vector<int> cpus{};        /**< CPUs of the cluster, empty for the GPU. */
+	bool             is_gpu{false}; /**< Is this the clock of the GPU ? */
+};
+
+/** Power drawn by a busy domain at one of its frequencies. */
+struct OperatingPoint
+{
+	uint64_t frequency_hz; /**< Frequency of the operating point, in Hz. */
+	double   power_mw;     /**< Power drawn while busy at that frequency, in mW. */
+};
+
+/** Current frequencies of the GPU and of the CPU clusters, read from devfreq and cpufreq.
+ *
+ * The sysfs files are opened once, when the monitor is constructed, and
+ * each read is a single pread() per domain, so the frequencies can be read
+ * with every sample without walking sysfs again.
+ *
+ * Energy is estimated from a power model: the power of each domain at its
+ * operating points, e.g. from the energy model of the device. Without one,
+ * only the frequencies and busy times are known.
+ */
+class DVFSMonitor
+{
+  public:
+	/** Find the GPU devfreq device and the cpufreq policies.
+	 *
+	 * Domains whose frequency can't be read are logged and left out.
+	 */
+	DVFSMonitor();
+
+	/** Close the sysfs files. */
+	~DVFSMonitor();
+
+	/** Prevent instances of this class from being copy constructed */
+	DVFSMonitor(const DVFSMonitor &) = delete;
+	/** Prevent instances of this class from being copied */
+	DVFSMonitor &operator=(const DVFSMonitor &) = delete;
+
+	/** Get the domains found.
+	 *
+	 * @return the domains, GPU first if found, then the CPU clusters by first CPU.
+	 */
+	const std::vector<FrequencyDomain> &domains() const
+	{
+		return _domains;
+	}
+
+	/** Get the domain of the GPU.
+	 *
+	 * @return the index of the GPU domain, or -1 if the GPU has no devfreq device.
+	 */
+	int gpu_domain() const;
+
+	/** Get the domain of a CPU.
+	 *
+	 * @param[in] cpu Logical CPU number.
+	 *
+	 * @return the index of the cluster of @p cpu, or -1 if its frequency isn't known.
+	 */
+	int cpu_domain(int cpu) const;
+
+	/** Read the current frequency of every domain.
+	 *
+	 * Doesn't allocate once @p frequencies_hz has one entry per domain.
+	 *
+	 * @param[out] frequencies_hz Frequency of each domain, in Hz, 0 if it couldn't be read.
+	 */
+	void read(std::vector<uint64_t> &frequencies_hz) const;
+
+	/** Set the power model of a domain.
+	 *
+	 * @param[in] domain Index of the domain.
+	 * @param[in] points Operating points of the domain, in any order.
+	 */
+	void set_power_model(size_t domain, std::vector<OperatingPoint> points);
+
+	/** Check whether a domain has a power model.
+	 *
+	 * @param[in] domain Index of the domain.
+	 *
+	 * @return true if @ref set_power_model was called for @p domain.
+	 */
+	bool has_power_model(size_t domain) const;
+
+	/** Power drawn by a busy domain.
+	 *
+	 * Interpolated linearly between the operating points around @p frequency_hz,
+	 * and clamped to the lowest and highest ones.
+	 *
+	 * @param[in] domain       Index of the domain.
+	 * @param[in] frequency_hz Frequency of the domain, in Hz.
+	 *
+	 * @return the power, in mW, 0 without a power model.
+	 */
+	double power_mw(size_t domain, uint64_t frequency_hz) const;
+
+  private:
+	void add_domain(FrequencyDomain domain, uint64_t hz_per_unit);
+
+	std::vector<FrequencyDomain>             _domains{};
+	std::vector<int>                         _fds{};          /**< Open frequency file of each domain. */
+	std::vector<uint64_t>                    _hz_per_unit{};  /**< Unit of each frequency file: devfreq reports Hz, cpufreq kHz. */
+	std::vector<std::vector<OperatingPoint>> _power_models{}; /**< Operating points of each domain, by frequency. */
+};
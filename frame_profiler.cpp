@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "frame_profiler.h"
+
+#if defined(__ANDROID__)
+#	include "mali_counter.h"
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <time.h>
+
+namespace
+{
+uint64_t monotonic_time_ns()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+}        // namespace
+
+FrameProfiler::FrameProfiler(PMUCounter *pmu, MaliCounter *mali, uint64_t coalesce_ns) :
+    _pmu(pmu),
+    _mali(mali),
+    _coalesce_ns(coalesce_ns)
+{
+}
+
+void FrameProfiler::begin_frame()
+{
+	if (_in_frame)
+	{
+		throw std::runtime_error("Frame already begun.");
+	}
+
+	_in_frame        = true;
+	_region_count    = 0;
+	_boundary_count  = 0;
+	_dumps_requested = 0;
+	_dumps_collected = 0;
+
+	if (_pmu != nullptr)
+	{
+		_pmu->start();
+	}
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		// Dump 0 clears the counts of the previous frame, the frame is measured from here
+		_mali->request_dump();
+		_dumps_requested = 1;
+		_last_dump_ns    = monotonic_time_ns();
+	}
+#endif
+
+	begin_region("Frame");
+}
+
+void FrameProfiler::begin_region(const char *name)
+{
+	if (!_in_frame)
+	{
+		throw std::runtime_error("Regions must be inside a frame.");
+	}
+
+	if (_region_count == _regions.size())
+	{
+		_regions.emplace_back();
+		_region_boundaries.emplace_back();
+	}
+
+	const size_t   index  = _region_count++;
+	ProfileRegion &region = _regions[index];
+	region.name           = name;
+	region.parent         = _stack.empty() ? -1 : static_cast<int>(_stack.back());
+	region.depth          = static_cast<int>(_stack.size());
+
+	_region_boundaries[index].first = add_boundary();
+	_stack.push_back(index);
+}
+
+void FrameProfiler::end_region()
+{
+	// The root region is only ended by end_frame
+	if (_stack.size() < 2)
+	{
+		throw std::runtime_error("No region to end.");
+	}
+
+	_region_boundaries[_stack.back()].second = add_boundary();
+	_stack.pop_back();
+}
+
+void FrameProfiler::end_frame()
+{
+	if (!_in_frame || _stack.size() != 1)
+	{
+		throw std::runtime_error("Unbalanced profile regions.");
+	}
+
+	_region_boundaries[_stack.back()].second = add_boundary();
+	_stack.pop_back();
+	_in_frame = false;
+
+	while (_dumps_collected < _dumps_requested)
+	{
+		collect_dump();
+	}
+
+	for (size_t i = 0; i < _region_count; ++i)
+	{
+		ProfileRegion & region = _regions[i];
+		const Boundary &begin  = _boundaries[_region_boundaries[i].first];
+		const Boundary &end    = _boundaries[_region_boundaries[i].second];
+
+		region.begin_ns = begin.time_ns;
+		region.end_ns   = end.time_ns;
+		region.cpu      = end.cpu - begin.cpu;
+
+#if defined(__ANDROID__)
+		if (_mali != nullptr)
+		{
+			const std::vector<uint64_t> &first = _dump_sums[begin.dump];
+			const std::vector<uint64_t> &last  = _dump_sums[end.dump];
+
+			for (size_t word = 0; word < _delta.size(); ++word)
+			{
+				_delta[word] = last[word] - first[word];
+			}
+
+			_mali->decode(_delta.data(), end.time_ns - begin.time_ns, region.gpu);
+		}
+#endif
+	}
+}
+
+size_t FrameProfiler::add_boundary()
+{
+	if (_boundary_count == _boundaries.size())
+	{
+		_boundaries.emplace_back();
+	}
+
+	Boundary &boundary = _boundaries[_boundary_count];
+	boundary.time_ns   = monotonic_time_ns();
+
+	if (_pmu != nullptr)
+	{
+		_pmu->sample(boundary.cpu);
+	}
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		if (boundary.time_ns - _last_dump_ns >= _coalesce_ns)
+		{
+			// Make room in the kernel buffers rather than losing the dump
+			if (_dumps_requested - _dumps_collected == _mali->buffer_count())
+			{
+				collect_dump();
+			}
+
+			_mali->request_dump();
+			_dumps_requested++;
+			_last_dump_ns = boundary.time_ns;
+		}
+
+		boundary.dump = _dumps_requested - 1;
+	}
+#endif
+
+	return _boundary_count++;
+}
+
+void FrameProfiler::collect_dump()
+{
+#if defined(__ANDROID__)
+	const size_t size  = _mali->dump_size();
+	const size_t index = _dumps_collected++;
+
+	if (index >= _dump_sums.size())
+	{
+		_dump_sums.emplace_back();
+	}
+
+	std::vector<uint64_t> &sum = _dump_sums[index];
+	sum.resize(size);
+	_delta.resize(size);
+
+	const MaliSampleView dump = _mali->next_dump();
+
+	// The first dump holds the counts before the frame
+	if (index == 0)
+	{
+		std::fill(sum.begin(), sum.end(), 0);
+		return;
+	}
+
+	const std::vector<uint64_t> &previous = _dump_sums[index - 1];
+	for (size_t word = 0; word < size; ++word)
+	{
+		sum[word] = previous[word] + dump.counters()[word];
+	}
+#endif
+}
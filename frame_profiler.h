@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurements_snapshot.h"
+#include "pmu_counter.h"
+
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+class MaliCounter;
+
+/** Measurements of a region of a frame. */
+struct ProfileRegion
+{
+	const char *         name{nullptr}; /**< Name of the region, "Frame" for the whole frame. */
+	int                  parent{-1};    /**< Index of the enclosing region, -1 for the frame. */
+	int                  depth{0};      /**< Nesting depth, 0 for the frame. */
+	uint64_t             begin_ns{0};   /**< Start of the region, on CLOCK_MONOTONIC. */
+	uint64_t             end_ns{0};     /**< End of the region, on CLOCK_MONOTONIC. */
+	PMUCounterValues     cpu{};         /**< CPU events of the region, nested regions included. */
+	MeasurementsSnapshot gpu{};         /**< GPU measurements of the region, empty without a Mali counter. */
+};
+
+/** Profile the nested regions of a frame.
+ *
+ * The counters are started once per frame. Region boundaries read the PMU
+ * counters without resetting them and request a Mali dump without
+ * collecting it; the dumps are collected when the frame ends, when the per
+ * region deltas are computed. Boundaries closer than the coalescing
+ * interval share a dump, so ending a region and beginning the next one
+ * costs one dump.
+ *
+ * GPU counts are attributed to the region running when the GPU executes the
+ * work, which may be later than the region that submitted it.
+ */
+class FrameProfiler
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] pmu         CPU counters to read at each boundary, or nullptr.
+	 * @param[in] mali        GPU counters to dump at each boundary, or nullptr.
+	 * @param[in] coalesce_ns Boundaries closer than this share a Mali dump, in nanoseconds.
+	 */
+	FrameProfiler(PMUCounter *pmu, MaliCounter *mali, uint64_t coalesce_ns = 50000);
+
+	/** Start a frame, and its root region. */
+	void begin_frame();
+
+	/** End the frame and compute the measurements of its regions.
+	 *
+	 * Blocks until the Mali dumps of the frame are delivered.
+	 */
+	void end_frame();
+
+	/** Begin a region nested in the current one.
+	 *
+	 * @param[in] name Name of the region, must stay valid until the next frame begins.
+	 */
+	void begin_region(const char *name);
+
+	/** End the current region. */
+	void end_region();
+
+	/** Number of regions of the last frame, the frame included.
+	 *
+	 * @return the number of regions.
+	 */
+	size_t region_count() const
+	{
+		return _region_count;
+	}
+
+	/** Get a region of the last frame.
+	 *
+	 * Regions are ordered by start, so region 0 is the whole frame and a
+	 * region's children follow it.
+	 *
+	 * @param[in] index Index of the region.
+	 *
+	 * @return the region.
+	 */
+	const ProfileRegion &region(size_t index) const
+	{
+		return _regions[index];
+	}
+
+  private:
+	/** Counter values at the boundary of a region */
+	struct Boundary
+	{
+		uint64_t         time_ns{0};
+		PMUCounterValues cpu{};
+		size_t           dump{0}; /**< Index of the Mali dump taken at the boundary. */
+	};
+
+	size_t add_boundary();
+	void   collect_dump();
+
+	PMUCounter * _pmu;
+	MaliCounter *_mali;
+	uint64_t     _coalesce_ns;
+
+	bool                _in_frame{false};
+	std::vector<size_t> _stack{}; /**< Regions currently open. */
+
+	std::vector<ProfileRegion>                  _regions{};
+	std::vector<std::pair<size_t, size_t>>      _region_boundaries{}; /**< Begin and end boundaries of each region. */
+	size_t                                      _region_count{0};
+	std::vector<Boundary>                       _boundaries{};
+	size_t                                      _boundary_count{0};
+	uint64_t                                    _last_dump_ns{0};
+	size_t                                      _dumps_requested{0};
+	size_t                                      _dumps_collected{0};
+	std::vector<std::vector<uint64_t>>          _dump_sums{}; /**< Sum of the dumps of the frame up to each dump. */
+	std::vector<uint64_t>                       _delta{};
+};
+
+/** Profile a region for the lifetime of the scope. */
+class ProfileScope
+{
+  public:
+	/** Begin a region
+	 *
+	 * @param[in] profiler Profiler of the current frame.
+	 * @param[in] name     Name of the region, must stay valid until the next frame begins.
+	 */
+	ProfileScope(FrameProfiler &profiler, const char *name) :
+	    _profiler(profiler)
+	{
+		_profiler.begin_region(name);
+	}
+
+	/** Prevent instances of this class from being copy constructed */
+	ProfileScope(const ProfileScope &) = delete;
+	/** Prevent instances of this class from being copied */
+	ProfileScope &operator=(const ProfileScope &) = delete;
+
+	/** End the region
+	 *
+	 * A destructor can't throw, so if the region can't be ended, e.g. because
+	 * the frame already ended, the error is logged instead.
+	 */
+	~ProfileScope()
+	{
+		try
+		{
+			_profiler.end_region();
+		}
+		catch (const std::exception &error)
+		{
+			HWCPIPE_LOG("Failed to end profile region: %s", error.what());
+		}
+	}
+
+  private:
+	FrameProfiler &_profiler;
+};
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "frame_sampler.h"
+
+#if defined(__ANDROID__)
+#	include "mali_counter.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+uint64_t monotonic_time_ns()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+/** Boundaries the presenting thread can queue ahead of the background thread */
+constexpr size_t boundary_capacity = 16;
+
+/** Pearson correlation of two series, 0 if either is constant */
+template <typename X, typename Y>
+double correlation(size_t count, X x, Y y)
+{
+	double mean_x = 0.0;
+	double mean_y = 0.0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		mean_x += x(i);
+		mean_y += y(i);
+	}
+	mean_x /= count;
+	mean_y /= count;
+
+	double covariance = 0.0;
+	double variance_x = 0.0;
+	double variance_y = 0.0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const double dx = x(i) - mean_x;
+		const double dy = y(i) - mean_y;
+		covariance += dx * dy;
+		variance_x += dx * dx;
+		variance_y += dy * dy;
+	}
+
+	if (variance_x <= 0.0 || variance_y <= 0.0)
+	{
+		return 0.0;
+	}
+
+	return covariance / std::sqrt(variance_x * variance_y);
+}
+
+double snapshot_value(const MeasurementsSnapshot &snapshot, MeasurementsSnapshot::Id id)
+{
+	const Measurement::Value &value = snapshot.value(id);
+	return value.is_floating_point ? value.v.floating_point : static_cast<double>(value.v.integer);
+}
+}        // namespace
+
+FrameSampler::FrameSampler(PMUCounter *pmu, MaliCounter *mali, size_t history) :
+    _pmu(pmu),
+    _mali(mali),
+    _boundaries(boundary_capacity),
+    _history(std::max<size_t>(history, 1))
+{
+}
+
+FrameSampler::~FrameSampler()
+{
+	stop();
+}
+
+void FrameSampler::start()
+{
+	if (_running)
+	{
+		throw std::runtime_error("Frame sampler already started.");
+	}
+
+	if (pipe2(_wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		throw std::runtime_error("Failed to create the frame sampler pipe.");
+	}
+
+	if (_pmu != nullptr)
+	{
+		_pmu->start();
+		_pmu->sample(_previous.cpu);
+	}
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		_mali->start();
+		_last_dump_ns = _mali->start_time();
+		_dump.assign(_mali->dump_size(), 0);
+	}
+#endif
+
+	_previous.time_ns = monotonic_time_ns();
+	_next_frame       = 0;
+	_dropped_frames   = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(_history_mutex);
+		_history_count = 0;
+		_history_next  = 0;
+	}
+
+	_running = true;
+	_worker  = std::thread(&FrameSampler::worker_loop, this);
+}
+
+void FrameSampler::stop()
+{
+	if (!_running)
+	{
+		return;
+	}
+
+	_running = false;
+
+	const char wake = 0;
+	if (write(_wake_pipe[1], &wake, 1) != 1)
+	{
+		HWCPIPE_LOG("Failed to wake the frame sampler thread.");
+	}
+	_worker.join();
+
+	close(_wake_pipe[0]);
+	close(_wake_pipe[1]);
+	_wake_pipe[0] = -1;
+	_wake_pipe[1] = -1;
+
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		_mali->stop();
+	}
+#endif
+
+	if (_pmu != nullptr)
+	{
+		_pmu->stop();
+	}
+}
+
+void FrameSampler::present()
+{
+	if (!_running)
+	{
+		return;
+	}
+
+	Boundary *boundary = _boundaries.write_slot();
+	if (boundary == nullptr)
+	{
+		_dropped_frames++;
+		return;
+	}
+
+	boundary->time_ns = monotonic_time_ns();
+	if (_pmu != nullptr)
+	{
+		_pmu->sample(boundary->cpu);
+	}
+	_boundaries.push();
+
+	// The pipe is non-blocking: if it is full the thread is awake anyway
+	const char wake = 0;
+	if (write(_wake_pipe[1], &wake, 1) != 1)
+	{
+		return;
+	}
+}
+
+void FrameSampler::worker_loop()
+{
+	for (;;)
+	{
+		pollfd poll_fd;
+		poll_fd.fd     = _wake_pipe[0];
+		poll_fd.events = POLLIN;
+		poll(&poll_fd, 1, -1);
+
+		char wakes[64];
+		while (read(_wake_pipe[0], wakes, sizeof(wakes)) > 0)
+		{
+		}
+
+		while (const Boundary *boundary = _boundaries.front())
+		{
+			process(*boundary);
+			_boundaries.pop();
+		}
+
+		// stop() wakes the thread after the last boundary was queued
+		if (!_running)
+		{
+			return;
+		}
+	}
+}
+
+void FrameSampler::process(const Boundary &boundary)
+{
+#if defined(__ANDROID__)
+	if (_mali != nullptr)
+	{
+		try
+		{
+			_mali->request_dump();
+			MaliSampleView dump = _mali->next_dump();
+
+			for (size_t i = 0; i < _dump.size() && i < dump.size(); ++i)
+			{
+				_dump[i] = dump.counters()[i];
+			}
+			const uint64_t timestamp = dump.timestamp();
+			dump.release();
+
+			_mali->decode(_dump.data(), timestamp - _last_dump_ns, _gpu);
+			_last_dump_ns = timestamp;
+		}
+		catch (const std::runtime_error &error)
+		{
+			HWCPIPE_LOG("Failed to sample the GPU counters of a frame: %s", error.what());
+			_gpu.clear();
+		}
+	}
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(_history_mutex);
+
+		FrameSample &sample = _history[_history_next];
+		sample.frame        = _next_frame++;
+		sample.begin_ns     = _previous.time_ns;
+		sample.end_ns       = boundary.time_ns;
+		sample.cpu          = boundary.cpu - _previous.cpu;
+		sample.gpu          = _gpu;
+
+		_history_next  = (_history_next + 1) % _history.size();
+		_history_count = std::min(_history_count + 1, _history.size());
+	}
+
+	_previous.time_ns = boundary.time_ns;
+	_previous.cpu     = boundary.cpu;
+}
+
+size_t FrameSampler::frame_count() const
+{
+	std::lock_guard<std::mutex> lock(_history_mutex);
+	return _history_count;
+}
+
+bool FrameSampler::frame(size_t age, FrameSample &sample) const
+{
+	std::lock_guard<std::mutex> lock(_history_mutex);
+
+	if (age >= _history_count)
+	{
+		return false;
+	}
+
+	sample = _history[(_history_next + _history.size() - 1 - age) % _history.size()];
+	return true;
+}
+
+std::vector<FrameCorrelation> FrameSampler::correlations() const
+{
+	std::lock_guard<std::mutex> lock(_history_mutex);
+
+	std::vector<FrameCorrelation> correlations;
+	const size_t                  count = _history_count;
+	if (count < 3)
+	{
+		return correlations;
+	}
+
+	const auto sample = [this, count](size_t i) -> const FrameSample & {
+		return _history[(_history_next + _history.size() - count + i) % _history.size()];
+	};
+	const auto frame_time = [&](size_t i) {
+		return static_cast<double>(sample(i).end_ns - sample(i).begin_ns);
+	};
+
+	if (_pmu != nullptr)
+	{
+		correlations.push_back({"CPU cycles", correlation(count, frame_time, [&](size_t i) { return static_cast<double>(sample(i).cpu.cycles); })});
+		correlations.push_back({"CPU instructions", correlation(count, frame_time, [&](size_t i) { return static_cast<double>(sample(i).cpu.instructions); })});
+		correlations.push_back({"CPU cache misses", correlation(count, frame_time, [&](size_t i) { return static_cast<double>(sample(i).cpu.cache_misses); })});
+		correlations.push_back({"CPU branch misses", correlation(count, frame_time, [&](size_t i) { return static_cast<double>(sample(i).cpu.branch_misses); })});
+	}
+
+	// GPU measurements are only correlated if every frame of the history has them
+	const MeasurementsSnapshot &latest = sample(count - 1).gpu;
+	bool                        same_layout = !latest.empty();
+	for (size_t i = 0; i < count && same_layout; ++i)
+	{
+		same_layout = sample(i).gpu.size() == latest.size();
+	}
+
+	if (same_layout)
+	{
+		for (MeasurementsSnapshot::Id id = 0; id < latest.size(); ++id)
+		{
+			correlations.push_back({latest.name(id), correlation(count, frame_time, [&](size_t i) { return snapshot_value(sample(i).gpu, id); })});
+		}
+	}
+
+	std::sort(correlations.begin(), correlations.end(), [](const FrameCorrelation &a, const FrameCorrelation &b) {
+		return std::fabs(a.correlation) > std::fabs(b.correlation);
+	});
+
+	return correlations;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurements_snapshot.h"
+#include "pmu_counter.h"
+#include "ring_buffer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MaliCounter;
+
+/** Counters of one frame, from a present to the next. */
+struct FrameSample
+{
+	uint64_t             frame{0};    /**< Index of the frame since start. */
+	uint64_t             begin_ns{0}; /**< Previous present, on CLOCK_MONOTONIC. */
+	uint64_t             end_ns{0};   /**< Present ending the frame, on CLOCK_MONOTONIC. */
+	PMUCounterValues     cpu{};       /**< CPU events of the presenting thread during the frame. */
+	MeasurementsSnapshot gpu{};       /**< GPU measurements of the frame, empty without a Mali counter. */
+};
+
+/** Correlation of a counter with the frame time. */
+struct FrameCorrelation
+{
+	std::string name;        /**< Name of the measurement. */
+	double      correlation; /**< Pearson correlation with the frame time, between -1 and 1. */
+};
+
+/** Sample the counters at every frame boundary without delaying the present.
+ *
+ * Call @ref present next to vkQueuePresentKHR or eglSwapBuffers, e.g. from a
+ * Vulkan layer or a swap hook. The presenting thread only reads the PMU
+ * group and queues the boundary; the Mali dump, which waits for the GPU, is
+ * taken by a background thread, which also keeps the history of the last
+ * frames. GPU counts are therefore cut slightly after the present.
+ *
+ * If the background thread falls behind, boundaries are dropped and the next
+ * frame covers the dropped ones.
+ */
+class FrameSampler
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] pmu     CPU counters, counting the presenting thread, or nullptr.
+	 * @param[in] mali    GPU counters, or nullptr. They are only used by the background thread while sampling.
+	 * @param[in] history Number of frames kept.
+	 */
+	FrameSampler(PMUCounter *pmu, MaliCounter *mali, size_t history = 120);
+
+	/** Default destructor, stops sampling. */
+	~FrameSampler();
+
+	/** Prevent instances of this class from being copy constructed */
+	FrameSampler(const FrameSampler &) = delete;
+	/** Prevent instances of this class from being copied */
+	FrameSampler &operator=(const FrameSampler &) = delete;
+
+	/** Start the counters and the background thread. The first frame begins now. */
+	void start();
+
+	/** Stop the background thread, once the queued frames are sampled, then the counters. */
+	void stop();
+
+	/** Mark a frame boundary. Call from the presenting thread. */
+	void present();
+
+	/** Mark a frame boundary, then present.
+	 *
+	 * @param[in] present_call Present call, e.g. a lambda calling the next vkQueuePresentKHR.
+	 *
+	 * @return the result of @p present_call.
+	 */
+	template <typename Present>
+	auto present(Present &&present_call) -> decltype(present_call())
+	{
+		present();
+		return present_call();
+	}
+
+	/** Number of frames in the history.
+	 *
+	 * @return the number of frames that can be read with @ref frame.
+	 */
+	size_t frame_count() const;
+
+	/** Copy a frame of the history.
+	 *
+	 * @param[in]  age    0 for the latest frame, 1 for the one before...
+	 * @param[out] sample The frame.
+	 *
+	 * @return false if the history doesn't hold this frame.
+	 */
+	bool frame(size_t age, FrameSample &sample) const;
+
+	/** Correlate the counters with the frame time over the history.
+	 *
+	 * @return the correlation of the CPU counters and of each GPU measurement, strongest first.
+	 */
+	std::vector<FrameCorrelation> correlations() const;
+
+	/** Number of boundaries dropped because the background thread fell behind.
+	 *
+	 * @return the dropped boundaries since start.
+	 */
+	uint64_t dropped_frames() const
+	{
+		return _dropped_frames;
+	}
+
+  private:
+	/** Frame boundary queued by the presenting thread */
+	struct Boundary
+	{
+		uint64_t         time_ns{0};
+		PMUCounterValues cpu{};
+	};
+
+	void worker_loop();
+	void process(const Boundary &boundary);
+
+	PMUCounter * _pmu;
+	MaliCounter *_mali;
+
+	SPSCRingBuffer<Boundary> _boundaries;
+	std::thread              _worker{};
+	int                      _wake_pipe[2]{-1, -1};
+	std::atomic<uint64_t>    _dropped_frames{0};
+	std::atomic<bool>        _running{false};
+
+	Boundary              _previous{}; /**< Last boundary processed by the background thread. */
+	uint64_t              _next_frame{0};
+	uint64_t              _last_dump_ns{0};
+	std::vector<uint64_t> _dump{}; /**< Mali dump widened to 64-bit for decoding. */
+	MeasurementsSnapshot  _gpu{};
+
+	mutable std::mutex       _history_mutex{};
+	std::vector<FrameSample> _history;
+	size_t                   _history_count{0};
+	size_t                   _history_next{0};
+};
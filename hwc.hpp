@@ -172,6 +172,8 @@ struct kbase_uk_gpuprops
 #	define KBASE_GPUPROP_PRODUCT_ID 1
 #	define KBASE_GPUPROP_MINOR_REVISION 3
 #	define KBASE_GPUPROP_MAJOR_REVISION 4
+#	define KBASE_GPUPROP_GPU_FREQ_KHZ_MAX 6
+#	define KBASE_GPUPROP_GPU_FREQ_KHZ_MIN 7
 
 #	define KBASE_GPUPROP_COHERENCY_NUM_GROUPS 61
 #	define KBASE_GPUPROP_COHERENCY_NUM_CORE_GROUPS 62
@@ -199,6 +201,8 @@ struct gpu_props
 	uint32_t product_id;
 	uint16_t minor_revision;
 	uint16_t major_revision;
+	uint32_t gpu_freq_khz_max;
+	uint32_t gpu_freq_khz_min;
 	uint32_t num_groups;
 	uint32_t num_core_groups;
 	uint64_t core_mask[16];
@@ -220,6 +224,8 @@ static const struct
     PROP(PRODUCT_ID, product_id),
     PROP(MINOR_REVISION, minor_revision),
     PROP(MAJOR_REVISION, major_revision),
+    PROP(GPU_FREQ_KHZ_MAX, gpu_freq_khz_max),
+    PROP(GPU_FREQ_KHZ_MIN, gpu_freq_khz_min),
     PROP(COHERENCY_NUM_GROUPS, num_groups),
     PROP(COHERENCY_NUM_CORE_GROUPS, num_core_groups),
     PROP(COHERENCY_GROUP_0, core_mask[0]),
@@ -243,6 +249,14 @@ static const struct
 #	undef PROP
     {0, 0, 0}};
 
+/** Interface of the kbase driver, probed once per device */
+enum class KbaseBackend
+{
+	LegacyUK,     /**< UK ioctls of the older drivers and the hwcnt reader. */
+	Ioctl,        /**< KBASE_IOCTL_* interface and the hwcnt reader. */
+	KinstrPrfcnt, /**< KBASE_IOCTL_* interface and the kinstr_prfcnt reader (r30+ drivers). */
+};
+
 struct kbase_hwcnt_reader_metadata
 {
 	uint64_t timestamp  = 0;
@@ -313,6 +327,174 @@ struct kbase_ioctl_hwcnt_reader_setup
 #	define KBASE_IOCTL_SET_FLAGS _IOW(KBASE_IOCTL_TYPE, 1, struct mali_userspace::kbase_ioctl_set_flags)
 #	define KBASE_IOCTL_HWCNT_READER_SETUP _IOW(KBASE_IOCTL_TYPE, 8, struct mali_userspace::kbase_ioctl_hwcnt_reader_setup)
 
+/* kinstr_prfcnt reader of the r30+ drivers, which replaces the hwcnt reader */
+#	define PRFCNT_LIST_TYPE_ENUM 0
+#	define PRFCNT_LIST_TYPE_REQUEST 1
+#	define PRFCNT_LIST_TYPE_SAMPLE_META 2
+#	define FLEX_LIST_TYPE(type, subtype) static_cast<uint16_t>((((type) &0xf) << 12) | ((subtype) &0xfff))
+#	define FLEX_LIST_TYPE_NONE FLEX_LIST_TYPE(0, 0)
+
+#	define PRFCNT_ENUM_TYPE_BLOCK FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_ENUM, 0)
+#	define PRFCNT_REQUEST_TYPE_MODE FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_REQUEST, 0)
+#	define PRFCNT_REQUEST_TYPE_ENABLE FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_REQUEST, 1)
+#	define PRFCNT_REQUEST_TYPE_SCOPE FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_REQUEST, 2)
+#	define PRFCNT_SAMPLE_META_TYPE_SAMPLE FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_SAMPLE_META, 0)
+#	define PRFCNT_SAMPLE_META_TYPE_BLOCK FLEX_LIST_TYPE(PRFCNT_LIST_TYPE_SAMPLE_META, 2)
+
+enum
+{
+	PRFCNT_BLOCK_TYPE_FE          = 0,
+	PRFCNT_BLOCK_TYPE_TILER       = 1,
+	PRFCNT_BLOCK_TYPE_MEMORY      = 2,
+	PRFCNT_BLOCK_TYPE_SHADER_CORE = 3,
+
+	PRFCNT_SET_PRIMARY = 0,
+
+	PRFCNT_MODE_MANUAL = 1,
+
+	PRFCNT_SCOPE_GLOBAL = 0,
+
+	PRFCNT_CONTROL_CMD_START       = 1,
+	PRFCNT_CONTROL_CMD_STOP        = 2,
+	PRFCNT_CONTROL_CMD_SAMPLE_SYNC = 3,
+};
+
+struct prfcnt_item_header
+{
+	uint16_t item_type;
+	uint16_t item_version;
+};
+
+struct prfcnt_enum_block_counter
+{
+	uint8_t  block_type;
+	uint8_t  set;
+	uint8_t  pad[2];
+	uint16_t num_instances;
+	uint16_t num_values;
+	uint64_t counter_mask[2];
+};
+
+struct prfcnt_enum_item
+{
+	prfcnt_item_header hdr;
+	uint8_t            padding[4];
+	union
+	{
+		prfcnt_enum_block_counter block_counter;
+		uint64_t                  sizer[3];
+	} u;
+};
+
+struct prfcnt_request_mode
+{
+	uint8_t  mode;
+	uint8_t  pad[7];
+	uint64_t period_ns;
+};
+
+struct prfcnt_request_enable
+{
+	uint8_t  block_type;
+	uint8_t  set;
+	uint8_t  pad[6];
+	uint64_t enable_mask[2];
+};
+
+struct prfcnt_request_scope
+{
+	uint8_t scope;
+	uint8_t pad[7];
+};
+
+struct prfcnt_request_item
+{
+	prfcnt_item_header hdr;
+	uint8_t            padding[4];
+	union
+	{
+		prfcnt_request_mode   req_mode;
+		prfcnt_request_enable req_enable;
+		prfcnt_request_scope  req_scope;
+	} u;
+};
+
+struct prfcnt_sample_metadata
+{
+	uint64_t timestamp_start;
+	uint64_t timestamp_end;
+	uint64_t seq;
+	uint64_t user_data;
+	uint32_t flags;
+	uint32_t pad;
+};
+
+struct prfcnt_block_metadata
+{
+	uint8_t  block_type;
+	uint8_t  block_idx;
+	uint8_t  set;
+	uint8_t  pad_u8;
+	uint32_t block_state;
+	uint32_t values_offset;
+	uint32_t pad_u32;
+};
+
+struct prfcnt_metadata
+{
+	prfcnt_item_header hdr;
+	uint8_t            padding[4];
+	union
+	{
+		prfcnt_sample_metadata sample_md;
+		prfcnt_block_metadata  block_md;
+		uint64_t               sizer[5];
+	} u;
+};
+
+struct prfcnt_control_cmd
+{
+	uint16_t cmd;
+	uint16_t pad[3];
+	uint64_t user_data;
+};
+
+struct prfcnt_sample_access
+{
+	uint64_t sequence;
+	uint64_t sample_offset_bytes;
+};
+
+struct kbase_ioctl_kinstr_prfcnt_enum_info
+{
+	uint32_t info_item_size;
+	uint32_t info_item_count;
+	uint64_t info_list_ptr;
+};
+
+union kbase_ioctl_kinstr_prfcnt_setup
+{
+	struct
+	{
+		uint32_t request_item_count;
+		uint32_t request_item_size;
+		uint64_t requests_ptr;
+	} in;
+	struct
+	{
+		uint32_t prfcnt_metadata_item_size;
+		uint32_t prfcnt_mmap_size_bytes;
+	} out;
+};
+
+#	define KBASE_IOCTL_KINSTR_PRFCNT_ENUM_INFO _IOWR(KBASE_IOCTL_TYPE, 56, struct mali_userspace::kbase_ioctl_kinstr_prfcnt_enum_info)
+#	define KBASE_IOCTL_KINSTR_PRFCNT_SETUP _IOWR(KBASE_IOCTL_TYPE, 57, union mali_userspace::kbase_ioctl_kinstr_prfcnt_setup)
+
+#	define KBASE_KINSTR_PRFCNT_READER 0xBF
+#	define KBASE_IOCTL_KINSTR_PRFCNT_CMD MALI_IOW(KBASE_KINSTR_PRFCNT_READER, 0x00, struct mali_userspace::prfcnt_control_cmd)
+#	define KBASE_IOCTL_KINSTR_PRFCNT_GET_SAMPLE MALI_IOR(KBASE_KINSTR_PRFCNT_READER, 0x01, struct mali_userspace::prfcnt_sample_access)
+#	define KBASE_IOCTL_KINSTR_PRFCNT_PUT_SAMPLE MALI_IOW(KBASE_KINSTR_PRFCNT_READER, 0x10, struct mali_userspace::prfcnt_sample_access)
+
 /** IOCTL parameters to set flags */
 struct kbase_uk_hwcnt_reader_set_flags
 {
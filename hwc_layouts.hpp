@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "hwc.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mali_userspace
+{
+enum
+{
+	MALI_NAME_BLOCK_COUNT = 4 /**< Blocks of a names table: job manager, tiler, shader core and MMU/L2. */
+};
+
+/** Check whether two counter names are equal, at compile time. */
+constexpr bool counter_name_equals(const char *str, const char *name)
+{
+	return *str == *name && (*str == '\0' || counter_name_equals(str + 1, name + 1));
+}
+
+/** Check whether a counter name is a name after its product prefix, at compile time, as MaliCounter does at runtime. */
+constexpr bool counter_name_matches(const char *str, const char *name)
+{
+	return *str != '\0' && (*str == '_' ? counter_name_equals(str + 1, name) : counter_name_matches(str + 1, name));
+}
+
+/** Find a counter in a names table at compile time.
+ *
+ * Blocks are searched in order, as MaliCounter does at runtime, so both
+ * resolve a name to the same counter.
+ *
+ * @param[in] names_lut Names table of a product, e.g. hardware_counters_mali_tMIx.
+ * @param[in] name      Counter name, without the product prefix.
+ * @param[in] position  First position searched.
+ *
+ * @return the position of the counter in the table (block * MALI_NAME_BLOCK_SIZE + index), or -1.
+ */
+constexpr int find_counter_position(const char *const *names_lut, const char *name, int position = 0)
+{
+	return position == MALI_NAME_BLOCK_COUNT * MALI_NAME_BLOCK_SIZE ? -1 :
+	       counter_name_matches(names_lut[position], name)           ? position :
+	                                                                   find_counter_position(names_lut, name, position + 1);
+}
+
+/** Compile time sequence of indices, std::index_sequence isn't available in C++11 */
+template <size_t... I>
+struct IndexSequence
+{
+};
+
+template <size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...>
+{
+};
+
+template <size_t... I>
+struct MakeIndexSequence<0, I...>
+{
+	using type = IndexSequence<I...>;
+};
+
+/** Counter of a fixed list, located in the dumps of a product at compile time.
+ *
+ * @tparam Product Index of the product in @ref products.
+ * @tparam Names   List of counter names, without the product prefix.
+ * @tparam I       Index of the counter in @p Names.
+ */
+template <size_t Product, const char *const *Names, size_t I>
+struct FixedCounter
+{
+	static constexpr int position = find_counter_position(products[Product].names_lut, Names[I]);
+	static constexpr int block    = position < 0 ? -1 : position / MALI_NAME_BLOCK_SIZE;
+	static constexpr int index    = position < 0 ? 0 : position % MALI_NAME_BLOCK_SIZE;
+};
+
+/** Where a fixed kernel stores the counters it reads */
+struct FixedCounterTargets
+{
+	std::vector<uint64_t *> values{};                  /**< Value of each counter of the list, summed over cores and L2 slices, nullptr if the product doesn't have it. */
+	std::vector<uint64_t *> core_values{};             /**< Per core values of each shader core counter of the list, nullptr for other counters. */
+	std::vector<uint64_t *> slice_values{};            /**< Per slice values of each L2 cache counter of the list, nullptr for other counters. */
+	const unsigned int *    core_index_remap{nullptr}; /**< Block of each shader core in the dump. */
+	int                     num_cores{0};
+	int                     num_l2_slices{0};
+};
+
+/** Counter extraction kernels specialized for a product and a fixed list of counters */
+struct FixedCounterLayout
+{
+	void (*read32)(const uint32_t *sample, const FixedCounterTargets &targets); /**< Read a dump of the hwcnt reader. */
+	void (*read64)(const uint64_t *sample, const FixedCounterTargets &targets); /**< Read dumps accumulated to 64-bit. */
+	int (*position)(size_t i);                                                   /**< Position of counter @p i in the names table, or -1. */
+};
+
+template <size_t Product, const char *const *Names, typename Sequence>
+struct FixedCounterKernel;
+
+/** Extraction kernel: every counter offset is a compile time constant, only the core and slice counts are read at runtime */
+template <size_t Product, const char *const *Names, size_t... I>
+struct FixedCounterKernel<Product, Names, IndexSequence<I...>>
+{
+	using Expand = int[];
+
+	template <typename Counter, typename T>
+	static int read_block(const T *sample, const FixedCounterTargets &targets, size_t i)
+	{
+		if (Counter::block == MALI_NAME_BLOCK_JM || Counter::block == MALI_NAME_BLOCK_TILER)
+		{
+			*targets.values[i] = sample[Counter::block * MALI_NAME_BLOCK_SIZE + Counter::index];
+		}
+		return 0;
+	}
+
+	template <typename Counter, typename T>
+	static int read_core(const T *core_block, const FixedCounterTargets &targets, size_t i, int core, uint64_t *sums)
+	{
+		if (Counter::block == MALI_NAME_BLOCK_SHADER)
+		{
+			const uint64_t value         = core_block[Counter::index];
+			targets.core_values[i][core] = value;
+			sums[i] += value;
+		}
+		return 0;
+	}
+
+	template <typename Counter>
+	static int store_core_sum(const FixedCounterTargets &targets, size_t i, const uint64_t *sums)
+	{
+		if (Counter::block == MALI_NAME_BLOCK_SHADER)
+		{
+			*targets.values[i] = sums[i];
+		}
+		return 0;
+	}
+
+	template <typename Counter, typename T>
+	static int read_slices(const T *sample, const FixedCounterTargets &targets, size_t i)
+	{
+		if (Counter::block == MALI_NAME_BLOCK_MMU)
+		{
+			// MMU blocks of consecutive slices are contiguous in the dump, after the tiler
+			uint64_t value = 0;
+			for (int slice = 0; slice < targets.num_l2_slices; ++slice)
+			{
+				const uint64_t slice_value     = sample[MALI_NAME_BLOCK_SIZE * (2 + slice) + Counter::index];
+				targets.slice_values[i][slice] = slice_value;
+				value += slice_value;
+			}
+			*targets.values[i] = value;
+		}
+		return 0;
+	}
+
+	template <typename T>
+	static void read(const T *sample, const FixedCounterTargets &targets)
+	{
+		(void) Expand{0, read_block<FixedCounter<Product, Names, I>>(sample, targets, I)...};
+
+		uint64_t       sums[sizeof...(I)] = {};
+		const T *const cores              = sample + MALI_NAME_BLOCK_SIZE * (2 + targets.num_l2_slices);
+		for (int core = 0; core < targets.num_cores; ++core)
+		{
+			const T *core_block = cores + MALI_NAME_BLOCK_SIZE * targets.core_index_remap[core];
+			(void) Expand{0, read_core<FixedCounter<Product, Names, I>>(core_block, targets, I, core, sums)...};
+		}
+		(void) Expand{0, store_core_sum<FixedCounter<Product, Names, I>>(targets, I, sums)...};
+
+		(void) Expand{0, read_slices<FixedCounter<Product, Names, I>>(sample, targets, I)...};
+	}
+
+	static int position(size_t i)
+	{
+		static const int positions[] = {FixedCounter<Product, Names, I>::position...};
+		return positions[i];
+	}
+
+	static FixedCounterLayout layout()
+	{
+		return FixedCounterLayout{&read<uint32_t>, &read<uint64_t>, &position};
+	}
+};
+
+template <const char *const *Names, size_t Count, size_t... Product>
+const FixedCounterLayout &fixed_counter_layout(size_t product, IndexSequence<Product...>)
+{
+	static const FixedCounterLayout layouts[] = {
+	    FixedCounterKernel<Product, Names, typename MakeIndexSequence<Count>::type>::layout()...};
+	return layouts[product];
+}
+
+/** Get the extraction kernels of a fixed list of counters for a product.
+ *
+ * The kernels of every product are compiled in, the product is picked at
+ * runtime once the GPU is identified.
+ *
+ * @tparam Names List of counter names, without the product prefix.
+ * @tparam Count Number of names.
+ *
+ * @param[in] product Index of the product in @ref products.
+ *
+ * @return the kernels of the product.
+ */
+template <const char *const *Names, size_t Count>
+const FixedCounterLayout &fixed_counter_layout(size_t product)
+{
+	return fixed_counter_layout<Names, Count>(product, typename MakeIndexSequence<NUM_PRODUCTS>::type());
+}
+}        // namespace mali_userspace
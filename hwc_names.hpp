@@ -52,7 +52,7 @@ enum
  * where no counter exists.
  */
 
-static const char *const hardware_counters_mali_t60x[] =
+static constexpr const char *const hardware_counters_mali_t60x[] =
     {
         /* Job Manager */
         "",
@@ -318,7 +318,7 @@ static const char *const hardware_counters_mali_t60x[] =
         "T60x_L2_SNOOP_FULL",
         "T60x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t62x[] =
+static constexpr const char *const hardware_counters_mali_t62x[] =
     {
         /* Job Manager */
         "",
@@ -584,7 +584,7 @@ static const char *const hardware_counters_mali_t62x[] =
         "T62x_L2_SNOOP_FULL",
         "T62x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t72x[] =
+static constexpr const char *const hardware_counters_mali_t72x[] =
     {
         /* Job Manager */
         "",
@@ -850,7 +850,7 @@ static const char *const hardware_counters_mali_t72x[] =
         "",
         ""};
 
-static const char *const hardware_counters_mali_t76x[] =
+static constexpr const char *const hardware_counters_mali_t76x[] =
     {
         /* Job Manager */
         "",
@@ -1116,7 +1116,7 @@ static const char *const hardware_counters_mali_t76x[] =
         "T76x_L2_SNOOP_FULL",
         "T76x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t82x[] =
+static constexpr const char *const hardware_counters_mali_t82x[] =
     {
         /* Job Manager */
         "",
@@ -1382,7 +1382,7 @@ static const char *const hardware_counters_mali_t82x[] =
         "T82x_L2_SNOOP_FULL",
         "T82x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t83x[] =
+static constexpr const char *const hardware_counters_mali_t83x[] =
     {
         /* Job Manager */
         "",
@@ -1648,7 +1648,7 @@ static const char *const hardware_counters_mali_t83x[] =
         "T83x_L2_SNOOP_FULL",
         "T83x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t86x[] =
+static constexpr const char *const hardware_counters_mali_t86x[] =
     {
         /* Job Manager */
         "",
@@ -1914,7 +1914,7 @@ static const char *const hardware_counters_mali_t86x[] =
         "T86x_L2_SNOOP_FULL",
         "T86x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_t88x[] =
+static constexpr const char *const hardware_counters_mali_t88x[] =
     {
         /* Job Manager */
         "",
@@ -2180,7 +2180,7 @@ static const char *const hardware_counters_mali_t88x[] =
         "T88x_L2_SNOOP_FULL",
         "T88x_L2_REPLAY_FULL"};
 
-static const char *const hardware_counters_mali_tHEx[] =
+static constexpr const char *const hardware_counters_mali_tHEx[] =
     {
         /* Performance counters for the Job Manager */
         "",
@@ -2446,7 +2446,7 @@ static const char *const hardware_counters_mali_tHEx[] =
         "",
         ""};
 
-static const char *const hardware_counters_mali_tMIx[] =
+static constexpr const char *const hardware_counters_mali_tMIx[] =
     {
         /* Performance counters for the Job Manager */
         "",
@@ -2712,7 +2712,7 @@ static const char *const hardware_counters_mali_tMIx[] =
         "",
         ""};
 
-static const char *const hardware_counters_mali_tSIx[] =
+static constexpr const char *const hardware_counters_mali_tSIx[] =
     {
         /* Performance counters for the Job Manager */
         "",
@@ -2978,7 +2978,7 @@ static const char *const hardware_counters_mali_tSIx[] =
         "",
         ""};
 
-static const char *const hardware_counters_mali_tNOx[] =
+static constexpr const char *const hardware_counters_mali_tNOx[] =
     {
         /* Performance counters for the Job Manager */
         "",
@@ -3266,74 +3266,94 @@ enum
 	PRODUCT_ID_TNOX = 0x7001
 };
 
+/* GPU architectures, each with its own set of counters */
+enum MaliGPUFamily
+{
+	MALI_FAMILY_MIDGARD = 0,
+	MALI_FAMILY_BIFROST = 1
+};
+
 struct CounterMapping
 {
 	uint32_t           product_mask;
 	uint32_t           product_id;
 	const char *const *names_lut;
+	MaliGPUFamily      family;
 };
 
-static const CounterMapping products[] =
+static constexpr CounterMapping products[] =
     {
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T60X,
             hardware_counters_mali_t60x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T62X,
             hardware_counters_mali_t62x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T72X,
             hardware_counters_mali_t72x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T76X,
             hardware_counters_mali_t76x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T82X,
             hardware_counters_mali_t82x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T83X,
             hardware_counters_mali_t83x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_T86X,
             hardware_counters_mali_t86x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_OLD,
             PRODUCT_ID_TFRX,
             hardware_counters_mali_t88x,
+            MALI_FAMILY_MIDGARD,
         },
         {
             PRODUCT_ID_MASK_NEW,
             PRODUCT_ID_TMIX,
             hardware_counters_mali_tMIx,
+            MALI_FAMILY_BIFROST,
         },
         {
             PRODUCT_ID_MASK_NEW,
             PRODUCT_ID_THEX,
             hardware_counters_mali_tHEx,
+            MALI_FAMILY_BIFROST,
         },
         {
             PRODUCT_ID_MASK_NEW,
             PRODUCT_ID_TSIX,
             hardware_counters_mali_tSIx,
+            MALI_FAMILY_BIFROST,
         },
         {
             PRODUCT_ID_MASK_NEW,
             PRODUCT_ID_TNOX,
             hardware_counters_mali_tNOx,
+            MALI_FAMILY_BIFROST,
         },
 };
 
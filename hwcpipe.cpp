@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "hwcpipe.h"
+
+#include <sched.h>
+#include <time.h>
+
+namespace
+{
+uint64_t clock_ns(clockid_t clock)
+{
+	timespec time;
+	clock_gettime(clock, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+/** Margin around the host window in which a GPU timestamp is taken to be on the same clock */
+constexpr uint64_t clock_margin_ns = 1000000;
+
+bool within(uint64_t timestamp, uint64_t before, uint64_t after)
+{
+	return timestamp + clock_margin_ns >= before && timestamp <= after + clock_margin_ns;
+}
+
+/** Frequency of a domain over an interval, from its reads at both ends */
+uint64_t average_frequency(uint64_t begin, uint64_t end)
+{
+	if (begin == 0 || end == 0)
+	{
+		return begin + end;
+	}
+	return begin / 2 + end / 2;
+}
+}        // namespace
+
+HWCPipe::HWCPipe(bool enable_cpu, bool enable_gpu, bool enable_dvfs)
+{
+	if (enable_cpu)
+	{
+		_cpu.reset(new PMUCounter());
+	}
+
+#if defined(__ANDROID__)
+	if (enable_gpu)
+	{
+		try
+		{
+			_gpu.reset(new MaliCounter());
+		}
+		catch (const std::runtime_error &error)
+		{
+			HWCPIPE_LOG("Mali counters disabled: %s", error.what());
+		}
+	}
+#else
+	(void) enable_gpu;
+#endif
+
+	if (enable_dvfs)
+	{
+		_dvfs.reset(new DVFSMonitor());
+		if (_dvfs->domains().empty())
+		{
+			HWCPIPE_LOG("DVFS frequencies disabled: no devfreq or cpufreq domain found.");
+			_dvfs.reset();
+		}
+		else
+		{
+			// stop() may run before any start()
+			_begin_frequencies.assign(_dvfs->domains().size(), 0);
+			_end_frequencies.assign(_dvfs->domains().size(), 0);
+		}
+	}
+}
+
+HWCPipe::~HWCPipe() = default;
+
+void HWCPipe::start()
+{
+	// Read the frequencies out of the measured window
+	if (_dvfs)
+	{
+		_dvfs->read(_begin_frequencies);
+	}
+
+	const uint64_t before = clock_ns(CLOCK_MONOTONIC_RAW);
+
+#if defined(__ANDROID__)
+	if (_gpu)
+	{
+		_gpu->start();
+	}
+#endif
+
+	_sample.begin_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+
+	if (_cpu)
+	{
+		_cpu->start();
+	}
+
+#if defined(__ANDROID__)
+	if (_gpu)
+	{
+		calibrate_gpu_clock(before, _sample.begin_ns, _gpu->start_time());
+		_sample.gpu_begin_ns = gpu_to_host(_gpu->start_time());
+	}
+#else
+	(void) before;
+#endif
+}
+
+void HWCPipe::stop()
+{
+#if defined(__ANDROID__)
+	if (_gpu)
+	{
+		_gpu->stop_async();
+	}
+#endif
+
+	if (_cpu)
+	{
+		_cpu->stop();
+	}
+
+	_sample.end_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+
+	const int cpu = sched_getcpu();
+	if (_dvfs)
+	{
+		_dvfs->read(_end_frequencies);
+	}
+
+	if (_cpu)
+	{
+		_cpu->snapshot(_sample.cpu);
+	}
+
+#if defined(__ANDROID__)
+	if (_gpu)
+	{
+		// The derived metrics of the dump use the clock the GPU ran at
+		const int gpu = _dvfs ? _dvfs->gpu_domain() : -1;
+		if (gpu >= 0)
+		{
+			_gpu->set_gpu_frequency(average_frequency(_begin_frequencies[gpu], _end_frequencies[gpu]));
+		}
+
+		_gpu->complete_stop(-1);
+		_gpu->snapshot(_sample.gpu);
+		_sample.gpu_end_ns = gpu_to_host(_gpu->stop_time());
+	}
+#endif
+
+	if (_dvfs)
+	{
+		update_power(cpu);
+	}
+}
+
+void HWCPipe::update_power(int cpu)
+{
+	const std::vector<FrequencyDomain> &domains = _dvfs->domains();
+	const int                           gpu     = _dvfs->gpu_domain();
+
+	// Energy is only reported for the domains with a power model, the thread may stop on any cluster
+	bool gpu_energy = gpu >= 0 && _dvfs->has_power_model(gpu);
+	bool cpu_energy = false;
+	for (size_t i = 0; i < domains.size(); ++i)
+	{
+		if (!domains[i].is_gpu)
+		{
+			cpu_energy = _dvfs->has_power_model(i);
+			if (!cpu_energy)
+			{
+				break;
+			}
+		}
+	}
+
+	// Frequencies first, then the busy time and energy of the GPU and of the CPU.
+	// Setting a power model after the first sample lays the measurements out again.
+	if (_sample.power.empty() || gpu_energy != _gpu_energy || cpu_energy != _cpu_energy)
+	{
+		_sample.power.clear();
+		_gpu_energy = gpu_energy;
+		_cpu_energy = cpu_energy;
+
+		for (const auto &domain : domains)
+		{
+			_sample.power.add(domain.name + " frequency", "MHz", true);
+		}
+
+		_gpu_busy = gpu >= 0 && _sample.gpu.find("GPU cycles", _gpu_cycles_id);
+		if (_gpu_busy)
+		{
+			_sample.power.add("GPU busy time", "ms", true);
+			if (_gpu_energy)
+			{
+				_sample.power.add("GPU energy", "mJ", true);
+			}
+		}
+
+		_cpu_busy = _sample.cpu.find("CPU cycles", _cpu_cycles_id);
+		if (_cpu_busy)
+		{
+			_sample.power.add("CPU busy time", "ms", true);
+			if (_cpu_energy)
+			{
+				_sample.power.add("CPU energy", "mJ", true);
+			}
+		}
+	}
+
+	MeasurementsSnapshot::Id id = 0;
+	for (size_t i = 0; i < domains.size(); ++i)
+	{
+		_sample.power.set(id++, average_frequency(_begin_frequencies[i], _end_frequencies[i]) / 1e6);
+	}
+
+	// Energy of the busy time only, the power model doesn't cover idle power
+	const auto busy = [&](int domain, MeasurementsSnapshot::Id cycles_id, const MeasurementsSnapshot &snapshot, bool energy) {
+		const uint64_t frequency = domain >= 0 ? average_frequency(_begin_frequencies[domain], _end_frequencies[domain]) : 0;
+		const double   cycles    = static_cast<double>(snapshot.value(cycles_id).v.integer);
+		const double   busy_s    = frequency != 0 ? cycles / static_cast<double>(frequency) : 0.0;
+
+		_sample.power.set(id++, busy_s * 1e3);
+		if (energy)
+		{
+			_sample.power.set(id++, domain >= 0 ? busy_s * _dvfs->power_mw(domain, frequency) : 0.0);
+		}
+	};
+
+	if (_gpu_busy)
+	{
+		busy(gpu, _gpu_cycles_id, _sample.gpu, _gpu_energy);
+	}
+
+	// The CPU cycles are counted at the clock of the cluster the thread was on when stopped
+	if (_cpu_busy)
+	{
+		busy(cpu >= 0 ? _dvfs->cpu_domain(cpu) : -1, _cpu_cycles_id, _sample.cpu, _cpu_energy);
+	}
+}
+
+void HWCPipe::calibrate_gpu_clock(uint64_t host_before, uint64_t host_after, uint64_t gpu_timestamp)
+{
+	if (_gpu_clock_calibrated)
+	{
+		return;
+	}
+
+	// kbase timestamps its dumps with the raw monotonic clock, older kernels may use CLOCK_MONOTONIC
+	if (within(gpu_timestamp, host_before, host_after))
+	{
+		_gpu_clock_offset = 0;
+	}
+	else
+	{
+		const uint64_t raw       = clock_ns(CLOCK_MONOTONIC_RAW);
+		const uint64_t monotonic = clock_ns(CLOCK_MONOTONIC);
+		const int64_t  offset    = static_cast<int64_t>(raw - monotonic);
+
+		if (within(gpu_timestamp + offset, host_before, host_after))
+		{
+			_gpu_clock_offset = offset;
+		}
+		else
+		{
+			// Unknown clock, align the dump with the middle of the host window
+			_gpu_clock_offset = static_cast<int64_t>(host_before / 2 + host_after / 2 - gpu_timestamp);
+		}
+	}
+
+	_gpu_clock_calibrated = true;
+}
+
+uint64_t HWCPipe::gpu_to_host(uint64_t timestamp) const
+{
+	return timestamp + static_cast<uint64_t>(_gpu_clock_offset);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "dvfs.h"
+#include "measurements_snapshot.h"
+#include "pmu_counter.h"
+
+#if defined(__ANDROID__)
+#	include "mali_counter.h"
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class MaliCounter;
+
+/** CPU and GPU measurements of one start()/stop() interval. */
+struct HWCPipeSample
+{
+	uint64_t             begin_ns{0};     /**< Start of the interval on the host, on CLOCK_MONOTONIC_RAW. */
+	uint64_t             end_ns{0};       /**< End of the interval on the host, on CLOCK_MONOTONIC_RAW. */
+	uint64_t             gpu_begin_ns{0}; /**< Time the GPU counters were started, mapped onto CLOCK_MONOTONIC_RAW. */
+	uint64_t             gpu_end_ns{0};   /**< Time the GPU counters were stopped, mapped onto CLOCK_MONOTONIC_RAW. */
+	MeasurementsSnapshot cpu{};           /**< CPU measurements, empty without CPU counters. */
+	MeasurementsSnapshot gpu{};           /**< GPU measurements, empty without GPU counters. */
+	MeasurementsSnapshot power{};         /**< Clock frequencies, busy times and estimated energy, empty without DVFS. */
+};
+
+/** Session sampling the CPU and GPU counters together.
+ *
+ * The instruments are sampled back to back in a fixed order, chosen so that
+ * the CPU sample sits as close as possible to the GPU dump:
+ *
+ *  - start(): GPU dump (waiting for it), host timestamp, CPU counters reset.
+ *  - stop(): GPU dump requested, CPU counters read, host timestamp, then
+ *    wait for the GPU dump.
+ *
+ * Host times are read from CLOCK_MONOTONIC_RAW and the GPU dump times are
+ * mapped onto the same clock, so the skew between both is visible in the
+ * sample rather than hidden in the measurements.
+ *
+ * The GPU and CPU cluster frequencies are read at start() and stop(), and
+ * the cycle counts are turned into busy times at the average of both, as
+ * DVFS makes a cycle count meaningless without its clock. With a power
+ * model set on @ref dvfs, the busy times give the energy of the interval:
+ * "GPU energy" is reported once the GPU has one, "CPU energy" once every
+ * CPU cluster has one.
+ */
+class HWCPipe
+{
+  public:
+	/** Constructor
+	 *
+	 * Instruments that can't be created are logged and left out.
+	 *
+	 * @param[in] enable_cpu  Sample the PMU counters.
+	 * @param[in] enable_gpu  Sample the Mali counters (Android only).
+	 * @param[in] enable_dvfs Read the GPU and CPU cluster frequencies.
+	 */
+	explicit HWCPipe(bool enable_cpu = true, bool enable_gpu = true, bool enable_dvfs = true);
+
+	/** Default destructor. */
+	~HWCPipe();
+
+	/** Prevent instances of this class from being copy constructed */
+	HWCPipe(const HWCPipe &) = delete;
+	/** Prevent instances of this class from being copied */
+	HWCPipe &operator=(const HWCPipe &) = delete;
+
+	/** Start sampling. */
+	void start();
+
+	/** Stop sampling and update @ref sample. */
+	void stop();
+
+	/** Get the last sample.
+	 *
+	 * @return the measurements of the last start()/stop() interval.
+	 */
+	const HWCPipeSample &sample() const
+	{
+		return _sample;
+	}
+
+	/** Get the CPU counters.
+	 *
+	 * @return the PMU counters, or nullptr if they are disabled.
+	 */
+	PMUCounter *cpu()
+	{
+		return _cpu.get();
+	}
+
+	/** Get the GPU counters.
+	 *
+	 * @return the Mali counters, or nullptr if they are disabled.
+	 */
+	MaliCounter *gpu()
+	{
+#if defined(__ANDROID__)
+		return _gpu.get();
+#else
+		return nullptr;
+#endif
+	}
+
+	/** Get the frequency monitor, to set the power models of the domains.
+	 *
+	 * @return the monitor, or nullptr if it is disabled or no domain was found.
+	 */
+	DVFSMonitor *dvfs()
+	{
+		return _dvfs.get();
+	}
+
+  private:
+	uint64_t gpu_to_host(uint64_t timestamp) const;
+	void     calibrate_gpu_clock(uint64_t host_before, uint64_t host_after, uint64_t gpu_timestamp);
+	void     update_power(int cpu);
+
+	std::unique_ptr<PMUCounter> _cpu{};
+#if defined(__ANDROID__)
+	std::unique_ptr<MaliCounter> _gpu{};
+#endif
+	int64_t                      _gpu_clock_offset{0}; /**< Offset added to the GPU timestamps to map them onto the host clock. */
+	bool                         _gpu_clock_calibrated{false};
+	std::unique_ptr<DVFSMonitor> _dvfs{};
+	std::vector<uint64_t>        _begin_frequencies{}; /**< Frequency of each DVFS domain at start(), in Hz. */
+	std::vector<uint64_t>        _end_frequencies{};   /**< Frequency of each DVFS domain at stop(), in Hz. */
+	MeasurementsSnapshot::Id     _gpu_cycles_id{0};
+	MeasurementsSnapshot::Id     _cpu_cycles_id{0};
+	bool                         _gpu_busy{false};   /**< Is the GPU busy time part of the power measurements ? */
+	bool                         _cpu_busy{false};   /**< Is the CPU busy time part of the power measurements ? */
+	bool                         _gpu_energy{false}; /**< Is the GPU energy part of the power measurements ? */
+	bool                         _cpu_energy{false}; /**< Is the CPU energy part of the power measurements ? */
+	HWCPipeSample                _sample{};
+};
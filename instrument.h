@@ -25,6 +25,7 @@
 #pragma once
 
 #include "measurement.h"
+#include "measurements_snapshot.h"
 
 #include <map>
 #include <memory>
@@ -104,6 +105,40 @@ class Instrument
 		return MeasurementsMap();
 	}
 
+	/** Fill a snapshot with the latest measurements.
+     *
+     * The first call lays the empty snapshot out, later calls only update its
+     * values in place. The default implementation copies @ref measurements,
+     * instruments override it to fill the snapshot without allocating.
+     *
+     * @param[in,out] snapshot Snapshot to fill, laid out by this instrument or empty.
+     */
+	virtual void snapshot(MeasurementsSnapshot &snapshot) const
+	{
+		const MeasurementsMap map = measurements();
+
+		if (!snapshot.check_layout(map.size()))
+		{
+			for (const auto &measurement : map)
+			{
+				snapshot.add(measurement.first, measurement.second.unit(), measurement.second.value().is_floating_point);
+			}
+		}
+
+		MeasurementsSnapshot::Id id = 0;
+		for (const auto &measurement : map)
+		{
+			if (measurement.second.value().is_floating_point)
+			{
+				snapshot.set(id++, measurement.second.value().v.floating_point);
+			}
+			else
+			{
+				snapshot.set(id++, measurement.second.value().v.integer);
+			}
+		}
+	}
+
 	/** Return the latest test measurements.
      *
      * @return the latest test measurements.
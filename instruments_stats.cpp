@@ -25,6 +25,7 @@
 #include "instruments_stats.h"
 
 #include <algorithm>
+#include <cmath>
 #include <numeric>
 
 /** Perform an index sort of a given vector.
@@ -76,3 +77,280 @@ InstrumentsStats::InstrumentsStats(const std::vector<Measurement> &measurements)
 	auto variance = sq_sum / measurements.size();
 	_stddev       = Measurement::Value::relative_standard_deviation(variance, _mean);
 }
+
+P2Quantile::P2Quantile(double p) :
+    _p(p),
+    _increments{{0.0, p / 2, p, (1 + p) / 2, 1.0}}
+{
+}
+
+void P2Quantile::add(double value)
+{
+	// Store the first values until there are enough to place the markers
+	if (_count < _heights.size())
+	{
+		_heights[_count++] = value;
+
+		if (_count == _heights.size())
+		{
+			std::sort(_heights.begin(), _heights.end());
+			for (size_t i = 0; i < _heights.size(); ++i)
+			{
+				_positions[i] = static_cast<double>(i + 1);
+				_desired[i]   = 1 + 4 * _increments[i];
+			}
+		}
+		return;
+	}
+
+	_count++;
+
+	// Find the cell of the value, extending the range if needed
+	size_t cell;
+	if (value < _heights[0])
+	{
+		_heights[0] = value;
+		cell        = 0;
+	}
+	else if (value >= _heights[4])
+	{
+		_heights[4] = value;
+		cell        = 3;
+	}
+	else
+	{
+		cell = 0;
+		while (value >= _heights[cell + 1])
+		{
+			cell++;
+		}
+	}
+
+	for (size_t i = cell + 1; i < _positions.size(); ++i)
+	{
+		_positions[i] += 1;
+	}
+	for (size_t i = 0; i < _desired.size(); ++i)
+	{
+		_desired[i] += _increments[i];
+	}
+
+	// Move the middle markers towards their desired position
+	for (size_t i = 1; i < 4; ++i)
+	{
+		const double offset = _desired[i] - _positions[i];
+
+		if ((offset >= 1 && _positions[i + 1] - _positions[i] > 1) || (offset <= -1 && _positions[i - 1] - _positions[i] < -1))
+		{
+			const double d = offset > 0 ? 1.0 : -1.0;
+
+			// Piecewise parabolic prediction, falling back to linear if it leaves the neighbours' range
+			const double parabolic = _heights[i] + d / (_positions[i + 1] - _positions[i - 1]) *
+			                                           ((_positions[i] - _positions[i - 1] + d) * (_heights[i + 1] - _heights[i]) / (_positions[i + 1] - _positions[i]) +
+			                                            (_positions[i + 1] - _positions[i] - d) * (_heights[i] - _heights[i - 1]) / (_positions[i] - _positions[i - 1]));
+
+			if (_heights[i - 1] < parabolic && parabolic < _heights[i + 1])
+			{
+				_heights[i] = parabolic;
+			}
+			else
+			{
+				const size_t neighbour = d > 0 ? i + 1 : i - 1;
+				_heights[i] += d * (_heights[neighbour] - _heights[i]) / (_positions[neighbour] - _positions[i]);
+			}
+
+			_positions[i] += d;
+		}
+	}
+}
+
+double P2Quantile::rank(double x) const
+{
+	// Number of values below x, interpolated between the markers
+	if (x < _heights[0])
+	{
+		return 0.0;
+	}
+	if (x >= _heights[4])
+	{
+		return _positions[4];
+	}
+
+	size_t cell = 0;
+	while (x >= _heights[cell + 1])
+	{
+		cell++;
+	}
+
+	const double width = _heights[cell + 1] - _heights[cell];
+	const double t     = width > 0 ? (x - _heights[cell]) / width : 0.0;
+	return _positions[cell] + t * (_positions[cell + 1] - _positions[cell]);
+}
+
+void P2Quantile::merge(const P2Quantile &other)
+{
+	// Replay the values of estimators that haven't placed their markers yet
+	if (other._count < other._heights.size())
+	{
+		for (size_t i = 0; i < other._count; ++i)
+		{
+			add(other._heights[i]);
+		}
+		return;
+	}
+
+	if (_count < _heights.size())
+	{
+		const std::array<double, 5> values = _heights;
+		const size_t                count  = _count;
+
+		*this = other;
+		for (size_t i = 0; i < count; ++i)
+		{
+			add(values[i]);
+		}
+		return;
+	}
+
+	// The combined rank is piecewise linear between the heights of both estimators
+	std::array<double, 10> breakpoints;
+	std::copy(_heights.begin(), _heights.end(), breakpoints.begin());
+	std::copy(other._heights.begin(), other._heights.end(), breakpoints.begin() + 5);
+	std::sort(breakpoints.begin(), breakpoints.end());
+
+	std::array<double, 10> ranks;
+	for (size_t i = 0; i < breakpoints.size(); ++i)
+	{
+		ranks[i] = rank(breakpoints[i]) + other.rank(breakpoints[i]);
+	}
+
+	const size_t          count = _count + other._count;
+	std::array<double, 5> heights;
+	heights[0] = breakpoints.front();
+	heights[4] = breakpoints.back();
+
+	for (size_t i = 1; i < 4; ++i)
+	{
+		const double target = 1 + _increments[i] * (count - 1);
+		size_t       cell   = 0;
+
+		while (cell + 2 < breakpoints.size() && ranks[cell + 1] < target)
+		{
+			cell++;
+		}
+
+		const double span = ranks[cell + 1] - ranks[cell];
+		const double t    = span > 0 ? std::min(std::max((target - ranks[cell]) / span, 0.0), 1.0) : 0.0;
+		heights[i]        = breakpoints[cell] + t * (breakpoints[cell + 1] - breakpoints[cell]);
+	}
+
+	_count   = count;
+	_heights = heights;
+
+	for (size_t i = 0; i < _positions.size(); ++i)
+	{
+		_desired[i] = 1 + _increments[i] * (count - 1);
+		// Positions must stay integers and strictly increasing
+		_positions[i] = std::round(_desired[i]);
+		if (i > 0)
+		{
+			_positions[i] = std::max(_positions[i], _positions[i - 1] + 1);
+		}
+	}
+	_positions[4] = static_cast<double>(count);
+	for (size_t i = 4; i-- > 1;)
+	{
+		_positions[i] = std::min(_positions[i], _positions[i + 1] - 1);
+	}
+}
+
+double P2Quantile::value() const
+{
+	if (_count == 0)
+	{
+		return 0.0;
+	}
+
+	if (_count < _heights.size())
+	{
+		std::array<double, 5> sorted = _heights;
+		std::sort(sorted.begin(), sorted.begin() + _count);
+		return sorted[static_cast<size_t>(_p * (_count - 1) + 0.5)];
+	}
+
+	return _heights[2];
+}
+
+OnlineStats::OnlineStats() :
+    _median(0.5),
+    _p95(0.95),
+    _p99(0.99)
+{
+}
+
+void OnlineStats::add(double value)
+{
+	if (_count == 0)
+	{
+		_min = value;
+		_max = value;
+	}
+	else
+	{
+		_min = std::min(_min, value);
+		_max = std::max(_max, value);
+	}
+
+	_count++;
+	const double delta = value - _mean;
+	_mean += delta / _count;
+	_m2 += delta * (value - _mean);
+
+	_median.add(value);
+	_p95.add(value);
+	_p99.add(value);
+}
+
+void OnlineStats::add(const Measurement &measurement)
+{
+	const Measurement::Value &value = measurement.value();
+	add(value.is_floating_point ? value.v.floating_point : static_cast<double>(value.v.integer));
+}
+
+void OnlineStats::merge(const OnlineStats &other)
+{
+	if (other._count == 0)
+	{
+		return;
+	}
+
+	if (_count == 0)
+	{
+		*this = other;
+		return;
+	}
+
+	// Combine the means and squared differences of both sets (Chan et al.)
+	const size_t count = _count + other._count;
+	const double delta = other._mean - _mean;
+
+	_mean += delta * other._count / count;
+	_m2 += other._m2 + delta * delta * (static_cast<double>(_count) * other._count / count);
+	_min   = std::min(_min, other._min);
+	_max   = std::max(_max, other._max);
+	_count = count;
+
+	_median.merge(other._median);
+	_p95.merge(other._p95);
+	_p99.merge(other._p99);
+}
+
+double OnlineStats::variance() const
+{
+	return _count > 0 ? _m2 / _count : 0.0;
+}
+
+double OnlineStats::relative_standard_deviation() const
+{
+	return 100.0 * std::sqrt(variance()) / _mean;
+}
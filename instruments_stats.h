@@ -26,6 +26,8 @@
 
 #include "measurement.h"
 
+#include <array>
+#include <cstddef>
 #include <vector>
 
 /** Generate common statistics for a set of measurements
@@ -76,3 +78,147 @@ class InstrumentsStats
 	Measurement::Value _mean;
 	double             _stddev;
 };
+
+/** Streaming estimator of one quantile, with the P² algorithm.
+ *
+ * Keeps five markers whose heights approximate the minimum, the quantile,
+ * the maximum and the quantiles half way between, and adjusts them as values
+ * are added. Uses constant memory whatever the number of values.
+ */
+class P2Quantile
+{
+  public:
+	/** Constructor
+     *
+     * @param[in] p Quantile to estimate, between 0 and 1.
+     */
+	explicit P2Quantile(double p);
+
+	/** Add a value
+     *
+     * @param[in] value Value to add.
+     */
+	void add(double value);
+
+	/** Merge the values added to another estimator of the same quantile.
+     *
+     * The markers are placed on the combined distribution, as interpolated
+     * from the markers of both estimators, so the result is an approximation
+     * of the estimate the values would have given when added to one estimator.
+     *
+     * @param[in] other Estimator to merge.
+     */
+	void merge(const P2Quantile &other);
+
+	/** The estimated quantile, 0 if no value was added
+     */
+	double value() const;
+
+	/** The number of values added
+     */
+	size_t count() const
+	{
+		return _count;
+	}
+
+  private:
+	double rank(double x) const;
+
+	double                _p;
+	size_t                _count{0};
+	std::array<double, 5> _heights{};
+	std::array<double, 5> _positions{};
+	std::array<double, 5> _desired{};
+	std::array<double, 5> _increments{};
+};
+
+/** Generate common statistics for a stream of measurements
+ *
+ * Unlike @ref InstrumentsStats the measurements aren't stored: min, max,
+ * mean and variance are updated with Welford's method and the median,
+ * p95 and p99 are estimated with @ref P2Quantile, in constant memory.
+ * Accumulators filled on different threads can be merged.
+ */
+class OnlineStats
+{
+  public:
+	/** Default constructor */
+	OnlineStats();
+
+	/** Add a value
+     *
+     * @param[in] value Value to add.
+     */
+	void add(double value);
+
+	/** Add a measurement
+     *
+     * @param[in] measurement Measurement to add.
+     */
+	void add(const Measurement &measurement);
+
+	/** Merge the values added to another accumulator.
+     *
+     * @param[in] other Accumulator to merge.
+     */
+	void merge(const OnlineStats &other);
+
+	/** The number of values added
+             */
+	size_t count() const
+	{
+		return _count;
+	}
+	/** The minimum value
+             */
+	double min() const
+	{
+		return _min;
+	}
+	/** The maximum value
+             */
+	double max() const
+	{
+		return _max;
+	}
+	/** The average of all the values
+             */
+	double mean() const
+	{
+		return _mean;
+	}
+	/** The variance of the values
+             */
+	double variance() const;
+	/** The relative standard deviation of the values, as a percentage
+             */
+	double relative_standard_deviation() const;
+	/** The estimated median
+             */
+	double median() const
+	{
+		return _median.value();
+	}
+	/** The estimated 95th percentile
+             */
+	double p95() const
+	{
+		return _p95.value();
+	}
+	/** The estimated 99th percentile
+             */
+	double p99() const
+	{
+		return _p99.value();
+	}
+
+  private:
+	size_t     _count{0};
+	double     _min{0.0};
+	double     _max{0.0};
+	double     _mean{0.0};
+	double     _m2{0.0}; /**< Sum of the squared differences to the mean. */
+	P2Quantile _median;
+	P2Quantile _p95;
+	P2Quantile _p99;
+};
@@ -23,8 +23,266 @@
  */
 #include "mali_counter.h"
 
+#include "pmu.h"
+
+#include <cmath>
+#include <type_traits>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	include <arm_neon.h>
+#endif
+
 namespace
 {
+/** Unit and measurement name of the counters HWCPipe knows about */
+struct MaliCounterDescription
+{
+	const char *name;
+	const char *unit;
+	const char *label;
+};
+
+const MaliCounterDescription counter_descriptions[] = {
+    {"GPU_ACTIVE", "cycles", "GPU cycles"},
+    {"JS0_JOBS", "jobs", "Fragment jobs"},
+    {"JS1_JOBS", "jobs", "Vertex/compute jobs"},
+    {"L2_READ_LOOKUP", "cache lookups", "L2 cache read lookups"},
+    {"L2_EXT_READ", "transactions", "L2 cache external reads"},
+    {"L2_EXT_AR_STALL", "stall cycles", "L2 cache external read stalls"},
+    {"L2_WRITE_LOOKUP", "cache lookups", "L2 cache write lookups"},
+    {"L2_EXT_WRITE", "transactions", "L2 cache external writes"},
+    {"L2_EXT_W_STALL", "stall cycles", "L2 cache external write stalls"},
+    {"L2_EXT_READ_BEATS", "bus cycles", "L2 cache external read beats"},
+    {"L2_EXT_WRITE_BEATS", "bus cycles", "L2 cache external write beats"},
+    {"TILER_ACTIVE", "cycles", "Tiler cycles"},
+    {"TI_ACTIVE", "cycles", "Tiler cycles"},
+    {"FRAG_ACTIVE", "cycles", "Fragment cycles"},
+    {"COMPUTE_ACTIVE", "cycles", "Compute cycles"},
+    {"EXEC_INSTR_COUNT", "instructions", "Shader instructions"},
+    {"ARITH_WORDS", "instructions", "Shader instructions"},
+    {"TEX_COORD_ISSUE", "cycles", "Texture cycles"},
+    {"TEX_ISSUES", "cycles", "Texture cycles"},
+    {"LS_MEM_READ_FULL", "cycles", "Load/store full read cycles"},
+    {"LS_MEM_READ_SHORT", "cycles", "Load/store partial read cycles"},
+    {"LS_MEM_WRITE_FULL", "cycles", "Load/store full write cycles"},
+    {"LS_MEM_WRITE_SHORT", "cycles", "Load/store partial write cycles"},
+    {"LS_ISSUES", "cycles", "Load/store cycles"},
+    {"FRAG_QUADS_RAST", "quads", "Fragment quads rasterized"},
+    {"FRAG_PTILES", "tiles", "Fragment tiles"},
+    {"FRAG_THREADS", "threads", "Fragment threads"},
+    {"FRAG_NUM_TILES", "tiles", "Fragment tiles"},
+};
+
+constexpr const char *const default_counters[] = {
+    "GPU_ACTIVE",
+    "JS0_JOBS",
+    "JS1_JOBS",
+    "L2_READ_LOOKUP",
+    "L2_EXT_READ",
+    "L2_EXT_AR_STALL",
+    "L2_WRITE_LOOKUP",
+    "L2_EXT_WRITE",
+    "L2_EXT_W_STALL",
+    "L2_EXT_READ_BEATS",
+    "L2_EXT_WRITE_BEATS",
+};
+
+constexpr const char *const shading_counters[] = {
+    "GPU_ACTIVE",
+    "JS0_JOBS",
+    "JS1_JOBS",
+    "L2_READ_LOOKUP",
+    "L2_EXT_READ",
+    "L2_EXT_AR_STALL",
+    "L2_WRITE_LOOKUP",
+    "L2_EXT_WRITE",
+    "L2_EXT_W_STALL",
+    "L2_EXT_READ_BEATS",
+    "L2_EXT_WRITE_BEATS",
+    // Bifrost
+    "TILER_ACTIVE",
+    "FRAG_ACTIVE",
+    "COMPUTE_ACTIVE",
+    "EXEC_INSTR_COUNT",
+    "TEX_COORD_ISSUE",
+    "LS_MEM_READ_FULL",
+    "LS_MEM_READ_SHORT",
+    "LS_MEM_WRITE_FULL",
+    "LS_MEM_WRITE_SHORT",
+    "FRAG_QUADS_RAST",
+    "FRAG_PTILES",
+    // Midgard
+    "TI_ACTIVE",
+    "ARITH_WORDS",
+    "TEX_ISSUES",
+    "LS_ISSUES",
+    "FRAG_THREADS",
+    "FRAG_NUM_TILES",
+};
+
+constexpr const char *const always_on_counters[] = {
+    "GPU_ACTIVE",
+    "JS0_JOBS",
+    "JS1_JOBS",
+    "L2_EXT_READ_BEATS",
+    "L2_EXT_WRITE_BEATS",
+};
+
+/** Compare the values of a counter across the cores or slices */
+MaliImbalance compute_imbalance(const std::vector<uint64_t> &values)
+{
+	MaliImbalance imbalance;
+
+	if (values.empty())
+	{
+		return imbalance;
+	}
+
+	double   sum = 0.0;
+	uint64_t max = 0;
+	for (const uint64_t value : values)
+	{
+		sum += static_cast<double>(value);
+		max = std::max(max, value);
+	}
+
+	const double mean = sum / values.size();
+	if (mean <= 0.0)
+	{
+		return imbalance;
+	}
+
+	double squares = 0.0;
+	for (const uint64_t value : values)
+	{
+		const double deviation = static_cast<double>(value) - mean;
+		squares += deviation * deviation;
+	}
+
+	imbalance.max_over_mean            = static_cast<double>(max) / mean;
+	imbalance.coefficient_of_variation = std::sqrt(squares / values.size()) / mean;
+	return imbalance;
+}
+
+const MaliCounterDescription *find_counter_description(const std::string &name)
+{
+	for (const auto &description : counter_descriptions)
+	{
+		if (name == description.name)
+		{
+			return &description;
+		}
+	}
+	return nullptr;
+}
+
+/** Properties of a sample used to compute the derived metrics */
+struct DerivedMetricContext
+{
+	double timespan_s;
+	double gpu_freq_hz;
+	double num_l2_slices;
+};
+
+/** Formula of a metric derived from the counters of a GPU family */
+struct DerivedMetricFormula
+{
+	const char *label;
+	const char *unit;
+	int         families; /**< Bitmask of the mali_userspace::MaliGPUFamily the formula applies to. */
+	const char *inputs[DERIVED_METRIC_MAX_INPUTS];
+	double (*compute)(const double *inputs, const DerivedMetricContext &context);
+};
+
+double safe_ratio(double numerator, double denominator)
+{
+	return denominator != 0.0 ? numerator / denominator : 0.0;
+}
+
+const int midgard = 1 << mali_userspace::MALI_FAMILY_MIDGARD;
+const int bifrost = 1 << mali_userspace::MALI_FAMILY_BIFROST;
+
+// Mali GPUs have a 128-bit external bus, so each beat transfers 16 bytes
+const double bytes_per_beat = 16.0;
+// Fragment shading works on 16x16 pixel tiles
+const double pixels_per_tile = 256.0;
+
+const DerivedMetricFormula derived_metric_formulas[] = {
+    {"GPU utilization", "%", midgard | bifrost, {"GPU_ACTIVE"}, [](const double *in, const DerivedMetricContext &context) {
+	     return 100.0 * safe_ratio(in[0], context.timespan_s * context.gpu_freq_hz);
+     }},
+    // Busy time at the clock the GPU ran at, which DVFS may have lowered below the maximum
+    {"GPU busy time", "ms", midgard | bifrost, {"GPU_ACTIVE"}, [](const double *in, const DerivedMetricContext &context) {
+	     return 1e3 * safe_ratio(in[0], context.gpu_freq_hz);
+     }},
+    {"External read bandwidth", "MB/s", midgard | bifrost, {"L2_EXT_READ_BEATS"}, [](const double *in, const DerivedMetricContext &context) {
+	     return safe_ratio(in[0] * bytes_per_beat, context.timespan_s) / 1e6;
+     }},
+    {"External write bandwidth", "MB/s", midgard | bifrost, {"L2_EXT_WRITE_BEATS"}, [](const double *in, const DerivedMetricContext &context) {
+	     return safe_ratio(in[0] * bytes_per_beat, context.timespan_s) / 1e6;
+     }},
+    // Stalls are summed over the L2 slices, each of which can stall every cycle
+    {"External read stall rate", "%", midgard | bifrost, {"L2_EXT_AR_STALL", "GPU_ACTIVE"}, [](const double *in, const DerivedMetricContext &context) {
+	     return 100.0 * safe_ratio(in[0], in[1] * context.num_l2_slices);
+     }},
+    {"External write stall rate", "%", midgard | bifrost, {"L2_EXT_W_STALL", "GPU_ACTIVE"}, [](const double *in, const DerivedMetricContext &context) {
+	     return 100.0 * safe_ratio(in[0], in[1] * context.num_l2_slices);
+     }},
+    {"Fragment share", "%", midgard | bifrost, {"FRAG_ACTIVE", "COMPUTE_ACTIVE"}, [](const double *in, const DerivedMetricContext &) {
+	     return 100.0 * safe_ratio(in[0], in[0] + in[1]);
+     }},
+    {"Compute share", "%", midgard | bifrost, {"FRAG_ACTIVE", "COMPUTE_ACTIVE"}, [](const double *in, const DerivedMetricContext &) {
+	     return 100.0 * safe_ratio(in[1], in[0] + in[1]);
+     }},
+    {"Overdraw", "fragments/pixel", midgard, {"FRAG_THREADS", "FRAG_NUM_TILES"}, [](const double *in, const DerivedMetricContext &) {
+	     return safe_ratio(in[0], in[1] * pixels_per_tile);
+     }},
+    // Bifrost doesn't count fragment threads, use the rasterized quads of 4 fragments instead
+    {"Overdraw", "fragments/pixel", bifrost, {"FRAG_QUADS_RAST", "FRAG_PTILES"}, [](const double *in, const DerivedMetricContext &) {
+	     return safe_ratio(in[0] * 4.0, in[1] * pixels_per_tile);
+     }},
+};
+
+/** Add 32-bit counters to 64-bit running sums, @p count must be a multiple of 4 */
+void accumulate(uint64_t *sum, const uint32_t *values, size_t count)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (size_t i = 0; i < count; i += 4)
+	{
+		const uint32x4_t v = vld1q_u32(values + i);
+		vst1q_u64(sum + i, vaddw_u32(vld1q_u64(sum + i), vget_low_u32(v)));
+		vst1q_u64(sum + i + 2, vaddw_u32(vld1q_u64(sum + i + 2), vget_high_u32(v)));
+	}
+#else
+	for (size_t i = 0; i < count; ++i)
+	{
+		sum[i] += values[i];
+	}
+#endif
+}
+
+/** Add 64-bit counters to 64-bit running sums, @p count must be a multiple of 4 */
+void accumulate(uint64_t *sum, const uint64_t *values, size_t count)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (size_t i = 0; i < count; i += 2)
+	{
+		vst1q_u64(sum + i, vaddq_u64(vld1q_u64(sum + i), vld1q_u64(values + i)));
+	}
+#else
+	for (size_t i = 0; i < count; ++i)
+	{
+		sum[i] += values[i];
+	}
+#endif
+}
+
+/** Each bit of a hwcnt reader block bitmask enables a group of 4 counters */
+uint32_t counter_enable_bit(int index)
+{
+	return 1u << (index / 4);
+}
+
 struct MaliHWInfo
 {
 	unsigned mp_count;
@@ -33,19 +291,24 @@ struct MaliHWInfo
 	unsigned p_value;
 	unsigned core_mask;
 	unsigned l2_slices;
+	unsigned gpu_freq_khz_max;
+	unsigned gpu_freq_khz_min;
 };
 
-MaliHWInfo get_mali_hw_info(const char *path)
+/** Check the kbase ABI version and set the context flags, needed before any other ioctl
+ *
+ * The interface is probed here once per device, so later ioctls go straight
+ * to the ABI the driver speaks instead of failing over from the legacy one.
+ *
+ * @return the interface of the driver.
+ */
+mali_userspace::KbaseBackend kbase_handshake(int fd)
 {
-	int fd = open(path, O_RDWR);        // NOLINT
+	mali_userspace::KbaseBackend backend = mali_userspace::KbaseBackend::LegacyUK;
 
-	if (fd < 0)
 	{
-		throw std::runtime_error("Failed to get HW info.");
-	}
-
-	{
-		mali_userspace::kbase_uk_hwcnt_reader_version_check_args version_check_args;
+		mali_userspace::kbase_uk_hwcnt_reader_version_check_args version_check_args;        // NOLINT
+		memset(&version_check_args, 0, sizeof(version_check_args));
 		version_check_args.header.id = mali_userspace::UKP_FUNC_ID_CHECK_VERSION;        // NOLINT
 		version_check_args.major     = 10;
 		version_check_args.minor     = 2;
@@ -55,12 +318,17 @@ MaliHWInfo get_mali_hw_info(const char *path)
 			mali_userspace::kbase_ioctl_version_check _version_check_args = {0, 0};
 			if (ioctl(fd, KBASE_IOCTL_VERSION_CHECK, &_version_check_args) < 0)
 			{
-				close(fd);
 				throw std::runtime_error("Failed to check version.");
 			}
+			backend = mali_userspace::KbaseBackend::Ioctl;
+		}
+		else if (version_check_args.major < 10)
+		{
+			throw std::runtime_error("Unsupported ABI version.");
 		}
 	}
 
+	if (backend == mali_userspace::KbaseBackend::LegacyUK)
 	{
 		mali_userspace::kbase_uk_hwcnt_reader_set_flags flags;        // NOLINT
 		memset(&flags, 0, sizeof(flags));
@@ -69,151 +337,332 @@ MaliHWInfo get_mali_hw_info(const char *path)
 
 		if (mali_userspace::mali_ioctl(fd, flags) != 0)
 		{
-			mali_userspace::kbase_ioctl_set_flags _flags = {1u << 1};
-			if (ioctl(fd, KBASE_IOCTL_SET_FLAGS, &_flags) < 0)
-			{
-				close(fd);
-				throw std::runtime_error("Failed settings flags ioctl.");
-			}
+			throw std::runtime_error("Failed settings flags ioctl.");
 		}
+		return backend;
+	}
+
+	mali_userspace::kbase_ioctl_set_flags _flags = {1u << 1};
+	if (ioctl(fd, KBASE_IOCTL_SET_FLAGS, &_flags) < 0)
+	{
+		throw std::runtime_error("Failed settings flags ioctl.");
+	}
+
+	// Drivers that can enumerate the kinstr_prfcnt blocks have it, and may no longer have the hwcnt reader
+	mali_userspace::kbase_ioctl_kinstr_prfcnt_enum_info enum_info = {};
+	if (ioctl(fd, KBASE_IOCTL_KINSTR_PRFCNT_ENUM_INFO, &enum_info) == 0 && enum_info.info_item_count > 0)
+	{
+		backend = mali_userspace::KbaseBackend::KinstrPrfcnt;
 	}
 
+	return backend;
+}
+
+/** Read a little endian value of the GPU properties blob */
+template <typename T>
+T read_le(const uint8_t *p)
+{
+	T value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&value, p, sizeof(T));
+#else
+	value = 0;
+	for (size_t i = 0; i < sizeof(T); ++i)
 	{
-		MaliHWInfo hw_info;        // NOLINT
-		memset(&hw_info, 0, sizeof(hw_info));
-		mali_userspace::kbase_uk_gpuprops props = {};
-		props.header.id                         = mali_userspace::KBASE_FUNC_GPU_PROPS_REG_DUMP;
-		if (mali_ioctl(fd, props) == 0)
+		value |= static_cast<T>(static_cast<T>(p[i]) << (8 * i));
+	}
+#endif
+	return value;
+}
+
+/** Number of property ids covered by the property lookup table */
+constexpr uint32_t gpu_property_id_count = 128;
+
+/** Index of each property in gpu_property_mapping, -1 for the properties we don't read */
+const std::array<int, gpu_property_id_count> &gpu_property_index()
+{
+	static const std::array<int, gpu_property_id_count> index = [] {
+		std::array<int, gpu_property_id_count> result;
+		result.fill(-1);
+		for (int i = 0; mali_userspace::gpu_property_mapping[i].type; i++)
 		{
-			hw_info.gpu_id  = props.props.core_props.product_id;
-			hw_info.r_value = props.props.core_props.major_revision;
-			hw_info.p_value = props.props.core_props.minor_revision;
-			for (uint32_t i = 0; i < props.props.coherency_info.num_core_groups; i++)
-				hw_info.core_mask |= props.props.coherency_info.group[i].core_mask;
-			hw_info.mp_count  = __builtin_popcountll(hw_info.core_mask);
-			hw_info.l2_slices = props.props.l2_props.num_l2_slices;
+			result[mali_userspace::gpu_property_mapping[i].type] = i;
+		}
+		return result;
+	}();
+	return index;
+}
 
-			close(fd);
+/** Decode the (type, value) pairs returned by KBASE_IOCTL_GET_GPUPROPS */
+mali_userspace::gpu_props decode_gpu_props(const uint8_t *ptr, size_t size)
+{
+	mali_userspace::gpu_props props = {};
+	const auto &              index = gpu_property_index();
+	const uint8_t *const      end   = ptr + size;
+
+	while (end - ptr >= 4)
+	{
+		const uint32_t type = read_le<uint32_t>(ptr);
+		ptr += 4;
+
+		const size_t value_size = size_t(1) << (type & 3);
+		if (static_cast<size_t>(end - ptr) < value_size)
+		{
+			break;
 		}
-		else
+
+		uint64_t value = 0;
+		switch (type & 3)
 		{
-			mali_userspace::kbase_ioctl_get_gpuprops get_props = {};
-			int                                      ret;
-			if ((ret = ioctl(fd, KBASE_IOCTL_GET_GPUPROPS, &get_props)) < 0)
-			{
-				throw std::runtime_error("Failed getting GPU properties.");
-				close(fd);
-			}
+			case KBASE_GPUPROP_VALUE_SIZE_U8:
+				value = read_le<uint8_t>(ptr);
+				break;
+			case KBASE_GPUPROP_VALUE_SIZE_U16:
+				value = read_le<uint16_t>(ptr);
+				break;
+			case KBASE_GPUPROP_VALUE_SIZE_U32:
+				value = read_le<uint32_t>(ptr);
+				break;
+			case KBASE_GPUPROP_VALUE_SIZE_U64:
+				value = read_le<uint64_t>(ptr);
+				break;
+		}
+		ptr += value_size;
 
-			get_props.size = ret;
-			std::vector<uint8_t> buffer(ret);
-			get_props.buffer.value = buffer.data();
-			ret                    = ioctl(fd, KBASE_IOCTL_GET_GPUPROPS, &get_props);
-			if (ret < 0)
-			{
-				throw std::runtime_error("Failed getting GPU properties.");
-				close(fd);
-			}
+		const uint32_t id = type >> 2;
+		if (id >= gpu_property_id_count || index[id] < 0)
+		{
+			continue;
+		}
 
-#define READ_U8(p) ((p)[0])
-#define READ_U16(p) (READ_U8((p)) | (uint16_t(READ_U8((p) + 1)) << 8))
-#define READ_U32(p) (READ_U16((p)) | (uint32_t(READ_U16((p) + 2)) << 16))
-#define READ_U64(p) (READ_U32((p)) | (uint64_t(READ_U32((p) + 4)) << 32))
+		const auto &mapping = mali_userspace::gpu_property_mapping[index[id]];
+		void *      p       = reinterpret_cast<uint8_t *>(&props) + mapping.offset;
+		switch (mapping.size)
+		{
+			case 1:
+				*reinterpret_cast<uint8_t *>(p) = value;
+				break;
+			case 2:
+				*reinterpret_cast<uint16_t *>(p) = value;
+				break;
+			case 4:
+				*reinterpret_cast<uint32_t *>(p) = value;
+				break;
+			case 8:
+				*reinterpret_cast<uint64_t *>(p) = value;
+				break;
+			default:
+				throw std::runtime_error("Invalid property size.");
+		}
+	}
 
-			mali_userspace::gpu_props props = {};
+	return props;
+}
 
-			const auto *ptr  = buffer.data();
-			int         size = ret;
-			while (size > 0)
-			{
-				uint32_t type       = READ_U32(ptr);
-				uint32_t value_type = type & 3;
-				uint64_t value;
+/** Read the properties of the legacy UK interface, laid out as the ones decoded by @ref decode_gpu_props */
+mali_userspace::gpu_props read_legacy_gpu_props(int fd)
+{
+	mali_userspace::kbase_uk_gpuprops uk_props = {};
+	uk_props.header.id                         = mali_userspace::KBASE_FUNC_GPU_PROPS_REG_DUMP;
+	if (mali_userspace::mali_ioctl(fd, uk_props) != 0)
+	{
+		throw std::runtime_error("Failed getting GPU properties.");
+	}
 
-				ptr += 4;
-				size -= 4;
+	mali_userspace::gpu_props props = {};
+	props.product_id                = uk_props.props.core_props.product_id;
+	props.minor_revision            = uk_props.props.core_props.minor_revision;
+	props.major_revision            = uk_props.props.core_props.major_revision;
+	props.gpu_freq_khz_max          = uk_props.props.core_props.gpu_freq_khz_max;
+	props.gpu_freq_khz_min          = uk_props.props.core_props.gpu_freq_khz_min;
+	props.num_groups                = uk_props.props.coherency_info.num_groups;
+	props.num_core_groups           = std::min<uint32_t>(uk_props.props.coherency_info.num_core_groups, BASE_MAX_COHERENT_GROUPS);
+	for (uint32_t i = 0; i < props.num_core_groups; i++)
+	{
+		props.core_mask[i] = uk_props.props.coherency_info.group[i].core_mask;
+	}
+	props.l2_slices = uk_props.props.l2_props.num_l2_slices;
 
-				switch (value_type)
-				{
-					case KBASE_GPUPROP_VALUE_SIZE_U8:
-						value = READ_U8(ptr);
-						ptr++;
-						size--;
-						break;
-					case KBASE_GPUPROP_VALUE_SIZE_U16:
-						value = READ_U16(ptr);
-						ptr += 2;
-						size -= 2;
-						break;
-					case KBASE_GPUPROP_VALUE_SIZE_U32:
-						value = READ_U32(ptr);
-						ptr += 4;
-						size -= 4;
-						break;
-					case KBASE_GPUPROP_VALUE_SIZE_U64:
-						value = READ_U64(ptr);
-						ptr += 8;
-						size -= 8;
-						break;
-				}
+	return props;
+}
 
-				for (unsigned i = 0; mali_userspace::gpu_property_mapping[i].type; i++)
-				{
-					if (mali_userspace::gpu_property_mapping[i].type == (type >> 2))
-					{
-						auto  offset = mali_userspace::gpu_property_mapping[i].offset;
-						void *p      = reinterpret_cast<uint8_t *>(&props) + offset;
-						switch (mali_userspace::gpu_property_mapping[i].size)
-						{
-							case 1:
-								*reinterpret_cast<uint8_t *>(p) = value;
-								break;
-							case 2:
-								*reinterpret_cast<uint16_t *>(p) = value;
-								break;
-							case 4:
-								*reinterpret_cast<uint32_t *>(p) = value;
-								break;
-							case 8:
-								*reinterpret_cast<uint64_t *>(p) = value;
-								break;
-							default:
-								throw std::runtime_error("Invalid property size.");
-								close(fd);
-						}
-						break;
-					}
-				}
-			}
+/** Read the (type, value) pairs of KBASE_IOCTL_GET_GPUPROPS */
+mali_userspace::gpu_props read_gpu_props(int fd)
+{
+	mali_userspace::kbase_ioctl_get_gpuprops get_props = {};
+	int                                      ret;
+	if ((ret = ioctl(fd, KBASE_IOCTL_GET_GPUPROPS, &get_props)) < 0)
+	{
+		throw std::runtime_error("Failed getting GPU properties.");
+	}
+
+	get_props.size = ret;
+	std::vector<uint8_t> buffer(ret);
+	get_props.buffer.value = buffer.data();
+	ret                    = ioctl(fd, KBASE_IOCTL_GET_GPUPROPS, &get_props);
+	if (ret < 0)
+	{
+		throw std::runtime_error("Failed getting GPU properties.");
+	}
 
-			hw_info.gpu_id  = props.product_id;
-			hw_info.r_value = props.major_revision;
-			hw_info.p_value = props.minor_revision;
-			for (uint32_t i = 0; i < props.num_core_groups; i++)
-				hw_info.core_mask |= props.core_mask[i];
-			hw_info.mp_count  = __builtin_popcountll(hw_info.core_mask);
-			hw_info.l2_slices = props.l2_slices;
+	return decode_gpu_props(buffer.data(), static_cast<size_t>(ret));
+}
+
+MaliHWInfo get_mali_hw_info(int fd, mali_userspace::KbaseBackend backend)
+{
+	const mali_userspace::gpu_props props = backend == mali_userspace::KbaseBackend::LegacyUK ? read_legacy_gpu_props(fd) : read_gpu_props(fd);
+
+	MaliHWInfo hw_info;        // NOLINT
+	memset(&hw_info, 0, sizeof(hw_info));
+	hw_info.gpu_id  = props.product_id;
+	hw_info.r_value = props.major_revision;
+	hw_info.p_value = props.minor_revision;
+	for (uint32_t i = 0; i < props.num_core_groups && i < BASE_MAX_COHERENT_GROUPS; i++)
+		hw_info.core_mask |= props.core_mask[i];
+	hw_info.mp_count  = __builtin_popcountll(hw_info.core_mask);
+	hw_info.l2_slices = props.l2_slices;
+
+	hw_info.gpu_freq_khz_max = props.gpu_freq_khz_max;
+	hw_info.gpu_freq_khz_min = props.gpu_freq_khz_min;
+
+	return hw_info;
+}
+}        // namespace
+
+/** kbase context and hardware description, shared by all the Mali counters of the process */
+struct MaliDevice
+{
+	/** Open the device, set the context up and read the GPU properties
+	 *
+	 * @param[in] path Path of the device.
+	 */
+	explicit MaliDevice(const char *path)
+	{
+		fd = open(path, O_RDWR | O_CLOEXEC | O_NONBLOCK);        // NOLINT
 
+		if (fd < 0)
+		{
+			throw std::runtime_error(std::string("Failed to open ") + path + ".");
+		}
+
+		try
+		{
+			backend = kbase_handshake(fd);
+			hw_info = get_mali_hw_info(fd, backend);
+		}
+		catch (const std::runtime_error &)
+		{
 			close(fd);
+			throw;
 		}
+	}
+
+	MaliDevice(const MaliDevice &) = delete;
+	MaliDevice &operator=(const MaliDevice &) = delete;
 
-		return hw_info;
+	~MaliDevice()
+	{
+		close(fd);
+	}
+
+	/** Get the device of a path, opened on first use and kept open for the lifetime of the process
+	 *
+	 * @param[in] path Path of the device.
+	 *
+	 * @return the shared device.
+	 */
+	static std::shared_ptr<const MaliDevice> get(const char *path)
+	{
+		static std::mutex                                              mutex;
+		static std::map<std::string, std::shared_ptr<const MaliDevice>> devices;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		std::shared_ptr<const MaliDevice> &device = devices[path];
+		if (!device)
+		{
+			device = std::make_shared<const MaliDevice>(path);
+		}
+		return device;
 	}
+
+	int                          fd{-1};
+	mali_userspace::KbaseBackend backend{mali_userspace::KbaseBackend::Ioctl};
+	MaliHWInfo                   hw_info{};
+};
+
+MaliSampleView::MaliSampleView(int hwc_fd, const mali_userspace::kbase_hwcnt_reader_metadata &meta, const uint32_t *data, size_t size) :
+    _hwc_fd(hwc_fd),
+    _meta(meta),
+    _data(data),
+    _size(size)
+{
+}
+
+MaliSampleView::MaliSampleView(MaliSampleView &&other) :
+    _hwc_fd(other._hwc_fd),
+    _meta(other._meta),
+    _data(other._data),
+    _size(other._size)
+{
+	other._data = nullptr;
 }
-}        // namespace
 
-MaliCounter::MaliCounter()
+MaliSampleView &MaliSampleView::operator=(MaliSampleView &&other)
 {
-	for (const auto &jm_counter : _jm_counter_names)
+	if (this != &other)
 	{
-		_counters.emplace(std::make_pair(jm_counter.first, Measurement{0, jm_counter.second}));
+		if (valid() && _hwc_fd >= 0)
+		{
+			ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_PUT_BUFFER, &_meta);        // NOLINT
+		}
+
+		_hwc_fd     = other._hwc_fd;
+		_meta       = other._meta;
+		_data       = other._data;
+		_size       = other._size;
+		other._data = nullptr;
+	}
+	return *this;
+}
+
+MaliSampleView::~MaliSampleView()
+{
+	if (valid() && _hwc_fd >= 0)
+	{
+		ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_PUT_BUFFER, &_meta);        // NOLINT
 	}
+}
+
+void MaliSampleView::release()
+{
+	if (!valid())
+	{
+		return;
+	}
+
+	_data = nullptr;
 
-	for (const auto &mmu_counter : _mmu_counter_names)
+	if (_hwc_fd >= 0 && ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_PUT_BUFFER, &_meta) != 0)        // NOLINT
 	{
-		_counters.emplace(std::make_pair(mmu_counter.first, Measurement{0, mmu_counter.second}));
+		throw std::runtime_error("Failed READER_PUT_BUFFER.");
 	}
+}
+
+MaliCounter::MaliCounter() :
+    MaliCounter(MaliCounterProfile::Default)
+{
+}
+
+MaliCounter::MaliCounter(MaliCounterProfile profile) :
+    _profile(profile)
+{
+	init();
+}
 
+MaliCounter::MaliCounter(const std::vector<std::string> &counter_names) :
+    _counter_names(counter_names)
+{
 	init();
 }
 
@@ -226,83 +675,102 @@ void MaliCounter::init()
 {
 	term();
 
-	MaliHWInfo hw_info = get_mali_hw_info(_device);
+	_mali_device = MaliDevice::get(_device);
+
+	const MaliHWInfo &hw_info = _mali_device->hw_info;
 
 	_num_cores     = hw_info.mp_count;
 	_num_l2_slices = hw_info.l2_slices;
+	_gpu_id        = hw_info.gpu_id;
+	_core_mask     = hw_info.core_mask;
 
-	_fd = open(_device, O_RDWR | O_CLOEXEC | O_NONBLOCK);        // NOLINT
+	auto product = std::find_if(std::begin(mali_userspace::products), std::end(mali_userspace::products), [&](const mali_userspace::CounterMapping &cm) {
+		return (cm.product_mask & hw_info.gpu_id) == cm.product_id;
+	});
 
-	if (_fd < 0)
+	if (product != std::end(mali_userspace::products))
 	{
-		throw std::runtime_error("Failed to open /dev/mali0.");
+		_names_lut  = product->names_lut;
+		_product_id = product->product_id;
 	}
-
+	else
 	{
-		mali_userspace::kbase_uk_hwcnt_reader_version_check_args check;        // NOLINT
-		memset(&check, 0, sizeof(check));
-
-		if (mali_userspace::mali_ioctl(_fd, check) != 0)
-		{
-			mali_userspace::kbase_ioctl_version_check _check = {0, 0};
-			if (ioctl(_fd, KBASE_IOCTL_VERSION_CHECK, &_check) < 0)
-			{
-				throw std::runtime_error("Failed to get ABI version.");
-			}
-		}
-		else if (check.major < 10)
-		{
-			throw std::runtime_error("Unsupported ABI version 10.");
-		}
+		throw std::runtime_error("Could not identify GPU.");
 	}
 
+	_family           = product->family;
+	_gpu_freq_khz_max = hw_info.gpu_freq_khz_max;
+	_gpu_freq_khz_min = hw_info.gpu_freq_khz_min;
+
+	select_counters();
+	select_derived_metrics();
+
+	const size_t product_index = static_cast<size_t>(product - std::begin(mali_userspace::products));
+
+	// The kbase context is shared, each counter only sets its own reader up
+	_fd      = _mali_device->fd;
+	_backend = _mali_device->backend;
+
+	if (_backend == mali_userspace::KbaseBackend::KinstrPrfcnt)
 	{
-		mali_userspace::kbase_uk_hwcnt_reader_set_flags flags;        // NOLINT
-		memset(&flags, 0, sizeof(flags));
-		flags.header.id    = mali_userspace::KBASE_FUNC_SET_FLAGS;        // NOLINT
-		flags.create_flags = mali_userspace::BASE_CONTEXT_CREATE_KERNEL_FLAGS;
+		setup_kinstr_reader();
+	}
+	else
+	{
+		setup_hwcnt_reader();
+	}
 
-		if (mali_userspace::mali_ioctl(_fd, flags) != 0)
-		{
-			mali_userspace::kbase_ioctl_set_flags _flags = {1u << 1};
-			if (ioctl(_fd, KBASE_IOCTL_SET_FLAGS, &_flags) < 0)
-			{
-				throw std::runtime_error("Failed settings flags ioctl.");
-			}
-		}
+	// Build core remap table.
+	_core_index_remap.clear();
+	_core_index_remap.reserve(hw_info.mp_count);
+
+	unsigned int mask = hw_info.core_mask;
+
+	while (mask != 0)
+	{
+		unsigned int bit = __builtin_ctz(mask);
+		_core_index_remap.push_back(bit);
+		mask &= ~(1u << bit);
 	}
 
+	select_fixed_layout(product_index);
+}
+
+void MaliCounter::setup_hwcnt_reader()
+{
+	if (_backend == mali_userspace::KbaseBackend::LegacyUK)
 	{
 		mali_userspace::kbase_uk_hwcnt_reader_setup setup;        // NOLINT
 		memset(&setup, 0, sizeof(setup));
 		setup.header.id    = mali_userspace::KBASE_FUNC_HWCNT_READER_SETUP;        // NOLINT
 		setup.buffer_count = _buffer_count;
-		setup.jm_bm        = -1;
-		setup.shader_bm    = -1;
-		setup.tiler_bm     = -1;
-		setup.mmu_l2_bm    = -1;
+		setup.jm_bm        = _jm_bm;
+		setup.shader_bm    = _shader_bm;
+		setup.tiler_bm     = _tiler_bm;
+		setup.mmu_l2_bm    = _mmu_l2_bm;
 		setup.fd           = -1;
 
 		if (mali_userspace::mali_ioctl(_fd, setup) != 0)
 		{
-			mali_userspace::kbase_ioctl_hwcnt_reader_setup _setup = {};
-			_setup.buffer_count                                   = _buffer_count;
-			_setup.jm_bm                                          = -1;
-			_setup.shader_bm                                      = -1;
-			_setup.tiler_bm                                       = -1;
-			_setup.mmu_l2_bm                                      = -1;
-
-			int ret;
-			if ((ret = ioctl(_fd, KBASE_IOCTL_HWCNT_READER_SETUP, &_setup)) < 0)
-			{
-				throw std::runtime_error("Failed setting hwcnt reader ioctl.");
-			}
-			_hwc_fd = ret;
+			throw std::runtime_error("Failed setting hwcnt reader ioctl.");
 		}
-		else
+		_hwc_fd = setup.fd;
+	}
+	else
+	{
+		mali_userspace::kbase_ioctl_hwcnt_reader_setup setup = {};
+		setup.buffer_count                                   = _buffer_count;
+		setup.jm_bm                                          = _jm_bm;
+		setup.shader_bm                                      = _shader_bm;
+		setup.tiler_bm                                       = _tiler_bm;
+		setup.mmu_l2_bm                                      = _mmu_l2_bm;
+
+		int ret;
+		if ((ret = ioctl(_fd, KBASE_IOCTL_HWCNT_READER_SETUP, &setup)) < 0)
 		{
-			_hwc_fd = setup.fd;
+			throw std::runtime_error("Failed setting hwcnt reader ioctl.");
 		}
+		_hwc_fd = ret;
 	}
 
 	{
@@ -333,47 +801,393 @@ void MaliCounter::init()
 		throw std::runtime_error("Unsupported HW version.");
 	}
 
-	_sample_data = static_cast<uint8_t *>(mmap(nullptr, _buffer_count * _buffer_size, PROT_READ, MAP_PRIVATE, _hwc_fd, 0));
+	_mmap_size   = _buffer_count * _buffer_size;
+	_sample_data = static_cast<uint8_t *>(mmap(nullptr, _mmap_size, PROT_READ, MAP_PRIVATE, _hwc_fd, 0));
 
 	if (_sample_data == MAP_FAILED)        // NOLINT
 	{
+		_sample_data = nullptr;
 		throw std::runtime_error("Failed to map sample data.");
 	}
+}
 
-	auto product = std::find_if(std::begin(mali_userspace::products), std::end(mali_userspace::products), [&](const mali_userspace::CounterMapping &cm) {
-		return (cm.product_mask & hw_info.gpu_id) == cm.product_id;
-	});
-
-	if (product != std::end(mali_userspace::products))
+void MaliCounter::setup_kinstr_reader()
+{
+	// Enumerate the counter blocks: the first call returns the number of items
+	mali_userspace::kbase_ioctl_kinstr_prfcnt_enum_info enum_info = {};
+	if (ioctl(_fd, KBASE_IOCTL_KINSTR_PRFCNT_ENUM_INFO, &enum_info) != 0)
 	{
-		_names_lut = product->names_lut;
+		throw std::runtime_error("Failed to enumerate the kinstr_prfcnt blocks.");
 	}
-	else
+
+	std::vector<uint8_t> enum_items(static_cast<size_t>(enum_info.info_item_size) * enum_info.info_item_count);
+	enum_info.info_list_ptr = reinterpret_cast<uintptr_t>(enum_items.data());
+	if (enum_info.info_item_size < sizeof(mali_userspace::prfcnt_enum_item) || ioctl(_fd, KBASE_IOCTL_KINSTR_PRFCNT_ENUM_INFO, &enum_info) != 0)
 	{
-		throw std::runtime_error("Could not identify GPU.");
+		throw std::runtime_error("Failed to enumerate the kinstr_prfcnt blocks.");
 	}
 
-	_raw_counter_buffer.resize(_buffer_size / sizeof(uint32_t));
+	const uint32_t bitmasks[] = {_jm_bm, _tiler_bm, _mmu_l2_bm, _shader_bm};
 
-	// Build core remap table.
-	_core_index_remap.clear();
-	_core_index_remap.reserve(hw_info.mp_count);
+	std::vector<mali_userspace::prfcnt_request_item> requests;
+	mali_userspace::prfcnt_request_item              request = {};
 
-	unsigned int mask = hw_info.core_mask;
+	request.hdr.item_type       = PRFCNT_REQUEST_TYPE_MODE;
+	request.u.req_mode.mode     = mali_userspace::PRFCNT_MODE_MANUAL;
+	requests.push_back(request);
 
-	while (mask != 0)
+	size_t shader_instances = 0;
+	_kinstr_block_values.fill(0);
+
+	for (size_t offset = 0; offset + sizeof(mali_userspace::prfcnt_enum_item) <= enum_items.size(); offset += enum_info.info_item_size)
 	{
-		unsigned int bit = __builtin_ctz(mask);
-		_core_index_remap.push_back(bit);
-		mask &= ~(1u << bit);
-	}
+		mali_userspace::prfcnt_enum_item item;
+		memcpy(&item, enum_items.data() + offset, sizeof(item));
+
+		if (item.hdr.item_type == FLEX_LIST_TYPE_NONE)
+		{
+			break;
+		}
+
+		const mali_userspace::prfcnt_enum_block_counter &block = item.u.block_counter;
+		if (item.hdr.item_type != PRFCNT_ENUM_TYPE_BLOCK || block.set != mali_userspace::PRFCNT_SET_PRIMARY || block.block_type > mali_userspace::PRFCNT_BLOCK_TYPE_SHADER_CORE)
+		{
+			continue;
+		}
+
+		_kinstr_block_values[block.block_type] = std::min<uint16_t>(block.num_values, mali_userspace::MALI_NAME_BLOCK_SIZE);
+		if (block.block_type == mali_userspace::PRFCNT_BLOCK_TYPE_SHADER_CORE)
+		{
+			shader_instances = block.num_instances;
+		}
+
+		// Each bit of a hwcnt reader bitmask enables 4 counters, kinstr_prfcnt has one bit per counter
+		uint64_t enable_mask = 0;
+		for (int group = 0; group < mali_userspace::MALI_NAME_BLOCK_SIZE / 4; ++group)
+		{
+			if ((bitmasks[block.block_type] & (1u << group)) != 0)
+			{
+				enable_mask |= 0xfull << (4 * group);
+			}
+		}
+
+		request                          = {};
+		request.hdr.item_type            = PRFCNT_REQUEST_TYPE_ENABLE;
+		request.u.req_enable.block_type  = block.block_type;
+		request.u.req_enable.set         = mali_userspace::PRFCNT_SET_PRIMARY;
+		request.u.req_enable.enable_mask[0] = enable_mask & block.counter_mask[0];
+		requests.push_back(request);
+	}
+
+	request                   = {};
+	request.hdr.item_type     = PRFCNT_REQUEST_TYPE_SCOPE;
+	request.u.req_scope.scope = mali_userspace::PRFCNT_SCOPE_GLOBAL;
+	requests.push_back(request);
+
+	request = {};
+	requests.push_back(request);
+
+	mali_userspace::kbase_ioctl_kinstr_prfcnt_setup setup = {};
+	setup.in.request_item_count                            = static_cast<uint32_t>(requests.size());
+	setup.in.request_item_size                             = sizeof(mali_userspace::prfcnt_request_item);
+	setup.in.requests_ptr                                  = reinterpret_cast<uintptr_t>(requests.data());
+
+	int ret;
+	if ((ret = ioctl(_fd, KBASE_IOCTL_KINSTR_PRFCNT_SETUP, &setup)) < 0)
+	{
+		throw std::runtime_error("Failed setting kinstr_prfcnt reader ioctl.");
+	}
+	_hwc_fd               = ret;
+	_mmap_size            = setup.out.prfcnt_mmap_size_bytes;
+	_kinstr_metadata_size = std::max<size_t>(setup.out.prfcnt_metadata_item_size, sizeof(mali_userspace::prfcnt_metadata));
+
+	_sample_data = static_cast<uint8_t *>(mmap(nullptr, _mmap_size, PROT_READ, MAP_PRIVATE, _hwc_fd, 0));
+
+	if (_sample_data == MAP_FAILED)        // NOLINT
+	{
+		_sample_data = nullptr;
+		throw std::runtime_error("Failed to map sample data.");
+	}
+
+	// Samples are converted to the layout of the hwcnt reader, with a shader core block up to the last present core
+	const size_t core_blocks = std::max<size_t>(shader_instances, 64 - __builtin_clzll(_core_mask | 1));
+	_buffer_size             = (2 + _num_l2_slices + core_blocks) * mali_userspace::MALI_NAME_BLOCK_SIZE * sizeof(uint32_t);
+	_hw_ver                  = 5;
+	_kinstr_buffers.assign(_buffer_count * _buffer_size / sizeof(uint32_t), 0);
+	_kinstr_next_buffer = 0;
+
+	mali_userspace::prfcnt_control_cmd cmd = {};
+	cmd.cmd                                = mali_userspace::PRFCNT_CONTROL_CMD_START;
+	if (ioctl(_hwc_fd, KBASE_IOCTL_KINSTR_PRFCNT_CMD, &cmd) != 0)
+	{
+		throw std::runtime_error("Failed to start the kinstr_prfcnt reader.");
+	}
+}
+
+void MaliCounter::select_counters()
+{
+	_jm_counters.clear();
+	_tiler_counters.clear();
+	_shader_counters.clear();
+	_mmu_counters.clear();
+	_jm_bm     = 0;
+	_tiler_bm  = 0;
+	_shader_bm = 0;
+	_mmu_l2_bm = 0;
+
+	const auto add_counter = [this](mali_userspace::MaliCounterBlockName block, int index, const std::string &name) {
+		const MaliCounterDescription *description = find_counter_description(name);
+		ResolvedCounter               counter{index, name, description ? description->label : name, description ? description->unit : "", 0, {}, {}, {}};
+
+		switch (block)
+		{
+			case mali_userspace::MALI_NAME_BLOCK_JM:
+				_jm_counters.push_back(std::move(counter));
+				_jm_bm |= counter_enable_bit(index);
+				break;
+			case mali_userspace::MALI_NAME_BLOCK_TILER:
+				_tiler_counters.push_back(std::move(counter));
+				_tiler_bm |= counter_enable_bit(index);
+				break;
+			case mali_userspace::MALI_NAME_BLOCK_SHADER:
+				counter.core_values.resize(_num_cores);
+				_shader_counters.push_back(std::move(counter));
+				_shader_bm |= counter_enable_bit(index);
+				break;
+			case mali_userspace::MALI_NAME_BLOCK_MMU:
+				counter.slice_values.resize(_num_l2_slices);
+				_mmu_counters.push_back(std::move(counter));
+				_mmu_l2_bm |= counter_enable_bit(index);
+				break;
+		}
+	};
+
+	const mali_userspace::MaliCounterBlockName blocks[] = {
+	    mali_userspace::MALI_NAME_BLOCK_JM,
+	    mali_userspace::MALI_NAME_BLOCK_TILER,
+	    mali_userspace::MALI_NAME_BLOCK_SHADER,
+	    mali_userspace::MALI_NAME_BLOCK_MMU,
+	};
+
+	if (_counter_names.empty() && _profile == MaliCounterProfile::Diagnostic)
+	{
+		for (const auto block : blocks)
+		{
+			const char *const *names = &_names_lut[mali_userspace::MALI_NAME_BLOCK_SIZE * block];
+
+			// The first 4 counters of each block are its header
+			for (int i = 4; i < mali_userspace::MALI_NAME_BLOCK_SIZE; ++i)
+			{
+				// Names are prefixed with the product name, e.g. "TMIx_GPU_ACTIVE"
+				const char *name = strchr(names[i], '_');
+				if (name != nullptr)
+				{
+					add_counter(block, i, name + 1);
+				}
+			}
+		}
+		return;
+	}
+
+	std::vector<std::string> names = _counter_names;
+	if (names.empty())
+	{
+		if (_profile == MaliCounterProfile::AlwaysOn)
+		{
+			names.assign(std::begin(always_on_counters), std::end(always_on_counters));
+		}
+		else if (_profile == MaliCounterProfile::Shading)
+		{
+			names.assign(std::begin(shading_counters), std::end(shading_counters));
+		}
+		else
+		{
+			names.assign(std::begin(default_counters), std::end(default_counters));
+		}
+	}
+
+	for (const auto &name : names)
+	{
+		bool found = false;
+		for (const auto block : blocks)
+		{
+			const int index = find_counter_index_by_name(block, name.c_str());
+			if (index >= 0)
+			{
+				add_counter(block, index, name);
+				found = true;
+				break;
+			}
+		}
+
+		// Profiles list the counters of every GPU family, only explicitly requested counters must exist
+		if (!found && !_counter_names.empty())
+		{
+			throw std::runtime_error("Unknown counter " + name + ".");
+		}
+	}
+}
+
+void MaliCounter::select_fixed_layout(size_t product)
+{
+	_fixed_layout  = nullptr;
+	_fixed_targets = mali_userspace::FixedCounterTargets();
+
+	// Counters selected by name and the diagnostic profile are only known at runtime
+	if (!_counter_names.empty() || _profile == MaliCounterProfile::Diagnostic)
+	{
+		return;
+	}
+
+	const char *const *                       names;
+	size_t                                    count;
+	const mali_userspace::FixedCounterLayout *layout;
+
+	if (_profile == MaliCounterProfile::AlwaysOn)
+	{
+		names  = always_on_counters;
+		count  = std::extent<decltype(always_on_counters)>::value;
+		layout = &mali_userspace::fixed_counter_layout<always_on_counters, std::extent<decltype(always_on_counters)>::value>(product);
+	}
+	else if (_profile == MaliCounterProfile::Shading)
+	{
+		names  = shading_counters;
+		count  = std::extent<decltype(shading_counters)>::value;
+		layout = &mali_userspace::fixed_counter_layout<shading_counters, std::extent<decltype(shading_counters)>::value>(product);
+	}
+	else
+	{
+		names  = default_counters;
+		count  = std::extent<decltype(default_counters)>::value;
+		layout = &mali_userspace::fixed_counter_layout<default_counters, std::extent<decltype(default_counters)>::value>(product);
+	}
+
+	const std::pair<mali_userspace::MaliCounterBlockName, std::vector<ResolvedCounter> *> blocks[] = {
+	    {mali_userspace::MALI_NAME_BLOCK_JM, &_jm_counters},
+	    {mali_userspace::MALI_NAME_BLOCK_TILER, &_tiler_counters},
+	    {mali_userspace::MALI_NAME_BLOCK_SHADER, &_shader_counters},
+	    {mali_userspace::MALI_NAME_BLOCK_MMU, &_mmu_counters},
+	};
+
+	mali_userspace::FixedCounterTargets targets;
+	targets.values.assign(count, nullptr);
+	targets.core_values.assign(count, nullptr);
+	targets.slice_values.assign(count, nullptr);
+	targets.core_index_remap = _core_index_remap.data();
+	targets.num_cores        = _num_cores;
+	targets.num_l2_slices    = _num_l2_slices;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		int position = -1;
+		for (const auto &block : blocks)
+		{
+			for (auto &counter : *block.second)
+			{
+				if (counter.name == names[i])
+				{
+					position                = block.first * mali_userspace::MALI_NAME_BLOCK_SIZE + counter.index;
+					targets.values[i]       = &counter.value;
+					targets.core_values[i]  = block.first == mali_userspace::MALI_NAME_BLOCK_SHADER ? counter.core_values.data() : nullptr;
+					targets.slice_values[i] = block.first == mali_userspace::MALI_NAME_BLOCK_MMU ? counter.slice_values.data() : nullptr;
+				}
+			}
+		}
+
+		// The kernels resolve the names the same way at compile time, keep reading by index if they don't agree
+		if (position != layout->position(i))
+		{
+			return;
+		}
+	}
+
+	_fixed_layout  = layout;
+	_fixed_targets = std::move(targets);
+}
+
+void MaliCounter::select_derived_metrics()
+{
+	_derived_metrics.clear();
+
+	const auto find_counter = [this](const char *name) -> const uint64_t * {
+		for (const auto *counters : {&_jm_counters, &_tiler_counters, &_shader_counters, &_mmu_counters})
+		{
+			for (const auto &counter : *counters)
+			{
+				if (counter.name == name)
+				{
+					return &counter.value;
+				}
+			}
+		}
+		return nullptr;
+	};
+
+	for (size_t i = 0; i < sizeof(derived_metric_formulas) / sizeof(derived_metric_formulas[0]); ++i)
+	{
+		const DerivedMetricFormula &formula = derived_metric_formulas[i];
+
+		if ((formula.families & (1 << _family)) == 0)
+		{
+			continue;
+		}
+
+		// Only compute the metrics whose inputs are all collected
+		DerivedMetric metric{i, {}, 0.0};
+		bool          available = true;
+
+		for (int input = 0; input < DERIVED_METRIC_MAX_INPUTS && formula.inputs[input] != nullptr; ++input)
+		{
+			metric.inputs[input] = find_counter(formula.inputs[input]);
+			available &= metric.inputs[input] != nullptr;
+		}
+
+		if (available)
+		{
+			_derived_metrics.push_back(metric);
+		}
+	}
+}
+
+void MaliCounter::update_derived_metrics()
+{
+	const DerivedMetricContext context{
+	    (_stop_time - _start_time) / 1e9,
+	    _gpu_freq_hz != 0 ? static_cast<double>(_gpu_freq_hz) : _gpu_freq_khz_max * 1e3,
+	    static_cast<double>(_num_l2_slices)};
+
+	for (auto &metric : _derived_metrics)
+	{
+		const DerivedMetricFormula &formula = derived_metric_formulas[metric.formula];
+
+		double inputs[DERIVED_METRIC_MAX_INPUTS] = {};
+		for (int input = 0; input < DERIVED_METRIC_MAX_INPUTS && metric.inputs[input] != nullptr; ++input)
+		{
+			inputs[input] = static_cast<double>(*metric.inputs[input]);
+		}
+
+		metric.value = formula.compute(inputs, context);
+	}
 }
 
 void MaliCounter::term()
 {
+	_stop_pending = false;
+
+	// Reached from the destructor, which must not throw
+	try
+	{
+		stop_reader_thread(nullptr);
+	}
+	catch (const std::runtime_error &error)
+	{
+		HWCPIPE_LOG("Failed to stop the Mali counter reader: %s", error.what());
+	}
+	_streaming = false;
+
 	if (_sample_data != nullptr)
 	{
-		munmap(_sample_data, _buffer_count * _buffer_size);
+		munmap(_sample_data, _mmap_size);
 		_sample_data = nullptr;
 	}
 
@@ -383,68 +1197,263 @@ void MaliCounter::term()
 		_hwc_fd = -1;
 	}
 
-	if (_fd >= 0)
-	{
-		close(_fd);
-		_fd = -1;
-	}
+	_fd = -1;
+	_mali_device.reset();
 }
 
 void MaliCounter::sample_counters()
 {
+	if (_backend == mali_userspace::KbaseBackend::KinstrPrfcnt)
+	{
+		mali_userspace::prfcnt_control_cmd cmd = {};
+		cmd.cmd                                = mali_userspace::PRFCNT_CONTROL_CMD_SAMPLE_SYNC;
+		if (ioctl(_hwc_fd, KBASE_IOCTL_KINSTR_PRFCNT_CMD, &cmd) != 0)
+		{
+			throw std::runtime_error("Could not sample hardware counters.");
+		}
+		return;
+	}
+
 	if (ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_DUMP, 0) != 0)
 	{
 		throw std::runtime_error("Could not sample hardware counters.");
 	}
 }
 
-void MaliCounter::wait_next_event()
+bool MaliCounter::get_buffer(mali_userspace::kbase_hwcnt_reader_metadata &meta, const uint32_t *&counters)
+{
+	if (_backend != mali_userspace::KbaseBackend::KinstrPrfcnt)
+	{
+		if (ioctl(_hwc_fd, static_cast<int>(mali_userspace::KBASE_HWCNT_READER_GET_BUFFER), &meta) != 0)        // NOLINT
+		{
+			return false;
+		}
+		counters = reinterpret_cast<const uint32_t *>(_sample_data + _buffer_size * meta.buffer_idx);
+		return true;
+	}
+
+	mali_userspace::prfcnt_sample_access access = {};
+	if (ioctl(_hwc_fd, KBASE_IOCTL_KINSTR_PRFCNT_GET_SAMPLE, &access) != 0)
+	{
+		return false;
+	}
+
+	// Convert the sample to the hwcnt reader layout, so that it is decoded like the other dumps
+	const size_t words  = _buffer_size / sizeof(uint32_t);
+	meta                = {};
+	meta.buffer_idx     = _kinstr_next_buffer;
+	_kinstr_next_buffer = (_kinstr_next_buffer + 1) % _buffer_count;
+
+	uint32_t *out = &_kinstr_buffers[meta.buffer_idx * words];
+	std::fill(out, out + words, 0);
+
+	for (size_t offset = access.sample_offset_bytes; offset + sizeof(mali_userspace::prfcnt_metadata) <= _mmap_size; offset += _kinstr_metadata_size)
+	{
+		mali_userspace::prfcnt_metadata item;
+		memcpy(&item, _sample_data + offset, sizeof(item));
+
+		if (item.hdr.item_type == FLEX_LIST_TYPE_NONE)
+		{
+			break;
+		}
+
+		if (item.hdr.item_type == PRFCNT_SAMPLE_META_TYPE_SAMPLE)
+		{
+			meta.timestamp = item.u.sample_md.timestamp_end;
+			continue;
+		}
+
+		const mali_userspace::prfcnt_block_metadata &block = item.u.block_md;
+		if (item.hdr.item_type != PRFCNT_SAMPLE_META_TYPE_BLOCK || block.set != mali_userspace::PRFCNT_SET_PRIMARY)
+		{
+			continue;
+		}
+
+		size_t slot;
+		switch (block.block_type)
+		{
+			case mali_userspace::PRFCNT_BLOCK_TYPE_FE:
+				slot = 0;
+				break;
+			case mali_userspace::PRFCNT_BLOCK_TYPE_TILER:
+				slot = 1;
+				break;
+			case mali_userspace::PRFCNT_BLOCK_TYPE_MEMORY:
+				slot = block.block_idx < _num_l2_slices ? 2 + block.block_idx : words;
+				break;
+			case mali_userspace::PRFCNT_BLOCK_TYPE_SHADER_CORE:
+				slot = 2 + _num_l2_slices + block.block_idx;
+				break;
+			default:
+				continue;
+		}
+
+		const size_t values = _kinstr_block_values[block.block_type];
+		if ((slot + 1) * mali_userspace::MALI_NAME_BLOCK_SIZE > words || block.values_offset + values * sizeof(uint64_t) > _mmap_size)
+		{
+			continue;
+		}
+
+		// Each sample holds the counts since the previous one, which fit in 32 bits like the hwcnt reader dumps
+		const uint8_t *block_values = _sample_data + block.values_offset;
+		for (size_t i = 0; i < values; ++i)
+		{
+			uint64_t value;
+			memcpy(&value, block_values + i * sizeof(uint64_t), sizeof(value));
+			out[slot * mali_userspace::MALI_NAME_BLOCK_SIZE + i] = static_cast<uint32_t>(std::min<uint64_t>(value, UINT32_MAX));
+		}
+	}
+
+	// The sample is copied, so it goes back to the kernel straight away
+	if (ioctl(_hwc_fd, KBASE_IOCTL_KINSTR_PRFCNT_PUT_SAMPLE, &access) != 0)
+	{
+		return false;
+	}
+
+	counters = out;
+	return true;
+}
+
+bool MaliCounter::put_buffer(const mali_userspace::kbase_hwcnt_reader_metadata &meta)
+{
+	if (_backend == mali_userspace::KbaseBackend::KinstrPrfcnt)
+	{
+		return true;
+	}
+
+	return ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_PUT_BUFFER, &meta) == 0;        // NOLINT
+}
+
+MaliSampleView MaliCounter::wait_next_event(int timeout_ms)
 {
 	pollfd poll_fd;        // NOLINT
 	poll_fd.fd     = _hwc_fd;
 	poll_fd.events = POLLIN;
 
-	const int count = poll(&poll_fd, 1, -1);
+	const int count = poll(&poll_fd, 1, timeout_ms);
 
 	if (count < 0)
 	{
 		throw std::runtime_error("poll() failed.");
 	}
 
+	if (count == 0)
+	{
+		return MaliSampleView();
+	}
+
 	if ((poll_fd.revents & POLLIN) != 0)
 	{
 		mali_userspace::kbase_hwcnt_reader_metadata meta;        // NOLINT
+		const uint32_t *                            counters = nullptr;
 
-		if (ioctl(_hwc_fd, static_cast<int>(mali_userspace::KBASE_HWCNT_READER_GET_BUFFER), &meta) != 0)        // NOLINT
+		if (!get_buffer(meta, counters))
 		{
 			throw std::runtime_error("Failed READER_GET_BUFFER.");
 		}
 
-		memcpy(_raw_counter_buffer.data(), _sample_data + _buffer_size * meta.buffer_idx, _buffer_size);
-		_timestamp = meta.timestamp;
-
-		if (ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_PUT_BUFFER, &meta) != 0)        // NOLINT
-		{
-			throw std::runtime_error("Failed READER_PUT_BUFFER.");
-		}
+		// The view returns the buffer to the kernel once the caller is done with it, kinstr_prfcnt samples are already returned
+		return MaliSampleView(_backend == mali_userspace::KbaseBackend::KinstrPrfcnt ? -1 : _hwc_fd, meta, counters, _buffer_size / sizeof(uint32_t));
 	}
 	else if ((poll_fd.revents & POLLHUP) != 0)
 	{
 		throw std::runtime_error("HWC hung up.");
 	}
+
+	throw std::runtime_error("No hardware counter buffer available.");
+}
+
+MaliSampleView MaliCounter::dump()
+{
+	if (_reader_thread.joinable())
+	{
+		throw std::runtime_error("Can't dump the counters while the reader thread is running.");
+	}
+
+	complete_stop(-1);
+	sample_counters();
+	return wait_next_event();
+}
+
+void MaliCounter::request_dump()
+{
+	if (_reader_thread.joinable())
+	{
+		throw std::runtime_error("Can't dump the counters while the reader thread is running.");
+	}
+
+	complete_stop(-1);
+	sample_counters();
+}
+
+MaliSampleView MaliCounter::next_dump()
+{
+	return wait_next_event();
+}
+
+size_t MaliCounter::buffer_count() const
+{
+	return static_cast<size_t>(_buffer_count);
+}
+
+size_t MaliCounter::dump_size() const
+{
+	return _buffer_size / sizeof(uint32_t);
+}
+
+void MaliCounter::decode(const uint64_t *dump, uint64_t timespan_ns, MeasurementsSnapshot &snapshot)
+{
+	// Decode in place and put the latest measurements back. Copies assign
+	// element by element, so the capacity and the addresses the derived
+	// metrics and fixed layouts point to are kept, and nothing allocates
+	// after the first call.
+	_decoded_counters[0] = _jm_counters;
+	_decoded_counters[1] = _tiler_counters;
+	_decoded_counters[2] = _shader_counters;
+	_decoded_counters[3] = _mmu_counters;
+	_decoded_metrics     = _derived_metrics;
+	const uint64_t start = _start_time;
+	const uint64_t stop  = _stop_time;
+
+	read_counters(dump);
+	_start_time = 0;
+	_stop_time  = timespan_ns;
+	update_derived_metrics();
+	this->snapshot(snapshot);
+
+	_jm_counters     = _decoded_counters[0];
+	_tiler_counters  = _decoded_counters[1];
+	_shader_counters = _decoded_counters[2];
+	_mmu_counters    = _decoded_counters[3];
+	_derived_metrics = _decoded_metrics;
+	_start_time      = start;
+	_stop_time       = stop;
+}
+
+TraceHeader MaliCounter::trace_header() const
+{
+	TraceHeader header;
+	header.gpu_id        = _gpu_id;
+	header.hw_ver        = _hw_ver;
+	header.num_cores     = _num_cores;
+	header.num_l2_slices = _num_l2_slices;
+	header.names_lut_id  = _product_id;
+	header.core_mask     = _core_mask;
+	header.block_size    = mali_userspace::MALI_NAME_BLOCK_SIZE;
+	return header;
 }
 
-const uint32_t *MaliCounter::get_counters() const
+const uint32_t *MaliCounter::get_counters(const uint32_t *sample, mali_userspace::MaliCounterBlockName block, int index) const
 {
-	return _raw_counter_buffer.data();
+	return sample + block_offset(block, index);
 }
 
-const uint32_t *MaliCounter::get_counters(mali_userspace::MaliCounterBlockName block, int index) const
+size_t MaliCounter::block_offset(mali_userspace::MaliCounterBlockName block, int index) const
 {
 	switch (block)
 	{
 		case mali_userspace::MALI_NAME_BLOCK_JM:
-			return _raw_counter_buffer.data() + mali_userspace::MALI_NAME_BLOCK_SIZE * 0;
+			return mali_userspace::MALI_NAME_BLOCK_SIZE * 0;
 		case mali_userspace::MALI_NAME_BLOCK_MMU:
 			if (index < 0 || index >= _num_l2_slices)
 			{
@@ -452,9 +1461,9 @@ const uint32_t *MaliCounter::get_counters(mali_userspace::MaliCounterBlockName b
 			}
 
 			// If an MMU counter is selected, index refers to the MMU slice
-			return _raw_counter_buffer.data() + mali_userspace::MALI_NAME_BLOCK_SIZE * (2 + index);
+			return mali_userspace::MALI_NAME_BLOCK_SIZE * (2 + index);
 		case mali_userspace::MALI_NAME_BLOCK_TILER:
-			return _raw_counter_buffer.data() + mali_userspace::MALI_NAME_BLOCK_SIZE * 1;
+			return mali_userspace::MALI_NAME_BLOCK_SIZE * 1;
 		default:
 			if (index < 0 || index >= _num_cores)
 			{
@@ -462,17 +1471,19 @@ const uint32_t *MaliCounter::get_counters(mali_userspace::MaliCounterBlockName b
 			}
 
 			// If a shader core counter is selected, index refers to the core index
-			return _raw_counter_buffer.data() + mali_userspace::MALI_NAME_BLOCK_SIZE * (2 + _num_l2_slices + _core_index_remap[index]);
+			return mali_userspace::MALI_NAME_BLOCK_SIZE * (2 + _num_l2_slices + _core_index_remap[index]);
 	}
 }
 
-int MaliCounter::find_counter_index_by_name(mali_userspace::MaliCounterBlockName block, const char *name)
+int MaliCounter::find_counter_index_by_name(mali_userspace::MaliCounterBlockName block, const char *name) const
 {
 	const char *const *names = &_names_lut[mali_userspace::MALI_NAME_BLOCK_SIZE * block];
 
 	for (int i = 0; i < mali_userspace::MALI_NAME_BLOCK_SIZE; ++i)
 	{
-		if (strstr(names[i], name) != nullptr)
+		// Match the whole name after the product prefix, "L2_EXT_READ" must not match "L2_EXT_READ_BEATS"
+		const char *suffix = strchr(names[i], '_');
+		if (suffix != nullptr && strcmp(suffix + 1, name) == 0)
 		{
 			return i;
 		}
@@ -481,44 +1492,422 @@ int MaliCounter::find_counter_index_by_name(mali_userspace::MaliCounterBlockName
 	return -1;
 }
 
+void MaliCounter::start_streaming(uint32_t interval_ns, size_t ring_capacity)
+{
+	if (_reader_thread.joinable())
+	{
+		throw std::runtime_error("Hardware counter reader already in use.");
+	}
+
+	complete_stop(-1);
+
+	_stream_ring.reset(new SPSCRingBuffer<MaliRawSample>(ring_capacity));
+	_dropped_samples = 0;
+
+	// Preallocate every slot so the streaming thread never allocates
+	for (size_t i = 0; i < _stream_ring->capacity(); ++i)
+	{
+		_stream_ring->write_slot()->counters.resize(_buffer_size / sizeof(uint32_t));
+		_stream_ring->push();
+	}
+	while (_stream_ring->front() != nullptr)
+	{
+		_stream_ring->pop();
+	}
+
+	start_reader_thread(interval_ns, &MaliCounter::push_stream_sample);
+	_streaming = true;
+}
+
+void MaliCounter::stop_streaming()
+{
+	if (!_streaming)
+	{
+		return;
+	}
+
+	stop_reader_thread(nullptr);
+	_streaming = false;
+}
+
+bool MaliCounter::pop_sample(MaliRawSample &sample)
+{
+	MaliRawSample *slot = _stream_ring ? _stream_ring->front() : nullptr;
+
+	if (slot == nullptr)
+	{
+		return false;
+	}
+
+	sample.timestamp = slot->timestamp;
+	sample.counters.assign(slot->counters.begin(), slot->counters.end());
+	_stream_ring->pop();
+
+	return true;
+}
+
+uint64_t MaliCounter::dropped_samples() const
+{
+	return _dropped_samples;
+}
+
+void MaliCounter::set_top_up_interval(uint32_t interval_ns)
+{
+	_top_up_interval_ns = interval_ns;
+}
+
+void MaliCounter::start_reader_thread(uint32_t interval_ns, DumpHandler on_dump)
+{
+	if (pipe2(_reader_pipe, O_CLOEXEC) != 0)
+	{
+		throw std::runtime_error("Failed to create reader thread pipe.");
+	}
+
+	// kinstr_prfcnt can only be periodic from its setup, so the reader thread takes the dumps itself
+	_reader_interval_ns = interval_ns;
+
+	if (_backend != mali_userspace::KbaseBackend::KinstrPrfcnt && ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_SET_INTERVAL, interval_ns) != 0)
+	{
+		close(_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_IN]);
+		close(_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_OUT]);
+		_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_IN]  = -1;
+		_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_OUT] = -1;
+		throw std::runtime_error("Failed to set the dump interval.");
+	}
+
+	_reader_thread = std::thread(&MaliCounter::reader_loop, this, on_dump);
+}
+
+void MaliCounter::stop_reader_thread(DumpHandler on_pending_dump)
+{
+	if (!_reader_thread.joinable())
+	{
+		return;
+	}
+
+	// A full pipe already holds a wake-up for the thread
+	const mali_userspace::poll_data_t data = 0;
+	if (write(_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_OUT], &data, sizeof(data)) != sizeof(data) && errno != EAGAIN)
+	{
+		throw std::runtime_error("Failed to signal the reader thread.");
+	}
+
+	_reader_thread.join();
+
+	if (_backend != mali_userspace::KbaseBackend::KinstrPrfcnt)
+	{
+		ioctl(_hwc_fd, mali_userspace::KBASE_HWCNT_READER_SET_INTERVAL, 0);
+	}
+	drain_pending_buffers(on_pending_dump);
+
+	close(_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_IN]);
+	close(_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_OUT]);
+	_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_IN]  = -1;
+	_reader_pipe[mali_userspace::PIPE_DESCRIPTOR_OUT] = -1;
+}
+
+void MaliCounter::reader_loop(DumpHandler on_dump)
+{
+	pollfd poll_fds[mali_userspace::POLL_DESCRIPTOR_COUNT];        // NOLINT
+	poll_fds[mali_userspace::POLL_DESCRIPTOR_SIGNAL].fd           = _reader_pipe[mali_userspace::PIPE_DESCRIPTOR_IN];
+	poll_fds[mali_userspace::POLL_DESCRIPTOR_SIGNAL].events       = POLLIN;
+	poll_fds[mali_userspace::POLL_DESCRIPTOR_HWCNT_READER].fd     = _hwc_fd;
+	poll_fds[mali_userspace::POLL_DESCRIPTOR_HWCNT_READER].events = POLLIN;
+
+	timespec interval;
+	interval.tv_sec        = static_cast<time_t>(_reader_interval_ns / 1000000000u);
+	interval.tv_nsec       = static_cast<long>(_reader_interval_ns % 1000000000u);
+	const timespec *period = _backend == mali_userspace::KbaseBackend::KinstrPrfcnt && _reader_interval_ns != 0 ? &interval : nullptr;
+
+	while (true)
+	{
+		const int count = ppoll(poll_fds, mali_userspace::POLL_DESCRIPTOR_COUNT, period, nullptr);
+
+		if (count < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+
+		if (count == 0)
+		{
+			mali_userspace::prfcnt_control_cmd cmd = {};
+			cmd.cmd                                = mali_userspace::PRFCNT_CONTROL_CMD_SAMPLE_SYNC;
+			if (ioctl(_hwc_fd, KBASE_IOCTL_KINSTR_PRFCNT_CMD, &cmd) != 0 || !drain_pending_buffers(on_dump))
+			{
+				return;
+			}
+			continue;
+		}
+
+		if (poll_fds[mali_userspace::POLL_DESCRIPTOR_SIGNAL].revents != 0)
+		{
+			return;
+		}
+
+		const short revents = poll_fds[mali_userspace::POLL_DESCRIPTOR_HWCNT_READER].revents;
+
+		if ((revents & POLLIN) != 0)
+		{
+			// Handle every buffer the kernel has filled since the last wake up
+			if (!drain_pending_buffers(on_dump))
+			{
+				return;
+			}
+		}
+		else if ((revents & (POLLHUP | POLLERR)) != 0)
+		{
+			return;
+		}
+	}
+}
+
+bool MaliCounter::drain_pending_buffers(DumpHandler on_dump)
+{
+	mali_userspace::kbase_hwcnt_reader_metadata meta;        // NOLINT
+	const uint32_t *                            counters = nullptr;
+
+	while (get_buffer(meta, counters))
+	{
+		if (on_dump != nullptr)
+		{
+			(this->*on_dump)(counters, meta.timestamp);
+		}
+
+		if (!put_buffer(meta))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MaliCounter::push_stream_sample(const uint32_t *counters, uint64_t timestamp)
+{
+	MaliRawSample *slot = _stream_ring->write_slot();
+
+	if (slot == nullptr)
+	{
+		_dropped_samples++;
+		return;
+	}
+
+	// Slots were sized by start_streaming() and are never handed out
+	memcpy(slot->counters.data(), counters, _buffer_size);
+	slot->timestamp = timestamp;
+	_stream_ring->push();
+}
+
+void MaliCounter::accumulate_sample(const uint32_t *counters, uint64_t)
+{
+	accumulate(_accumulator.data(), counters, _accumulator.size());
+}
+
 void MaliCounter::start()
 {
+	if (_streaming)
+	{
+		throw std::runtime_error("Can't start the counter while streaming.");
+	}
+
+	// The pending dump is delivered before the one of this start
+	complete_stop(-1);
+
+	// Discard the top up dumps of a measurement that was never stopped
+	stop_reader_thread(nullptr);
+
 	sample_counters();
-	wait_next_event();
-	_start_time = _timestamp;
+	_start_time = wait_next_event().timestamp();
+
+	if (_top_up_interval_ns != 0)
+	{
+		_accumulator.assign(_buffer_size / sizeof(uint32_t), 0);
+		start_reader_thread(_top_up_interval_ns, &MaliCounter::accumulate_sample);
+	}
 }
 
 void MaliCounter::stop()
 {
+	stop_async();
+	complete_stop(-1);
+}
+
+void MaliCounter::stop_async()
+{
+	if (_streaming)
+	{
+		throw std::runtime_error("Can't stop the counter while streaming.");
+	}
+
+	if (_stop_pending)
+	{
+		throw std::runtime_error("The counter is already being stopped.");
+	}
+
+	// Add the last top up dumps to the 64-bit accumulators, the final one is added when it is delivered
+	_stop_accumulating = _reader_thread.joinable();
+	stop_reader_thread(&MaliCounter::accumulate_sample);
+
 	sample_counters();
-	wait_next_event();
+	_stop_pending = true;
+}
+
+bool MaliCounter::complete_stop(int timeout_ms)
+{
+	if (!_stop_pending)
+	{
+		return false;
+	}
+
+	const MaliSampleView sample = wait_next_event(timeout_ms);
+
+	if (!sample.valid())
+	{
+		return false;
+	}
+
+	if (_stop_accumulating)
+	{
+		accumulate_sample(sample.counters(), sample.timestamp());
+		read_counters(_accumulator.data());
+	}
+	else
+	{
+		read_counters(sample.counters());
+	}
+
+	_stop_time    = sample.timestamp();
+	_stop_pending = false;
+	update_derived_metrics();
+
+	return true;
+}
+
+uint64_t MaliCounter::start_time() const
+{
+	return _start_time;
+}
+
+uint64_t MaliCounter::stop_time() const
+{
+	return _stop_time;
+}
+
+unsigned MaliCounter::gpu_freq_khz_min() const
+{
+	return _gpu_freq_khz_min;
+}
+
+unsigned MaliCounter::gpu_freq_khz_max() const
+{
+	return _gpu_freq_khz_max;
+}
+
+void MaliCounter::set_gpu_frequency(uint64_t frequency_hz)
+{
+	_gpu_freq_hz = frequency_hz;
+}
+
+bool MaliCounter::stop_pending() const
+{
+	return _stop_pending;
+}
+
+int MaliCounter::event_fd() const
+{
+	return _hwc_fd;
+}
+
+void MaliCounter::read_fixed_counters(const uint32_t *sample)
+{
+	_fixed_layout->read32(sample, _fixed_targets);
+}
+
+void MaliCounter::read_fixed_counters(const uint64_t *sample)
+{
+	_fixed_layout->read64(sample, _fixed_targets);
+}
+
+template <typename T>
+void MaliCounter::read_counters(const T *sample)
+{
+	// Kernel specialized for the GPU and the profile, every counter is at a fixed offset
+	if (_fixed_layout != nullptr)
+	{
+		read_fixed_counters(sample);
+		update_imbalance();
+		return;
+	}
+
+	const T *jm_counter = sample + block_offset(mali_userspace::MALI_NAME_BLOCK_JM);
+
+	for (auto &counter : _jm_counters)
+	{
+		counter.value = jm_counter[counter.index];
+	}
 
-	const uint32_t *jm_counter = get_counters(mali_userspace::MALI_NAME_BLOCK_JM);
+	const T *tiler_counter = sample + block_offset(mali_userspace::MALI_NAME_BLOCK_TILER);
 
-	for (const auto &jm_counter_name : _jm_counter_names)
+	for (auto &counter : _tiler_counters)
 	{
-		_counters.at(jm_counter_name.first) = Measurement(jm_counter[find_counter_index_by_name(mali_userspace::MALI_NAME_BLOCK_JM, jm_counter_name.first)], _counters.at(jm_counter_name.first).unit());
+		counter.value = tiler_counter[counter.index];
 	}
 
-	// We have one MMU counter per L2 cache slice
-	std::vector<const uint32_t *> mmu_counters;
-	for (int i = 0; i < _num_l2_slices; i++)
+	// Sum whole shader core blocks at once, then pick the selected counters out of the sum
+	if (!_shader_counters.empty())
 	{
-		mmu_counters.push_back(get_counters(mali_userspace::MALI_NAME_BLOCK_MMU, i));
+		_shader_block_sum.fill(0);
+
+		for (int core = 0; core < _num_cores; core++)
+		{
+			const T *shader_counter = sample + block_offset(mali_userspace::MALI_NAME_BLOCK_SHADER, core);
+			accumulate(_shader_block_sum.data(), shader_counter, mali_userspace::MALI_NAME_BLOCK_SIZE);
+
+			for (auto &counter : _shader_counters)
+			{
+				counter.core_values[core] = shader_counter[counter.index];
+			}
+		}
+
+		for (auto &counter : _shader_counters)
+		{
+			counter.value = _shader_block_sum[counter.index];
+		}
 	}
 
-	// We iterate over counter names and accumulate data from all L2 cache slices
-	for (const auto &mmu_counter_name : _mmu_counter_names)
+	// We have one MMU counter per L2 cache slice, accumulate data from all of them
+	const T *mmu_counter = _num_l2_slices > 0 ? sample + block_offset(mali_userspace::MALI_NAME_BLOCK_MMU, 0) : nullptr;
+
+	for (auto &counter : _mmu_counters)
 	{
-		uint32_t mmu_counter_value = 0;
-		for (const auto &mmu_counter : mmu_counters)
+		uint64_t mmu_counter_value = 0;
+		// MMU blocks of consecutive slices are contiguous in the dump
+		for (int i = 0; i < _num_l2_slices; i++)
 		{
-			mmu_counter_value += mmu_counter[find_counter_index_by_name(mali_userspace::MALI_NAME_BLOCK_MMU, mmu_counter_name.first)];
+			counter.slice_values[i] = mmu_counter[mali_userspace::MALI_NAME_BLOCK_SIZE * i + counter.index];
+			mmu_counter_value += counter.slice_values[i];
 		}
-		_counters.at(mmu_counter_name.first) = Measurement(mmu_counter_value, _counters.at(mmu_counter_name.first).unit());
+		counter.value = mmu_counter_value;
+	}
+
+	update_imbalance();
+}
+
+void MaliCounter::update_imbalance()
+{
+	for (auto &counter : _shader_counters)
+	{
+		counter.imbalance = compute_imbalance(counter.core_values);
 	}
 
-	_stop_time = _timestamp;
+	for (auto &counter : _mmu_counters)
+	{
+		counter.imbalance = compute_imbalance(counter.slice_values);
+	}
 }
 
 std::string MaliCounter::id() const
@@ -528,20 +1917,106 @@ std::string MaliCounter::id() const
 
 Instrument::MeasurementsMap MaliCounter::measurements() const
 {
-	MeasurementsMap measurements{
-	    {"Timespan", Measurement(_stop_time - _start_time, "ns")},
-	    {"GPU cycles", _counters.at("GPU_ACTIVE")},
-	    {"Fragment jobs", _counters.at("JS0_JOBS")},
-	    {"Vertex/compute jobs", _counters.at("JS1_JOBS")},
-	    {"L2 cache read lookups", _counters.at("L2_READ_LOOKUP")},
-	    {"L2 cache external reads", _counters.at("L2_EXT_READ")},
-	    {"L2 cache external read stalls", _counters.at("L2_EXT_AR_STALL")},
-	    {"L2 cache write lookups", _counters.at("L2_WRITE_LOOKUP")},
-	    {"L2 cache external writes", _counters.at("L2_EXT_WRITE")},
-	    {"L2 cache external write stalls", _counters.at("L2_EXT_W_STALL")},
-	    {"L2 cache external read beats", _counters.at("L2_EXT_READ_BEATS")},
-	    {"L2 cache external write beats", _counters.at("L2_EXT_WRITE_BEATS")},
-	};
+	MeasurementsSnapshot snapshot;
+	this->snapshot(snapshot);
+	return snapshot.to_map();
+}
+
+void MaliCounter::snapshot(MeasurementsSnapshot &snapshot) const
+{
+	const auto counter_lists = {&_jm_counters, &_tiler_counters, &_shader_counters, &_mmu_counters};
+
+	size_t size = 1 + _derived_metrics.size();
+	for (const auto *counters : counter_lists)
+	{
+		size += counters->size();
+	}
+
+	// Timespan first, then the counters of every block and the derived metrics
+	if (!snapshot.check_layout(size))
+	{
+		snapshot.add("Timespan", "ns", false);
+
+		for (const auto *counters : counter_lists)
+		{
+			for (const auto &counter : *counters)
+			{
+				snapshot.add(counter.label, counter.unit, false);
+			}
+		}
+
+		for (const auto &metric : _derived_metrics)
+		{
+			snapshot.add(derived_metric_formulas[metric.formula].label, derived_metric_formulas[metric.formula].unit, true);
+		}
+	}
+
+	MeasurementsSnapshot::Id id = 0;
+	snapshot.set(id++, _stop_time - _start_time);
+
+	for (const auto *counters : counter_lists)
+	{
+		for (const auto &counter : *counters)
+		{
+			snapshot.set(id++, counter.value);
+		}
+	}
+
+	for (const auto &metric : _derived_metrics)
+	{
+		snapshot.set(id++, metric.value);
+	}
+}
+
+MaliCounter::CoreMeasurementsMap MaliCounter::core_measurements() const
+{
+	CoreMeasurementsMap measurements;
+
+	for (const auto &counter : _shader_counters)
+	{
+		std::vector<Measurement> &values = measurements[counter.label];
+		values.reserve(counter.core_values.size());
+
+		for (const auto value : counter.core_values)
+		{
+			values.emplace_back(value, counter.unit);
+		}
+	}
+
+	return measurements;
+}
+
+MaliCounter::CoreMeasurementsMap MaliCounter::slice_measurements() const
+{
+	CoreMeasurementsMap measurements;
+
+	for (const auto &counter : _mmu_counters)
+	{
+		std::vector<Measurement> &values = measurements[counter.label];
+		values.reserve(counter.slice_values.size());
+
+		for (const auto value : counter.slice_values)
+		{
+			values.emplace_back(value, counter.unit);
+		}
+	}
 
 	return measurements;
 }
+
+MaliCounter::ImbalanceMap MaliCounter::imbalance() const
+{
+	ImbalanceMap imbalance;
+
+	for (const auto &counter : _shader_counters)
+	{
+		imbalance[counter.label] = counter.imbalance;
+	}
+
+	for (const auto &counter : _mmu_counters)
+	{
+		imbalance[counter.label] = counter.imbalance;
+	}
+
+	return imbalance;
+}
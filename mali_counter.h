@@ -25,20 +25,154 @@
 #pragma once
 
 #include "hwc.hpp"
+#include "hwc_layouts.hpp"
 #include "instrument.h"
 #include "measurement.h"
+#include "ring_buffer.h"
+#include "trace.h"
 
+#include <array>
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <algorithm>
 
-/** Instrument implementation for mali hw counters. */
+/** Raw hardware counter dump, as laid out in memory by the kernel. */
+struct MaliRawSample
+{
+	uint64_t              timestamp{0}; /**< Time of the dump, in nanoseconds. */
+	std::vector<uint32_t> counters{};   /**< Counter blocks: job manager, tiler, one per L2 slice, then one per shader core. */
+};
+
+/** Scoped view over a hardware counter buffer shared with the kernel.
+ *
+ * The counters are read directly from the pages mapped from the hwcnt
+ * reader, without copying them. The buffer is handed back to the kernel
+ * (READER_PUT_BUFFER) when the view is destroyed or released, so views must
+ * be short-lived: the reader only owns a handful of buffers. With the
+ * kinstr_prfcnt reader the view points at a converted copy of the sample.
+ */
+class MaliSampleView
+{
+  public:
+	/** Default constructor: an empty view. */
+	MaliSampleView() = default;
+
+	/** Prevent instances of this class from being copy constructed */
+	MaliSampleView(const MaliSampleView &) = delete;
+	/** Prevent instances of this class from being copied */
+	MaliSampleView &operator=(const MaliSampleView &) = delete;
+	/** Allow instances of this class to be move constructed */
+	MaliSampleView(MaliSampleView &&other);
+	/** Allow instances of this class to be moved */
+	MaliSampleView &operator=(MaliSampleView &&other);
+
+	/** Return the buffer to the kernel. */
+	~MaliSampleView();
+
+	/** Return the buffer to the kernel before the view goes out of scope. */
+	void release();
+
+	/** Check whether the view holds a buffer.
+	 *
+	 * @return true if the view holds a buffer.
+	 */
+	bool valid() const
+	{
+		return _data != nullptr;
+	}
+
+	/** Raw counter blocks: job manager, tiler, one per L2 slice, then one per shader core.
+	 *
+	 * @return pointer to the first counter of the dump.
+	 */
+	const uint32_t *counters() const
+	{
+		return _data;
+	}
+
+	/** Number of 32-bit counters in the dump.
+	 *
+	 * @return the size of the dump.
+	 */
+	size_t size() const
+	{
+		return _size;
+	}
+
+	/** Time of the dump, in nanoseconds.
+	 *
+	 * @return the timestamp of the dump.
+	 */
+	uint64_t timestamp() const
+	{
+		return _meta.timestamp;
+	}
+
+  private:
+	friend class MaliCounter;
+
+	MaliSampleView(int hwc_fd, const mali_userspace::kbase_hwcnt_reader_metadata &meta, const uint32_t *data, size_t size);
+
+	int                                         _hwc_fd{-1};
+	mali_userspace::kbase_hwcnt_reader_metadata _meta{};
+	const uint32_t *                            _data{nullptr};
+	size_t                                      _size{0};
+};
+
+/** Predefined sets of counters collected by a MaliCounter. */
+enum class MaliCounterProfile
+{
+	Default,    /**< Job manager activity and L2 cache traffic. */
+	AlwaysOn,   /**< GPU cycles, job counts and external memory traffic, cheap enough to leave enabled. */
+	Shading,    /**< Default counters, plus tiler and shader core activity. */
+	Diagnostic, /**< Every counter the GPU exposes. */
+};
+
+/** Maximum number of counters a derived metric is computed from. */
+enum
+{
+	DERIVED_METRIC_MAX_INPUTS = 3
+};
+
+/** Spread of a counter over the shader cores or the L2 slices of the GPU. */
+struct MaliImbalance
+{
+	double max_over_mean{0.0};            /**< Busiest core or slice over the average, 1 when perfectly balanced, 0 without activity. */
+	double coefficient_of_variation{0.0}; /**< Standard deviation over the mean, 0 when perfectly balanced or without activity. */
+};
+
+/** kbase context shared by the Mali counters of the process. */
+struct MaliDevice;
+
+/** Instrument implementation for mali hw counters.
+ *
+ * On top of the raw counters, the measurements include metrics derived from
+ * them with formulas specific to the GPU family (utilization, busy time,
+ * external bandwidth, stall rates, fragment/compute share, overdraw). They
+ * are computed once per sample, for the metrics whose counters are collected.
+ */
 class MaliCounter : public Instrument
 {
   public:
-	/// @brief Construct a Mali counter.
+	/// @brief Construct a Mali counter collecting the default profile.
 	MaliCounter();
 
+	/// @brief Construct a Mali counter collecting a predefined set of counters.
+	///
+	/// Only the blocks of counters used by the profile are enabled in the GPU.
+	explicit MaliCounter(MaliCounterProfile profile);
+
+	/// @brief Construct a Mali counter collecting the given counters.
+	///
+	/// Counters are named as in hwc_names.hpp, without the product prefix
+	/// (e.g. "GPU_ACTIVE"). Only the blocks of counters they belong to are
+	/// enabled in the GPU.
+	explicit MaliCounter(const std::vector<std::string> &counter_names);
+
 	/** Prevent instances of this class from being copy constructed */
 	MaliCounter(const MaliCounter &) = delete;
 	/** Prevent instances of this class from being copied */
@@ -51,31 +185,310 @@ class MaliCounter : public Instrument
 	void            start() override;
 	void            stop() override;
 	MeasurementsMap measurements() const override;
+	void            snapshot(MeasurementsSnapshot &snapshot) const override;
+
+	/** Time of the dump of the last @ref start, as reported by the kernel.
+	 *
+	 * @return the timestamp, in nanoseconds.
+	 */
+	uint64_t start_time() const;
+
+	/** Time of the dump of the last completed stop, as reported by the kernel.
+	 *
+	 * @return the timestamp, in nanoseconds.
+	 */
+	uint64_t stop_time() const;
+
+	/** Lowest clock of the GPU, as reported by the driver.
+	 *
+	 * @return the frequency, in kHz, 0 if the driver doesn't report it.
+	 */
+	unsigned gpu_freq_khz_min() const;
+
+	/** Highest clock of the GPU, as reported by the driver.
+	 *
+	 * @return the frequency, in kHz.
+	 */
+	unsigned gpu_freq_khz_max() const;
+
+	/** Set the clock the GPU runs at, used by the derived metrics of the following samples.
+	 *
+	 * The utilization and busy time are computed at the highest clock by
+	 * default, which overstates the headroom once DVFS lowers the clock. Pass
+	 * the current frequency (e.g. from @ref DVFSMonitor) before each stop.
+	 *
+	 * @param[in] frequency_hz Current GPU clock, in Hz, 0 to use the highest clock.
+	 */
+	void set_gpu_frequency(uint64_t frequency_hz);
+
+	/** Map of measurements with one value per shader core */
+	using CoreMeasurementsMap = std::map<std::string, std::vector<Measurement>>;
+
+	/** Return the latest shader core measurements, core by core.
+	 *
+	 * @ref measurements reports the sum over all the cores.
+	 *
+	 * @return one measurement per shader core, in core index order, for each shader core counter.
+	 */
+	CoreMeasurementsMap core_measurements() const;
+
+	/** Return the latest L2 cache measurements, slice by slice.
+	 *
+	 * @ref measurements reports the sum over all the slices.
+	 *
+	 * @return one measurement per L2 slice, in slice order, for each L2 cache counter.
+	 */
+	CoreMeasurementsMap slice_measurements() const;
+
+	/** Map of the imbalance of each counter */
+	using ImbalanceMap = std::map<std::string, MaliImbalance>;
+
+	/** Return how evenly the latest sample was spread over the GPU.
+	 *
+	 * Each shader core counter is compared across the cores, each L2 cache
+	 * counter across the slices. A high imbalance with a moderate load means
+	 * the work distribution, rather than the amount of work, limits the GPU.
+	 *
+	 * @return the imbalance of each shader core and L2 cache counter, keyed by measurement name.
+	 */
+	ImbalanceMap imbalance() const;
+
+	/** Start dumping the counters periodically on a background thread.
+	 *
+	 * The hwcnt reader is put in periodic mode and a dedicated thread pushes
+	 * every dump into a lock-free ring buffer, which the application drains
+	 * with @ref pop_sample without blocking. @ref start and @ref stop can't be
+	 * used while streaming.
+	 *
+	 * @param[in] interval_ns   Dump interval, in nanoseconds.
+	 * @param[in] ring_capacity (Optional) Number of dumps the ring can hold, rounded up to a power of two.
+	 */
+	void start_streaming(uint32_t interval_ns, size_t ring_capacity = 256);
+
+	/** Stop the background thread and leave periodic mode. */
+	void stop_streaming();
+
+	/** Take the oldest dump captured by the streaming thread.
+	 *
+	 * The dump is copied into the storage of @p sample, so a caller that keeps
+	 * reusing the same sample only allocates on the first call, and the ring's
+	 * slots keep the size they were allocated with.
+	 *
+	 * @param[out] sample The dump. Each dump holds the counts since the previous one.
+	 *
+	 * @return false if no dump is available.
+	 */
+	bool pop_sample(MaliRawSample &sample);
+
+	/** Number of dumps discarded because the ring was full.
+	 *
+	 * @return the number of dropped dumps since streaming started.
+	 */
+	uint64_t dropped_samples() const;
+
+	/** Stop measuring without collecting the final dump.
+	 *
+	 * Requests the dump, which is a synchronous ioctl returning once the GPU
+	 * has written the counters, but doesn't wait for the kernel to deliver
+	 * the buffer or read it. The measurements are updated once the dump is
+	 * picked up by @ref complete_stop, for instance on the next frame, or
+	 * when @ref event_fd becomes readable in an event loop. Until then
+	 * @ref measurements returns the previous values. start(),
+	 * dumps and a blocking stop() complete a pending stop first.
+	 */
+	void stop_async();
+
+	/** Pick up the final dump of @ref stop_async.
+	 *
+	 * @param[in] timeout_ms Time to wait for the dump, in milliseconds: 0 to poll, -1 to wait until it is delivered.
+	 *
+	 * @return true if the measurements were updated, false if the dump isn't ready or no stop is pending.
+	 */
+	bool complete_stop(int timeout_ms = 0);
+
+	/** Check whether a stop is waiting for its dump.
+	 *
+	 * @return true if @ref stop_async was called and the stop isn't complete.
+	 */
+	bool stop_pending() const;
+
+	/** File descriptor of the hardware counter reader, to wait for dumps with poll() or epoll.
+	 *
+	 * It becomes readable (POLLIN) when a dump is ready.
+	 *
+	 * @return the reader file descriptor.
+	 */
+	int event_fd() const;
+
+	/** Interface the driver was probed with.
+	 *
+	 * With kinstr_prfcnt the samples are converted to the hwcnt reader layout,
+	 * so dumps and @ref get_counters look the same whatever the interface.
+	 *
+	 * @return the kbase interface used by the counter.
+	 */
+	mali_userspace::KbaseBackend backend() const
+	{
+		return _backend;
+	}
+
+	/** Dump the counters in the background while measuring, so that they can't wrap.
+	 *
+	 * The hardware counters are 32-bit and are cleared by every dump. With a
+	 * top up interval, @ref start puts the reader in periodic mode and a
+	 * background thread adds each dump to 64-bit accumulators, so a single
+	 * start()/stop() pair can cover a long run without dumping in the caller's
+	 * loop. Without it, one start()/stop() interval must be short enough for
+	 * the counters not to wrap (a few seconds for GPU_ACTIVE at 1GHz).
+	 *
+	 * @param[in] interval_ns Interval between background dumps, in nanoseconds. 0 disables them.
+	 */
+	void set_top_up_interval(uint32_t interval_ns);
+
+	/** Dump the counters and wait for the result, without copying it.
+	 *
+	 * @return A view over the kernel buffer holding the counts since the previous dump.
+	 */
+	MaliSampleView dump();
+
+	/** Request a dump of the counters without collecting it.
+	 *
+	 * The dump ioctl is synchronous: it returns once the GPU has written the
+	 * counters to a kernel buffer, so the call costs the dump itself. Only
+	 * collecting the buffer is deferred. A pending @ref stop_async is
+	 * completed first, waiting for its dump.
+	 *
+	 * Requested dumps are delivered in order by @ref next_dump. The kernel
+	 * holds at most @ref buffer_count dumps until they are collected.
+	 */
+	void request_dump();
+
+	/** Wait for the oldest requested dump.
+	 *
+	 * @return A view over the kernel buffer holding the counts between this dump and the previous one.
+	 */
+	MaliSampleView next_dump();
+
+	/** Number of dumps the kernel can hold until they are collected.
+	 *
+	 * @return the number of hardware counter buffers.
+	 */
+	size_t buffer_count() const;
+
+	/** Number of counters of a dump, over all the blocks.
+	 *
+	 * @return the size of a dump in 32-bit words.
+	 */
+	size_t dump_size() const;
+
+	/** Extract the selected counters and derived metrics from dumps summed by the caller.
+	 *
+	 * The snapshot is filled as if the counter had been stopped after
+	 * @p timespan_ns with these counts. The latest measurements of the
+	 * counter are left unchanged.
+	 *
+	 * @param[in]     dump        Sum of consecutive dumps, @ref dump_size words.
+	 * @param[in]     timespan_ns Time covered by the dumps, in nanoseconds.
+	 * @param[in,out] snapshot    Snapshot filled with the measurements, see @ref snapshot.
+	 */
+	void decode(const uint64_t *dump, uint64_t timespan_ns, MeasurementsSnapshot &snapshot);
+
+	/** Describe the GPU for a trace of its dumps.
+	 *
+	 * Record the dumps with a @ref TraceWriter created with this header and
+	 * block TRACE_BLOCK_MALI_DUMP, so they can be decoded on another machine.
+	 *
+	 * @return the trace header of this GPU.
+	 */
+	TraceHeader trace_header() const;
+
+	/** Locate a counter block in a dump.
+	 *
+	 * @param[in] sample Raw dump, e.g. @ref MaliSampleView::counters or @ref MaliRawSample::counters.
+	 * @param[in] block  Block to locate.
+	 * @param[in] index  (Optional) L2 slice for MMU blocks, core index for shader core blocks.
+	 *
+	 * @return pointer to the first of the block's 64 counters.
+	 */
+	const uint32_t *get_counters(const uint32_t *sample, mali_userspace::MaliCounterBlockName block, int index = -1) const;
 
   private:
 	void init();
 	void term();
+	void setup_hwcnt_reader();
+	void setup_kinstr_reader();
+	void select_counters();
+	void select_derived_metrics();
+	void select_fixed_layout(size_t product);
+	void update_imbalance();
+	void update_derived_metrics();
+
+	/** Function called by the reader thread for each dump */
+	using DumpHandler = void (MaliCounter::*)(const uint32_t *counters, uint64_t timestamp);
+
+	void start_reader_thread(uint32_t interval_ns, DumpHandler on_dump);
+	void stop_reader_thread(DumpHandler on_pending_dump);
+	void reader_loop(DumpHandler on_dump);
+	bool drain_pending_buffers(DumpHandler on_dump);
+	void push_stream_sample(const uint32_t *counters, uint64_t timestamp);
+	void accumulate_sample(const uint32_t *counters, uint64_t timestamp);
 
-	void            sample_counters();
-	void            wait_next_event();
-	const uint32_t *get_counters() const;
-	const uint32_t *get_counters(mali_userspace::MaliCounterBlockName block, int index = -1) const;
-	int             find_counter_index_by_name(mali_userspace::MaliCounterBlockName block, const char *name);
-
-	const std::vector<std::pair<const char *, const char *>> _jm_counter_names{
-	    {"GPU_ACTIVE", "cycles"},
-	    {"JS0_JOBS", "jobs"},
-	    {"JS1_JOBS", "jobs"}};
-	const std::vector<std::pair<const char *, const char *>> _mmu_counter_names{
-	    {"L2_READ_LOOKUP", "cache lookups"},
-	    {"L2_EXT_READ", "transactions"},
-	    {"L2_EXT_AR_STALL", "stall cycles"},
-	    {"L2_WRITE_LOOKUP", "cache lookups"},
-	    {"L2_EXT_WRITE", "transactions"},
-	    {"L2_EXT_W_STALL", "stall cycles"},
-	    {"L2_EXT_READ_BEATS", "bus cycles"},
-	    {"L2_EXT_WRITE_BEATS", "bus cycles"}};
-	std::map<std::string, Measurement> _counters{};
+	template <typename T>
+	void           read_counters(const T *sample);
+	void           read_fixed_counters(const uint32_t *sample);
+	void           read_fixed_counters(const uint64_t *sample);
+	size_t         block_offset(mali_userspace::MaliCounterBlockName block, int index = -1) const;
+	void           sample_counters();
+	bool           get_buffer(mali_userspace::kbase_hwcnt_reader_metadata &meta, const uint32_t *&counters);
+	bool           put_buffer(const mali_userspace::kbase_hwcnt_reader_metadata &meta);
+	MaliSampleView wait_next_event(int timeout_ms = -1);
+	int            find_counter_index_by_name(mali_userspace::MaliCounterBlockName block, const char *name) const;
+
+	/** Counter whose position in its block is resolved once in init() */
+	struct ResolvedCounter
+	{
+		int                   index;        /**< Offset of the counter in its block. */
+		std::string           name;         /**< Name of the counter, without the product prefix. */
+		std::string           label;        /**< Name of the counter in the measurements. */
+		std::string           unit;         /**< Unit of the counter. */
+		uint64_t              value;        /**< Latest value of the counter, summed over cores and L2 slices. */
+		std::vector<uint64_t> core_values;  /**< Latest value of a shader core counter for each core. */
+		std::vector<uint64_t> slice_values; /**< Latest value of an L2 cache counter for each slice. */
+		MaliImbalance         imbalance;    /**< Spread of the latest value over the cores or slices. */
+	};
+
+	MaliCounterProfile           _profile{MaliCounterProfile::Default};
+	std::vector<std::string>     _counter_names{};
+	std::vector<ResolvedCounter> _jm_counters{};
+	std::vector<ResolvedCounter> _tiler_counters{};
+	std::vector<ResolvedCounter> _shader_counters{};
+	std::vector<ResolvedCounter> _mmu_counters{};
+	uint32_t                     _jm_bm{0};
+	uint32_t                     _tiler_bm{0};
+	uint32_t                     _shader_bm{0};
+	uint32_t                     _mmu_l2_bm{0};
+
+	std::array<uint64_t, mali_userspace::MALI_NAME_BLOCK_SIZE> _shader_block_sum{};
+
+	/** Metric derived from the counters, computed once per sample */
+	struct DerivedMetric
+	{
+		size_t                                                  formula; /**< Index of the formula computing the metric. */
+		std::array<const uint64_t *, DERIVED_METRIC_MAX_INPUTS> inputs;  /**< Values of the counters the metric is computed from. */
+		double                                                  value;   /**< Latest value of the metric. */
+	};
+
+	const mali_userspace::FixedCounterLayout *_fixed_layout{nullptr}; /**< Kernels reading the profile counters of this GPU at fixed offsets, nullptr to read them by index. */
+	mali_userspace::FixedCounterTargets       _fixed_targets{};
+
+	std::vector<DerivedMetric>    _derived_metrics{};
+
+	std::array<std::vector<ResolvedCounter>, 4> _decoded_counters{}; /**< Latest counters, kept aside while @ref decode runs. */
+	std::vector<DerivedMetric>                  _decoded_metrics{};  /**< Latest derived metrics, kept aside while @ref decode runs. */
+	mali_userspace::MaliGPUFamily _family{mali_userspace::MALI_FAMILY_MIDGARD};
+	unsigned                      _gpu_freq_khz_max{0};
+	unsigned                      _gpu_freq_khz_min{0};
+	uint64_t                      _gpu_freq_hz{0}; /**< Current GPU clock set by the caller, 0 if unknown. */
 
 	uint64_t _start_time{0};
 	uint64_t _stop_time{0};
@@ -84,14 +497,34 @@ class MaliCounter : public Instrument
 	int                _num_cores{0};
 	int                _num_l2_slices{0};
 	uint32_t           _hw_ver{0};
+	uint32_t           _gpu_id{0};
+	uint32_t           _product_id{0};
+	uint64_t           _core_mask{0};
 	int                _buffer_count{16};
 	size_t             _buffer_size{0};
+	size_t             _mmap_size{0};
 	uint8_t *          _sample_data{nullptr};
-	uint64_t           _timestamp{0};
 	const char *const *_names_lut{
 	    nullptr};
-	std::vector<uint32_t>     _raw_counter_buffer{};
 	std::vector<unsigned int> _core_index_remap{};
-	int                       _fd{-1};
-	int                       _hwc_fd{-1};
+	std::shared_ptr<const MaliDevice> _mali_device{}; /**< kbase context shared with the other counters. */
+	int                               _fd{-1};
+	int                               _hwc_fd{-1};
+	mali_userspace::KbaseBackend      _backend{mali_userspace::KbaseBackend::Ioctl};
+
+	size_t                  _kinstr_metadata_size{0};  /**< Stride of the kinstr_prfcnt sample metadata items. */
+	std::array<uint16_t, 4> _kinstr_block_values{};    /**< Number of values of each kinstr_prfcnt block type. */
+	std::vector<uint32_t>   _kinstr_buffers{};         /**< kinstr_prfcnt samples converted to the hwcnt reader layout, one per buffer. */
+	uint32_t                _kinstr_next_buffer{0};
+
+	std::thread                                    _reader_thread{};
+	int                                            _reader_pipe[mali_userspace::PIPE_DESCRIPTOR_COUNT]{-1, -1};
+	bool                                           _streaming{false};
+	bool                                           _stop_pending{false};
+	bool                                           _stop_accumulating{false};
+	std::unique_ptr<SPSCRingBuffer<MaliRawSample>> _stream_ring{};
+	std::atomic<uint64_t>                          _dropped_samples{0};
+	uint32_t                                       _top_up_interval_ns{0};
+	uint32_t                                       _reader_interval_ns{0}; /**< Interval of the reader thread dumps. */
+	std::vector<uint64_t>                          _accumulator{};
 };
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurement.h"
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/** Fixed layout set of measurements, updated in place.
+ *
+ * Names and units are stored once, when the snapshot is laid out, and values
+ * are then set by index. Once laid out, filling a snapshot doesn't allocate,
+ * so it can be polled every frame.
+ */
+class MeasurementsSnapshot
+{
+  public:
+	/** Index of a measurement in the snapshot */
+	using Id = size_t;
+
+	/** Add a measurement to the layout of the snapshot.
+	 *
+	 * @param[in] name              Name of the measurement.
+	 * @param[in] unit              Unit of the measurement.
+	 * @param[in] is_floating_point Will the value stored be floating point ?
+	 *
+	 * @return the index of the measurement.
+	 */
+	Id add(std::string name, std::string unit, bool is_floating_point)
+	{
+		_names.push_back(std::move(name));
+		_units.push_back(std::move(unit));
+		_values.emplace_back(is_floating_point);
+		return _values.size() - 1;
+	}
+
+	/** Set a floating point value
+	 *
+	 * @param[in] id Index of the measurement.
+	 * @param[in] v  Value to store.
+	 */
+	template <typename Floating, typename std::enable_if<!std::is_integral<Floating>::value, int>::type = 0>
+	void set(Id id, Floating v)
+	{
+		_values[id].v.floating_point = static_cast<double>(v);
+	}
+
+	/** Set an integer value
+	 *
+	 * @param[in] id Index of the measurement.
+	 * @param[in] v  Value to store.
+	 */
+	template <typename Integer, typename std::enable_if<std::is_integral<Integer>::value, int>::type = 0>
+	void set(Id id, Integer v)
+	{
+		_values[id].v.integer = static_cast<long long int>(v);
+	}
+
+	/** Check that the snapshot has the layout of an instrument.
+	 *
+	 * @param[in] size Number of measurements of the instrument.
+	 *
+	 * @return false if the snapshot is empty and must be laid out.
+	 */
+	bool check_layout(size_t size) const
+	{
+		if (_values.empty())
+		{
+			return false;
+		}
+
+		if (_values.size() != size)
+		{
+			throw std::runtime_error("Snapshot was laid out by another instrument.");
+		}
+
+		return true;
+	}
+
+	/** Remove all the measurements, so that the snapshot can be laid out again. */
+	void clear()
+	{
+		_names.clear();
+		_units.clear();
+		_values.clear();
+	}
+
+	/** Number of measurements in the snapshot
+	 *
+	 * @return the number of measurements.
+	 */
+	size_t size() const
+	{
+		return _values.size();
+	}
+
+	/** Check whether the snapshot was laid out.
+	 *
+	 * @return true if the snapshot has no measurement.
+	 */
+	bool empty() const
+	{
+		return _values.empty();
+	}
+
+	/** Accessor for the name of a measurement
+	 *
+	 * @param[in] id Index of the measurement.
+	 *
+	 * @return Name of the measurement
+	 */
+	const std::string &name(Id id) const
+	{
+		return _names[id];
+	}
+
+	/** Accessor for the unit of a measurement
+	 *
+	 * @param[in] id Index of the measurement.
+	 *
+	 * @return Unit of the measurement
+	 */
+	const std::string &unit(Id id) const
+	{
+		return _units[id];
+	}
+
+	/** Accessor for the value of a measurement
+	 *
+	 * @param[in] id Index of the measurement.
+	 *
+	 * @return Value of the measurement
+	 */
+	const Measurement::Value &value(Id id) const
+	{
+		return _values[id];
+	}
+
+	/** Find a measurement by name.
+	 *
+	 * Look measurements up once and keep their index, the search is linear.
+	 *
+	 * @param[in]  name Name of the measurement.
+	 * @param[out] id   Index of the measurement, if found.
+	 *
+	 * @return true if the measurement was found.
+	 */
+	bool find(const std::string &name, Id &id) const
+	{
+		for (Id i = 0; i < _names.size(); ++i)
+		{
+			if (_names[i] == name)
+			{
+				id = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** Build a measurement.
+	 *
+	 * @param[in] id Index of the measurement.
+	 *
+	 * @return the measurement, with its unit.
+	 */
+	Measurement measurement(Id id) const
+	{
+		if (_values[id].is_floating_point)
+		{
+			return Measurement(_values[id].v.floating_point, _units[id]);
+		}
+		return Measurement(_values[id].v.integer, _units[id]);
+	}
+
+	/** Build a map of all the measurements.
+	 *
+	 * If several measurements share a name, the first one is kept.
+	 *
+	 * @return the map of measurements, indexed by name.
+	 */
+	std::map<std::string, Measurement> to_map() const
+	{
+		std::map<std::string, Measurement> measurements;
+
+		for (Id i = 0; i < _values.size(); ++i)
+		{
+			measurements.emplace(_names[i], measurement(i));
+		}
+
+		return measurements;
+	}
+
+  private:
+	std::vector<std::string>        _names{};
+	std::vector<std::string>        _units{};
+	std::vector<Measurement::Value> _values{};
+};
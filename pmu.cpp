@@ -24,10 +24,110 @@
 
 #include "pmu.h"
 
+#include "pmu_events.h"
+
+#include <algorithm>
 #include <asm/unistd.h>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+
+namespace
+{
+#if defined(__aarch64__)
+/** Read a PMU counter register, as indexed by perf_event_mmap_page::index - 1 */
+uint64_t read_pmu_counter(uint32_t counter)
+{
+	uint64_t value = 0;
+
+#	define HWCPIPE_READ_PMEVCNTR(n)                              \
+		case n:                                                   \
+			asm volatile("mrs %0, pmevcntr" #n "_el0" : "=r"(value)); \
+			break;
+
+	switch (counter)
+	{
+		HWCPIPE_READ_PMEVCNTR(0)
+		HWCPIPE_READ_PMEVCNTR(1)
+		HWCPIPE_READ_PMEVCNTR(2)
+		HWCPIPE_READ_PMEVCNTR(3)
+		HWCPIPE_READ_PMEVCNTR(4)
+		HWCPIPE_READ_PMEVCNTR(5)
+		HWCPIPE_READ_PMEVCNTR(6)
+		HWCPIPE_READ_PMEVCNTR(7)
+		HWCPIPE_READ_PMEVCNTR(8)
+		HWCPIPE_READ_PMEVCNTR(9)
+		HWCPIPE_READ_PMEVCNTR(10)
+		HWCPIPE_READ_PMEVCNTR(11)
+		HWCPIPE_READ_PMEVCNTR(12)
+		HWCPIPE_READ_PMEVCNTR(13)
+		HWCPIPE_READ_PMEVCNTR(14)
+		HWCPIPE_READ_PMEVCNTR(15)
+		HWCPIPE_READ_PMEVCNTR(16)
+		HWCPIPE_READ_PMEVCNTR(17)
+		HWCPIPE_READ_PMEVCNTR(18)
+		HWCPIPE_READ_PMEVCNTR(19)
+		HWCPIPE_READ_PMEVCNTR(20)
+		HWCPIPE_READ_PMEVCNTR(21)
+		HWCPIPE_READ_PMEVCNTR(22)
+		HWCPIPE_READ_PMEVCNTR(23)
+		HWCPIPE_READ_PMEVCNTR(24)
+		HWCPIPE_READ_PMEVCNTR(25)
+		HWCPIPE_READ_PMEVCNTR(26)
+		HWCPIPE_READ_PMEVCNTR(27)
+		HWCPIPE_READ_PMEVCNTR(28)
+		HWCPIPE_READ_PMEVCNTR(29)
+		HWCPIPE_READ_PMEVCNTR(30)
+		case 31:
+			// The kernel remaps the cycle counter to index 32
+			asm volatile("mrs %0, pmccntr_el0" : "=r"(value));
+			break;
+		default:
+			break;
+	}
+
+#	undef HWCPIPE_READ_PMEVCNTR
+
+	return value;
+}
+
+/** Read the clock perf_event_mmap_page::time_offset/mult/shift convert to nanoseconds */
+uint64_t read_timestamp()
+{
+	uint64_t value;
+	asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+	return value;
+}
+#	define HWCPIPE_HAS_USER_READ 1
+#elif defined(__x86_64__) || defined(__i386__)
+/** Read a PMU counter register, as indexed by perf_event_mmap_page::index - 1 */
+uint64_t read_pmu_counter(uint32_t counter)
+{
+	uint32_t low;
+	uint32_t high;
+	asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+	return low | (static_cast<uint64_t>(high) << 32);
+}
+
+/** Read the clock perf_event_mmap_page::time_offset/mult/shift convert to nanoseconds */
+uint64_t read_timestamp()
+{
+	uint32_t low;
+	uint32_t high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return low | (static_cast<uint64_t>(high) << 32);
+}
+#	define HWCPIPE_HAS_USER_READ 1
+#endif
+
+/** Prevent the compiler from reordering accesses to the mmap'd page */
+inline void compiler_barrier()
+{
+	asm volatile("" ::: "memory");
+}
+}        // namespace
 
 PMU::PMU() :
     _perf_config()
@@ -63,13 +163,58 @@ void PMU::open(uint64_t config)
 
 void PMU::open(const perf_event_attr &perf_config)
 {
-	// Measure this process/thread (+ children) on any CPU
-	_fd = syscall(__NR_perf_event_open, &perf_config, 0, -1, -1, 0);
+	open(perf_config, -1);
+}
+
+void PMU::open_leader(uint64_t config)
+{
+	_perf_config.config      = config;
+	_perf_config.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	open(_perf_config, -1);
+
+	if (_fd >= 0)
+	{
+		_group_size = 1;
+		// Layout of a group read: nr, time_enabled, time_running, values[nr]
+		_group_buffer.assign(3 + _group_size, 0);
+	}
+}
+
+void PMU::open(uint64_t config, PMU &leader)
+{
+	_perf_config.config = config;
+	open(_perf_config, leader._fd);
+
+	if (_fd >= 0)
+	{
+		leader._group_size++;
+		leader._group_buffer.assign(3 + leader._group_size, 0);
+		leader._group_members.push_back(this);
+	}
+}
+
+void PMU::open(const perf_event_attr &perf_config, long group_fd)
+{
+	// Measure the target thread (+ children unless a target was set), by default this thread on any CPU
+	_fd = syscall(__NR_perf_event_open, &perf_config, _tid, _cpu, group_fd, 0);
 
 	if (_fd < 0)
 	{
 		HWCPIPE_LOG("perf_event_open failed. Counter ID: %s", config_to_str(_perf_config).c_str());
 	}
+	else if (_user_read_requested)
+	{
+		void *page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, _fd, 0);
+		if (page == MAP_FAILED)
+		{
+			HWCPIPE_LOG("Failed to map PMU counter page: %s", std::to_string(errno).c_str());
+		}
+		else
+		{
+			_user_page   = static_cast<perf_event_mmap_page *>(page);
+			_user_thread = pthread_self();
+		}
+	}
 
 	const int result = ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
 	if (result == -1)
@@ -78,13 +223,175 @@ void PMU::open(const perf_event_attr &perf_config)
 	}
 }
 
+void PMU::request_user_read()
+{
+	_user_read_requested = true;
+
+	// The mmap'd page only reflects the events of the thread the counter is attached to
+	_perf_config.inherit      = 0;
+	_perf_config.inherit_stat = 0;
+
+#if defined(__aarch64__)
+	// config1 bit 1 asks the Arm PMU driver to enable EL0 access to the counter
+	_perf_config.config1 |= 0x2;
+#endif
+}
+
+void PMU::set_target(pid_t tid, int cpu)
+{
+	_tid = tid;
+	_cpu = cpu;
+
+	// Child tasks would otherwise be added to the target's counts
+	_perf_config.inherit      = 0;
+	_perf_config.inherit_stat = 0;
+}
+
+void PMU::set_event_type(uint32_t type)
+{
+	_perf_config.type = type;
+}
+
 void PMU::close()
 {
+	if (_user_page != nullptr)
+	{
+		munmap(_user_page, sysconf(_SC_PAGESIZE));
+		_user_page = nullptr;
+	}
+
 	if (_fd != -1)
 	{
 		::close(_fd);
 		_fd = -1;
 	}
+
+	_group_size = 0;
+	_group_buffer.clear();
+	_group_members.clear();
+
+	// Reopening the counter on its own must read a single value
+	_perf_config.read_format = 0;
+}
+
+bool PMU::is_open() const
+{
+	return _fd >= 0;
+}
+
+bool PMU::has_user_read() const
+{
+	uint64_t value;
+	return read_user(value);
+}
+
+bool PMU::read_user(uint64_t &value, uint64_t *time_enabled, uint64_t *time_running) const
+{
+#if defined(HWCPIPE_HAS_USER_READ)
+	// The counter registers hold the events of the thread running on this CPU
+	if (_user_page == nullptr || !pthread_equal(_user_thread, pthread_self()))
+	{
+		return false;
+	}
+
+	const volatile perf_event_mmap_page *page = _user_page;
+	const bool                           with_times = time_enabled != nullptr || time_running != nullptr;
+	uint32_t                             seq;
+	uint64_t                             count;
+	uint64_t                             enabled;
+	uint64_t                             running;
+	uint64_t                             delta;
+
+	// The kernel updates the page under a seqlock, retry if it changed while reading
+	do
+	{
+		seq = page->lock;
+		compiler_barrier();
+
+		const uint32_t index = page->index;
+		const uint16_t width = page->pmc_width;
+		count                = page->offset;
+		enabled              = page->time_enabled;
+		running              = page->time_running;
+		delta                = 0;
+
+		if (!page->cap_user_rdpmc || index == 0 || width == 0 || width > 64)
+		{
+			return false;
+		}
+
+		// Sign extend the hardware counter to 64 bits before adding the offset
+		int64_t pmc = static_cast<int64_t>(read_pmu_counter(index - 1) << (64 - width));
+		count += static_cast<uint64_t>(pmc >> (64 - width));
+
+		if (with_times)
+		{
+			// The times are only updated when the event is scheduled, add the time since then
+			if (!page->cap_user_time)
+			{
+				return false;
+			}
+
+			const uint16_t shift = page->time_shift;
+			const uint32_t mult  = page->time_mult;
+			uint64_t       cyc   = read_timestamp();
+
+			if (page->cap_user_time_short)
+			{
+				cyc = page->time_cycles + ((cyc - page->time_cycles) & page->time_mask);
+			}
+
+			const uint64_t quot = cyc >> shift;
+			const uint64_t rem  = cyc & ((static_cast<uint64_t>(1) << shift) - 1);
+			delta               = page->time_offset + quot * mult + ((rem * mult) >> shift);
+		}
+
+		compiler_barrier();
+	} while (page->lock != seq);
+
+	value = count;
+	if (time_enabled != nullptr)
+	{
+		*time_enabled = enabled + delta;
+	}
+	if (time_running != nullptr)
+	{
+		// The event is running, as it has a counter
+		*time_running = running + delta;
+	}
+	return true;
+#else
+	(void) value;
+	(void) time_enabled;
+	(void) time_running;
+	return false;
+#endif
+}
+
+bool PMU::read_user_group(PMUGroupValues &values) const
+{
+	if (_user_page == nullptr || _group_members.size() + 1 != _group_size)
+	{
+		return false;
+	}
+
+	values.values.resize(_group_size);
+
+	if (!read_user(values.values[0], &values.time_enabled, &values.time_running))
+	{
+		return false;
+	}
+
+	// A thread's counters don't count while it is switched out, so reading them one by one doesn't skew them
+	for (size_t i = 0; i < _group_members.size(); ++i)
+	{
+		if (!_group_members[i]->read_user(values.values[i + 1]))
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
 bool PMU::reset()
@@ -93,6 +400,49 @@ bool PMU::reset()
 	return result != -1;
 }
 
+bool PMU::reset_group()
+{
+	const int result = ioctl(_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	return result != -1;
+}
+
+bool PMU::enable_group()
+{
+	const int result = ioctl(_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return result != -1;
+}
+
+bool PMU::disable_group()
+{
+	const int result = ioctl(_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	return result != -1;
+}
+
+void PMU::get_group_values(PMUGroupValues &values) const
+{
+	if (_group_size == 0)
+	{
+		throw std::runtime_error("PMU counter is not a group leader.");
+	}
+
+	if (read_user_group(values))
+	{
+		return;
+	}
+
+	const ssize_t result = read(_fd, _group_buffer.data(), _group_buffer.size() * sizeof(uint64_t));
+
+	if (result == -1)
+	{
+		throw std::runtime_error("Can't get PMU group values: " + std::to_string(errno));
+	}
+
+	const size_t count  = std::min<size_t>(_group_buffer[0], _group_size);
+	values.time_enabled = _group_buffer[1];
+	values.time_running = _group_buffer[2];
+	values.values.assign(_group_buffer.begin() + 3, _group_buffer.begin() + 3 + count);
+}
+
 std::string PMU::config_to_str(const perf_event_attr &perf_config)
 {
 	switch (perf_config.type)
@@ -150,6 +500,20 @@ std::string PMU::config_to_str(const perf_event_attr &perf_config)
 				default:
 					return "UNKNOWN SOFTWARE COUNTER";
 			}
+		case PERF_TYPE_RAW:
+		{
+			const char *name = pmu_raw_event_name(perf_config.config);
+			if (name != nullptr)
+			{
+				return name;
+			}
+
+			char str[32];
+			snprintf(str, sizeof(str), "RAW 0x%llx", static_cast<unsigned long long>(perf_config.config));
+			return str;
+		}
+		case PERF_TYPE_HW_CACHE:
+			return pmu_hw_cache_event_name(perf_config.config);
 		default:
 			return std::to_string(perf_config.config);
 	}
@@ -27,10 +27,12 @@
 #include <cstdint>
 #include <errno.h>
 #include <linux/perf_event.h>
+#include <pthread.h>
 #include <stdexcept>
 #include <string>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <vector>
 
 #define HWCPIPE_TAG "HWCPipe"
 
@@ -47,6 +49,14 @@
 		}
 #endif
 
+/** Values of an event group read with a single read() call. */
+struct PMUGroupValues
+{
+	uint64_t              time_enabled{0}; /**< Time the group was enabled, in nanoseconds. */
+	uint64_t              time_running{0}; /**< Time the group was actually counting, in nanoseconds. */
+	std::vector<uint64_t> values{};        /**< Counter values: the leader first, then the members in the order they were opened. */
+};
+
 /** Class provides access to CPU hardware counters. */
 class PMU
 {
@@ -68,6 +78,9 @@ class PMU
 
 	/** Get the counter value.
      *
+     * If userspace access was requested with @ref request_user_read and the
+     * kernel exposes it, the counter is read without a syscall.
+     *
      * @return Counter value casted to the specified type. */
 	template <typename T>
 	T get_value() const;
@@ -84,25 +97,138 @@ class PMU
      */
 	void open(const perf_event_attr &perf_config);
 
+	/** Open the specified counter as the leader of a new event group.
+	 *
+	 * The leader is opened with PERF_FORMAT_GROUP so that the values of all
+	 * the counters of the group can be read at once with @ref get_group_values.
+	 * Call @ref request_user_read on the leader and on every member to read
+	 * the group without a syscall.
+	 *
+	 * @param[in] config Counter identifier.
+	 */
+	void open_leader(uint64_t config);
+
+	/** Open the specified counter as a member of an event group.
+	 *
+	 * Members are scheduled on the PMU together with their leader, so all the
+	 * values of a group are captured at the same time.
+	 *
+	 * @param[in]     config Counter identifier.
+	 * @param[in,out] leader Group leader, opened with @ref open_leader.
+	 */
+	void open(uint64_t config, PMU &leader);
+
+	/** Request userspace access to the counter.
+	 *
+	 * Must be called before the counter is opened. The counter's
+	 * perf_event_mmap_page is then mapped on open so that @ref get_value and
+	 * @ref get_group_values can read the hardware counter directly
+	 * (cap_user_rdpmc), falling back to read() when the kernel doesn't allow
+	 * it.
+	 *
+	 * Userspace reads only see the events of the thread the counter counts,
+	 * so inherit is disabled. The counter must count the thread that opens
+	 * it, and reads from any other thread fall back to read().
+	 */
+	void request_user_read();
+
+	/** Select the thread and CPU to count the events of.
+	 *
+	 * Must be called before the counter is opened. By default the counter
+	 * counts the calling thread and its children on any CPU. Once a target is
+	 * set, inherit is disabled so that each counter only reports its target.
+	 *
+	 * @param[in] tid Thread to count, 0 for the calling thread, -1 for all the threads (requires @p cpu).
+	 * @param[in] cpu CPU to count on, -1 for any CPU.
+	 */
+	void set_target(pid_t tid, int cpu);
+
+	/** Select the type of the event to count.
+	 *
+	 * Must be called before the counter is opened. The default type is
+	 * PERF_TYPE_HARDWARE, so the config passed to @ref open is one of the
+	 * generic PERF_COUNT_HW_* events.
+	 *
+	 * @param[in] type Event type, e.g. PERF_TYPE_RAW or PERF_TYPE_HW_CACHE.
+	 */
+	void set_event_type(uint32_t type);
+
 	/** Close the currently open counter. */
 	void close();
 
+	/** Check whether the counter was opened successfully.
+	 *
+	 * @return true if the counter is open.
+	 */
+	bool is_open() const;
+
 	/** Reset counter.
 	 *
 	 * @return false if reset fails. */
 	bool reset();
 
+	/** Reset all the counters of the group led by this counter with a single ioctl.
+	 *
+	 * @return false if reset fails. */
+	bool reset_group();
+
+	/** Start counting the events of the group led by this counter.
+	 *
+	 * @return false if enabling fails. */
+	bool enable_group();
+
+	/** Stop counting the events of the group led by this counter.
+	 *
+	 * While disabled the group's enabled and running times don't advance.
+	 *
+	 * @return false if disabling fails. */
+	bool disable_group();
+
+	/** Get the values of all the counters of the group led by this counter with a single read.
+	 *
+	 * If the leader and all the members were opened with userspace access and
+	 * the kernel exposes it, each counter is read from its mmap'd page instead
+	 * (the enabled and running times need cap_user_time), without a syscall.
+	 *
+	 * @param[out] values Group values. The vector is reused, so no allocation happens on the sampling path.
+	 */
+	void get_group_values(PMUGroupValues &values) const;
+
 	/** Print counter config ID. */
 	std::string config_to_str(const perf_event_attr &perf_config);
 
+	/** Check whether the counter can currently be read from userspace.
+	 *
+	 * @return true if @ref get_value doesn't need a syscall on the calling thread.
+	 */
+	bool has_user_read() const;
+
   private:
-	perf_event_attr _perf_config;
-	long            _fd{-1};
+	void open(const perf_event_attr &perf_config, long group_fd);
+	bool read_user(uint64_t &value, uint64_t *time_enabled = nullptr, uint64_t *time_running = nullptr) const;
+	bool read_user_group(PMUGroupValues &values) const;
+
+	perf_event_attr               _perf_config;
+	pid_t                         _tid{0};
+	int                           _cpu{-1};
+	long                          _fd{-1};
+	bool                          _user_read_requested{false};
+	perf_event_mmap_page *        _user_page{nullptr};
+	pthread_t                     _user_thread{}; /**< Thread that opened the counter, the only one that can read it from userspace. */
+	size_t                        _group_size{0};
+	mutable std::vector<uint64_t> _group_buffer{};
+	std::vector<const PMU *>      _group_members{}; /**< Members of the group led by this counter, in the order they were opened. */
 };
 
 template <typename T>
 T PMU::get_value() const
 {
+	uint64_t user_value;
+	if (read_user(user_value))
+	{
+		return static_cast<T>(user_value);
+	}
+
 	T             value{};
 	const ssize_t result = read(_fd, &value, sizeof(T));
 
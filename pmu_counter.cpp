@@ -21,8 +21,242 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+
 #include "pmu_counter.h"
 
+#include "cpu_info.h"
+
+#include <algorithm>
+
+namespace
+{
+void add(PMUCounterValues &total, const PMUCounterValues &values)
+{
+	total.cycles += values.cycles;
+	total.instructions += values.instructions;
+	total.cache_references += values.cache_references;
+	total.cache_misses += values.cache_misses;
+	total.branch_instructions += values.branch_instructions;
+	total.branch_misses += values.branch_misses;
+
+	if (total.events.size() < values.events.size())
+	{
+		total.events.resize(values.events.size(), 0);
+	}
+	for (size_t i = 0; i < values.events.size(); ++i)
+	{
+		total.events[i] += values.events[i];
+	}
+}
+
+/** Reset the values, keeping the storage of the extra events */
+void clear(PMUCounterValues &values, size_t event_count)
+{
+	values.cycles              = 0;
+	values.instructions        = 0;
+	values.cache_references    = 0;
+	values.cache_misses        = 0;
+	values.branch_instructions = 0;
+	values.branch_misses       = 0;
+	values.events.assign(event_count, 0);
+}
+
+/** Scale factor of the counts of a group, if the kernel multiplexed it with other events */
+double group_scale(const PMUGroupValues &values, const PMUGroupValues &baseline)
+{
+	const uint64_t enabled = values.time_enabled - baseline.time_enabled;
+	const uint64_t running = values.time_running - baseline.time_running;
+
+	return running > 0 && running < enabled ? static_cast<double>(enabled) / running : 1.0;
+}
+}        // namespace
+
+PMUCounterValues operator-(const PMUCounterValues &a, const PMUCounterValues &b)
+{
+	PMUCounterValues result;
+	result.cycles              = a.cycles - b.cycles;
+	result.instructions        = a.instructions - b.instructions;
+	result.cache_references    = a.cache_references - b.cache_references;
+	result.cache_misses        = a.cache_misses - b.cache_misses;
+	result.branch_instructions = a.branch_instructions - b.branch_instructions;
+	result.branch_misses       = a.branch_misses - b.branch_misses;
+
+	result.events.resize(std::min(a.events.size(), b.events.size()));
+	for (size_t i = 0; i < result.events.size(); ++i)
+	{
+		result.events[i] = a.events[i] - b.events[i];
+	}
+	return result;
+}
+
+PMUCounter::PMUCounter() :
+    PMUCounter(PMUCounterMode::Process)
+{
+}
+
+PMUCounter::PMUCounter(PMUCounterMode mode) :
+    PMUCounter(mode, std::vector<PMUEvent>())
+{
+}
+
+PMUCounter::PMUCounter(PMUCounterMode mode, const std::vector<PMUEvent> &events) :
+    _mode(mode),
+    _events(events)
+{
+	switch (_mode)
+	{
+		case PMUCounterMode::Process:
+		{
+			std::unique_ptr<Target> target(new Target());
+			target->label = "Process";
+			target->open(0, -1, false, false, _events);
+			_targets.push_back(std::move(target));
+			break;
+		}
+		case PMUCounterMode::Thread:
+		{
+			std::unique_ptr<Target> target(new Target());
+			target->label = "Thread";
+			target->open(0, -1, true, true, _events);
+			_targets.push_back(std::move(target));
+			break;
+		}
+		case PMUCounterMode::PerThread:
+		{
+			const pid_t calling_tid = static_cast<pid_t>(syscall(__NR_gettid));
+			for (const auto &thread : get_threads())
+			{
+				std::unique_ptr<Target> target(new Target());
+				target->label = std::to_string(thread.tid) + " " + thread.name;
+				target->open(thread.tid, -1, true, thread.tid == calling_tid, _events);
+				_targets.push_back(std::move(target));
+			}
+			if (_targets.empty())
+			{
+				HWCPIPE_LOG("Failed to list the threads of the process.");
+			}
+			break;
+		}
+		case PMUCounterMode::PerCPU:
+			for (const auto &cpu : get_cpu_info())
+			{
+				std::unique_ptr<Target> target(new Target());
+				target->label   = "CPU " + std::to_string(cpu.id) + " (" + cpu.name + ")";
+				target->cluster = cpu.name;
+				target->open(-1, cpu.id, true, false, _events);
+				_targets.push_back(std::move(target));
+			}
+			break;
+	}
+}
+
+void PMUCounter::Target::open(pid_t tid, int cpu, bool attach, bool user_read, const std::vector<PMUEvent> &events)
+{
+	if (attach)
+	{
+		pmu_cycles.set_target(tid, cpu);
+		pmu_instructions.set_target(tid, cpu);
+		pmu_cache_references.set_target(tid, cpu);
+		pmu_cache_misses.set_target(tid, cpu);
+		pmu_branch_instructions.set_target(tid, cpu);
+		pmu_branch_misses.set_target(tid, cpu);
+	}
+
+	if (user_read)
+	{
+		pmu_cycles.request_user_read();
+		pmu_instructions.request_user_read();
+		pmu_cache_references.request_user_read();
+		pmu_cache_misses.request_user_read();
+		pmu_branch_instructions.request_user_read();
+		pmu_branch_misses.request_user_read();
+	}
+
+	pmu_cycles.open_leader(PERF_COUNT_HW_CPU_CYCLES);
+	pmu_instructions.open(PERF_COUNT_HW_INSTRUCTIONS, pmu_cycles);
+	pmu_cache_references.open(PERF_COUNT_HW_CACHE_REFERENCES, pmu_cycles);
+	pmu_cache_misses.open(PERF_COUNT_HW_CACHE_MISSES, pmu_cycles);
+	pmu_branch_instructions.open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS, pmu_cycles);
+	pmu_branch_misses.open(PERF_COUNT_HW_BRANCH_MISSES, pmu_cycles);
+
+	grouped = pmu_cycles.is_open() && pmu_instructions.is_open() && pmu_cache_references.is_open() &&
+	          pmu_cache_misses.is_open() && pmu_branch_instructions.is_open() && pmu_branch_misses.is_open();
+
+	if (!grouped)
+	{
+		HWCPIPE_LOG("Failed to open PMU event group, falling back to independent counters.");
+
+		pmu_branch_misses.close();
+		pmu_branch_instructions.close();
+		pmu_cache_misses.close();
+		pmu_cache_references.close();
+		pmu_instructions.close();
+		pmu_cycles.close();
+
+		pmu_cycles.open(PERF_COUNT_HW_CPU_CYCLES);
+		pmu_instructions.open(PERF_COUNT_HW_INSTRUCTIONS);
+		pmu_cache_references.open(PERF_COUNT_HW_CACHE_REFERENCES);
+		pmu_cache_misses.open(PERF_COUNT_HW_CACHE_MISSES);
+		pmu_branch_instructions.open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+		pmu_branch_misses.open(PERF_COUNT_HW_BRANCH_MISSES);
+	}
+
+	open_events(tid, cpu, attach, user_read, events);
+}
+
+void PMUCounter::Target::open_events(pid_t tid, int cpu, bool attach, bool user_read, const std::vector<PMUEvent> &events)
+{
+	if (events.empty())
+	{
+		return;
+	}
+
+	for (const auto &event : events)
+	{
+		std::unique_ptr<PMU> pmu(new PMU());
+		if (attach)
+		{
+			pmu->set_target(tid, cpu);
+		}
+		if (user_read)
+		{
+			pmu->request_user_read();
+		}
+		pmu->set_event_type(event.type);
+
+		if (pmu_events.empty())
+		{
+			pmu->open_leader(event.config);
+		}
+		else
+		{
+			pmu->open(event.config, *pmu_events.front());
+		}
+		pmu_events.push_back(std::move(pmu));
+	}
+
+	events_grouped = true;
+	for (const auto &pmu : pmu_events)
+	{
+		events_grouped = events_grouped && pmu->is_open();
+	}
+
+	if (!events_grouped)
+	{
+		HWCPIPE_LOG("Failed to open the group of extra PMU events, falling back to independent counters.");
+
+		for (auto it = pmu_events.rbegin(); it != pmu_events.rend(); ++it)
+		{
+			(*it)->close();
+		}
+
+		for (size_t i = 0; i < events.size(); ++i)
+		{
+			pmu_events[i]->open(events[i].config);
+		}
+	}
+}
+
 std::string PMUCounter::id() const
 {
 	return "PMU Counter";
@@ -30,83 +264,331 @@ std::string PMUCounter::id() const
 
 void PMUCounter::start()
 {
-	_pmu_cycles.reset();
-	_pmu_instructions.reset();
-	_pmu_cache_references.reset();
-	_pmu_cache_misses.reset();
-	_pmu_branch_instructions.reset();
-	_pmu_branch_misses.reset();
+	for (auto &target : _targets)
+	{
+		target->start();
+	}
 }
 
 void PMUCounter::stop()
+{
+	clear(_values, _events.size());
+
+	for (auto &target : _targets)
+	{
+		target->read(target->values, true);
+		add(_values, target->values);
+	}
+}
+
+void PMUCounter::sample(PMUCounterValues &values)
+{
+	clear(values, _events.size());
+
+	for (auto &target : _targets)
+	{
+		PMUCounterValues target_values;
+		target->read(target_values, false);
+		add(values, target_values);
+	}
+}
+
+void PMUCounter::Target::start()
+{
+	if (events_grouped)
+	{
+		try
+		{
+			pmu_events.front()->get_group_values(events_baseline);
+		}
+		catch (const std::runtime_error &)
+		{
+			events_baseline.values.clear();
+		}
+	}
+	else
+	{
+		for (auto &pmu : pmu_events)
+		{
+			pmu->reset();
+		}
+	}
+
+	if (grouped)
+	{
+		// Counts and times are measured from this baseline, resetting the group wouldn't reset its times
+		try
+		{
+			pmu_cycles.get_group_values(baseline);
+		}
+		catch (const std::runtime_error &)
+		{
+			baseline.values.clear();
+		}
+		return;
+	}
+
+	pmu_cycles.reset();
+	pmu_instructions.reset();
+	pmu_cache_references.reset();
+	pmu_cache_misses.reset();
+	pmu_branch_instructions.reset();
+	pmu_branch_misses.reset();
+}
+
+void PMUCounter::Target::read(PMUCounterValues &out, bool reset)
+{
+	if (grouped)
+	{
+		read_group(out, reset);
+	}
+	else
+	{
+		read_independent(out, reset);
+	}
+
+	read_events(out, reset);
+}
+
+void PMUCounter::Target::read_group(PMUCounterValues &out, bool reset)
 {
 	try
 	{
-		_cycles = _pmu_cycles.get_value<long long>();
-		_pmu_cycles.reset();
+		pmu_cycles.get_group_values(group_values);
 	}
 	catch (const std::runtime_error &)
 	{
-		_cycles = 0;
+		group_values.values.clear();
 	}
 
+	const bool   valid = group_values.values.size() == baseline.values.size();
+	const double scale = group_scale(group_values, baseline);
+
+	// Values are ordered as the counters were added to the group
+	const auto value = [&](size_t index) {
+		return valid && index < group_values.values.size() ? static_cast<long long>((group_values.values[index] - baseline.values[index]) * scale) : 0;
+	};
+
+	out.cycles              = value(0);
+	out.instructions        = value(1);
+	out.cache_references    = value(2);
+	out.cache_misses        = value(3);
+	out.branch_instructions = value(4);
+	out.branch_misses       = value(5);
+
+	if (reset && valid)
+	{
+		baseline.time_enabled = group_values.time_enabled;
+		baseline.time_running = group_values.time_running;
+		baseline.values.swap(group_values.values);
+	}
+}
+
+void PMUCounter::Target::read_independent(PMUCounterValues &out, bool reset)
+{
 	try
 	{
-		_instructions = _pmu_instructions.get_value<long long>();
-		_pmu_instructions.reset();
+		out.cycles = pmu_cycles.get_value<long long>();
+		if (reset)
+		{
+			pmu_cycles.reset();
+		}
 	}
 	catch (const std::runtime_error &)
 	{
-		_instructions = 0;
+		out.cycles = 0;
 	}
 
 	try
 	{
-		_cache_references = _pmu_cache_references.get_value<long long>();
-		_pmu_cache_references.reset();
+		out.instructions = pmu_instructions.get_value<long long>();
+		if (reset)
+		{
+			pmu_instructions.reset();
+		}
 	}
 	catch (const std::runtime_error &)
 	{
-		_cache_references = 0;
+		out.instructions = 0;
 	}
 
 	try
 	{
-		_cache_misses = _pmu_cache_misses.get_value<long long>();
-		_pmu_cache_misses.reset();
+		out.cache_references = pmu_cache_references.get_value<long long>();
+		if (reset)
+		{
+			pmu_cache_references.reset();
+		}
 	}
 	catch (const std::runtime_error &)
 	{
-		_cache_misses = 0;
+		out.cache_references = 0;
 	}
 
 	try
 	{
-		_branch_instructions = _pmu_branch_instructions.get_value<long long>();
-		_pmu_branch_instructions.reset();
+		out.cache_misses = pmu_cache_misses.get_value<long long>();
+		if (reset)
+		{
+			pmu_cache_misses.reset();
+		}
 	}
 	catch (const std::runtime_error &)
 	{
-		_branch_instructions = 0;
+		out.cache_misses = 0;
+	}
+
+	try
+	{
+		out.branch_instructions = pmu_branch_instructions.get_value<long long>();
+		if (reset)
+		{
+			pmu_branch_instructions.reset();
+		}
+	}
+	catch (const std::runtime_error &)
+	{
+		out.branch_instructions = 0;
+	}
+
+	try
+	{
+		out.branch_misses = pmu_branch_misses.get_value<long long>();
+		if (reset)
+		{
+			pmu_branch_misses.reset();
+		}
+	}
+	catch (const std::runtime_error &)
+	{
+		out.branch_misses = 0;
+	}
+}
+
+void PMUCounter::Target::read_events(PMUCounterValues &out, bool reset)
+{
+	out.events.resize(pmu_events.size());
+
+	if (!events_grouped)
+	{
+		for (size_t i = 0; i < pmu_events.size(); ++i)
+		{
+			try
+			{
+				out.events[i] = pmu_events[i]->get_value<long long>();
+				if (reset)
+				{
+					pmu_events[i]->reset();
+				}
+			}
+			catch (const std::runtime_error &)
+			{
+				out.events[i] = 0;
+			}
+		}
+		return;
 	}
 
 	try
 	{
-		_branch_misses = _pmu_branch_misses.get_value<long long>();
-		_pmu_branch_misses.reset();
+		pmu_events.front()->get_group_values(events_group_values);
 	}
 	catch (const std::runtime_error &)
 	{
-		_branch_misses = 0;
+		events_group_values.values.clear();
+	}
+
+	const bool   valid = events_group_values.values.size() == events_baseline.values.size();
+	const double scale = group_scale(events_group_values, events_baseline);
+
+	for (size_t i = 0; i < pmu_events.size(); ++i)
+	{
+		out.events[i] = valid && i < events_group_values.values.size() ?
+		                    static_cast<long long>((events_group_values.values[i] - events_baseline.values[i]) * scale) :
+		                    0;
+	}
+
+	if (reset && valid)
+	{
+		events_baseline.time_enabled = events_group_values.time_enabled;
+		events_baseline.time_running = events_group_values.time_running;
+		events_baseline.values.swap(events_group_values.values);
 	}
 }
 
 Instrument::MeasurementsMap PMUCounter::measurements() const
 {
-	return MeasurementsMap{
-	    {"CPU cycles", Measurement(_cycles, "cycles")},
-	    {"CPU instructions", Measurement(_instructions, "instructions")},
-	    {"Cache miss ratio", Measurement(static_cast<double>(_cache_misses) / _cache_references, "")},
-	    {"Branch miss ratio", Measurement(static_cast<double>(_branch_misses) / _branch_instructions, "")},
-	};
+	return to_measurements(_values);
+}
+
+PMUCounter::BreakdownMap PMUCounter::target_measurements() const
+{
+	BreakdownMap measurements;
+
+	for (const auto &target : _targets)
+	{
+		measurements[target->label] = to_measurements(target->values);
+	}
+
+	return measurements;
+}
+
+PMUCounter::BreakdownMap PMUCounter::cluster_measurements() const
+{
+	std::map<std::string, PMUCounterValues> clusters;
+
+	if (_mode == PMUCounterMode::PerCPU)
+	{
+		for (const auto &target : _targets)
+		{
+			add(clusters[target->cluster], target->values);
+		}
+	}
+
+	BreakdownMap measurements;
+
+	for (const auto &cluster : clusters)
+	{
+		measurements[cluster.first] = to_measurements(cluster.second);
+	}
+
+	return measurements;
+}
+
+void PMUCounter::snapshot(MeasurementsSnapshot &snapshot) const
+{
+	fill_snapshot(_values, snapshot);
+}
+
+void PMUCounter::fill_snapshot(const PMUCounterValues &values, MeasurementsSnapshot &snapshot) const
+{
+	if (!snapshot.check_layout(SNAPSHOT_SIZE + _events.size()))
+	{
+		snapshot.add("CPU cycles", "cycles", false);
+		snapshot.add("CPU instructions", "instructions", false);
+		snapshot.add("Cache miss ratio", "", true);
+		snapshot.add("Branch miss ratio", "", true);
+
+		for (const auto &event : _events)
+		{
+			snapshot.add(event.name, "events", false);
+		}
+	}
+
+	snapshot.set(SNAPSHOT_CYCLES, values.cycles);
+	snapshot.set(SNAPSHOT_INSTRUCTIONS, values.instructions);
+	snapshot.set(SNAPSHOT_CACHE_MISS_RATIO, static_cast<double>(values.cache_misses) / values.cache_references);
+	snapshot.set(SNAPSHOT_BRANCH_MISS_RATIO, static_cast<double>(values.branch_misses) / values.branch_instructions);
+
+	for (size_t i = 0; i < _events.size(); ++i)
+	{
+		snapshot.set(SNAPSHOT_SIZE + i, i < values.events.size() ? values.events[i] : 0);
+	}
+}
+
+Instrument::MeasurementsMap PMUCounter::to_measurements(const PMUCounterValues &values) const
+{
+	MeasurementsSnapshot snapshot;
+	fill_snapshot(values, snapshot);
+	return snapshot.to_map();
 }
@@ -22,34 +22,171 @@
  * SOFTWARE.
  */
 
+
 #pragma once
 
 #include "instrument.h"
 #include "pmu.h"
+#include "pmu_events.h"
+
+#include <memory>
+#include <vector>
+
+/** What the PMU counters of a @ref PMUCounter are attached to. */
+enum class PMUCounterMode
+{
+	Process,   /**< The calling thread and its children, on any CPU. */
+	Thread,    /**< The calling thread only, on any CPU, read from userspace when the kernel allows it. */
+	PerThread, /**< Each thread of the process, reported separately. */
+	PerCPU,    /**< Each online CPU, for all the processes, reported separately and per cluster. */
+};
+
+/** Values of the PMU counters of one thread or CPU. */
+struct PMUCounterValues
+{
+	long long cycles{0};
+	long long instructions{0};
+	long long cache_references{0};
+	long long cache_misses{0};
+	long long branch_instructions{0};
+	long long branch_misses{0};
+
+	std::vector<long long> events{}; /**< Extra events, in the order they were configured. */
+};
+
+/** Events between two reads of the counters, see @ref PMUCounter::sample.
+ *
+ * @param[in] a Later read.
+ * @param[in] b Earlier read.
+ *
+ * @return the events counted in between.
+ */
+PMUCounterValues operator-(const PMUCounterValues &a, const PMUCounterValues &b);
 
 /** Implementation of an instrument to count CPU cycles. */
 class PMUCounter : public Instrument
 {
   public:
-	/// @brief Construct a PMU counter.
-	PMUCounter(){};
+	/// @brief Construct a PMU counter for the calling thread and its children.
+	///
+	/// The counters are opened as a single event group led by the CPU cycles
+	/// counter, so they are read together. If the kernel multiplexes the group
+	/// with other events, the counts are scaled by its enabled/running times.
+	/// If the group can't be scheduled, the counters are opened independently
+	/// instead.
+	PMUCounter();
+
+	/// @brief Construct a PMU counter with the given attribution mode.
+	///
+	/// In Thread mode, and for the calling thread in PerThread mode, the
+	/// counters are read through their mmap'd pages without a syscall when the
+	/// kernel exposes userspace access and the reads happen on the calling
+	/// thread. Process mode always reads them with read(), as the pages don't
+	/// include the events of the children.
+	///
+	/// In PerThread mode the threads of the process are enumerated once, here:
+	/// threads created later aren't counted. PerCPU mode counts every process
+	/// and usually needs perf_event_paranoid to be 0 or lower; CPUs whose
+	/// counters can't be opened report zeros.
+	///
+	/// @param[in] mode What the counters are attached to.
+	explicit PMUCounter(PMUCounterMode mode);
+
+	/// @brief Construct a PMU counter counting extra events.
+	///
+	/// The extra events, e.g. Armv8 memory hierarchy events found with
+	/// @ref find_pmu_event, are opened as a second event group next to the
+	/// default counters and reported under their own names. The PMU usually
+	/// can't count both groups at once, so the kernel multiplexes them and
+	/// the counts are scaled to the whole measurement.
+	///
+	/// @param[in] mode   What the counters are attached to.
+	/// @param[in] events Extra events to count.
+	PMUCounter(PMUCounterMode mode, const std::vector<PMUEvent> &events);
 
 	std::string     id() const override;
 	void            start() override;
 	void            stop() override;
 	MeasurementsMap measurements() const override;
+	void            snapshot(MeasurementsSnapshot &snapshot) const override;
+
+	/** Read the counters since the last @ref start without resetting them.
+	 *
+	 * Reading the counters at two points and subtracting the values gives the
+	 * events in between, so nested regions can be measured without
+	 * restarting the counters.
+	 *
+	 * @param[out] values Counter values, summed over all the threads or CPUs.
+	 */
+	void sample(PMUCounterValues &values);
+
+	/** Map of measurements of each thread, CPU or cluster */
+	using BreakdownMap = std::map<std::string, MeasurementsMap>;
+
+	/** Return the latest measurements of each thread or CPU.
+	 *
+	 * Threads are keyed by "<tid> <name>" and CPUs by "CPU <n> (<core name>)".
+	 * In Process mode the only entry holds the same values as @ref measurements.
+	 *
+	 * @return the latest measurements of each target.
+	 */
+	BreakdownMap target_measurements() const;
+
+	/** Return the latest measurements of each CPU cluster.
+	 *
+	 * Only available in PerCPU mode. Clusters are keyed by core name, so the
+	 * big and LITTLE cores of a big.LITTLE system are reported apart.
+	 *
+	 * @return the latest measurements of each cluster.
+	 */
+	BreakdownMap cluster_measurements() const;
 
   private:
-	PMU       _pmu_cycles{PERF_COUNT_HW_CPU_CYCLES};
-	PMU       _pmu_instructions{PERF_COUNT_HW_INSTRUCTIONS};
-	PMU       _pmu_cache_references{PERF_COUNT_HW_CACHE_REFERENCES};
-	PMU       _pmu_cache_misses{PERF_COUNT_HW_CACHE_MISSES};
-	PMU       _pmu_branch_instructions{PERF_COUNT_HW_BRANCH_INSTRUCTIONS};
-	PMU       _pmu_branch_misses{PERF_COUNT_HW_BRANCH_MISSES};
-	long long _cycles{0};
-	long long _instructions{0};
-	long long _cache_references{0};
-	long long _cache_misses{0};
-	long long _branch_instructions{0};
-	long long _branch_misses{0};
+	/** Counters of one thread or CPU */
+	struct Target
+	{
+		void open(pid_t tid, int cpu, bool attach, bool user_read, const std::vector<PMUEvent> &events);
+		void open_events(pid_t tid, int cpu, bool attach, bool user_read, const std::vector<PMUEvent> &events);
+		void start();
+		void read(PMUCounterValues &out, bool reset);
+		void read_group(PMUCounterValues &out, bool reset);
+		void read_independent(PMUCounterValues &out, bool reset);
+		void read_events(PMUCounterValues &out, bool reset);
+
+		std::string      label{};
+		std::string      cluster{};
+		PMU              pmu_cycles{};
+		PMU              pmu_instructions{};
+		PMU              pmu_cache_references{};
+		PMU              pmu_cache_misses{};
+		PMU              pmu_branch_instructions{};
+		PMU              pmu_branch_misses{};
+		bool             grouped{false};
+		PMUGroupValues   group_values{};
+		PMUGroupValues   baseline{}; /**< Group values at the last start or reset. */
+		PMUCounterValues values{};
+
+		std::vector<std::unique_ptr<PMU>> pmu_events{}; /**< Extra events, the first one leads their group. */
+		bool                              events_grouped{false};
+		PMUGroupValues                    events_group_values{};
+		PMUGroupValues                    events_baseline{};
+	};
+
+	/** Layout of the measurement snapshots */
+	enum SnapshotId : MeasurementsSnapshot::Id
+	{
+		SNAPSHOT_CYCLES,
+		SNAPSHOT_INSTRUCTIONS,
+		SNAPSHOT_CACHE_MISS_RATIO,
+		SNAPSHOT_BRANCH_MISS_RATIO,
+		SNAPSHOT_SIZE
+	};
+
+	void            fill_snapshot(const PMUCounterValues &values, MeasurementsSnapshot &snapshot) const;
+	MeasurementsMap to_measurements(const PMUCounterValues &values) const;
+
+	PMUCounterMode                       _mode;
+	std::vector<PMUEvent>                _events{};
+	std::vector<std::unique_ptr<Target>> _targets{};
+	PMUCounterValues                     _values{};
 };
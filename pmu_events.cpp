@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "pmu_events.h"
+
+#include "cpu_info.h"
+
+namespace
+{
+constexpr uint32_t implementer_arm = 0x41;
+
+/** Which cores implement an event */
+enum PMUEventAvailability
+{
+	PMU_EVENT_ARCHITECTURAL, /**< Common event of the Armv8.0 PMU, implemented by every core. */
+	PMU_EVENT_PMUV3P1,       /**< Common event added or made common by the Armv8.1 PMU, implemented by the Armv8.2 cores only. */
+	PMU_EVENT_RECOMMENDED,   /**< Recommended implementation defined event, implemented by the big cores and the Cortex-A55 family. */
+	PMU_EVENT_CORTEX_A53,    /**< Implementation defined event of the Cortex-A53 and Cortex-A35. */
+};
+
+struct PMURawEvent
+{
+	uint16_t             number;
+	const char *         name;
+	PMUEventAvailability availability;
+};
+
+const PMURawEvent raw_events[] = {
+    {0x00, "SW_INCR", PMU_EVENT_ARCHITECTURAL},
+    {0x01, "L1I_CACHE_REFILL", PMU_EVENT_ARCHITECTURAL},
+    {0x02, "L1I_TLB_REFILL", PMU_EVENT_ARCHITECTURAL},
+    {0x03, "L1D_CACHE_REFILL", PMU_EVENT_ARCHITECTURAL},
+    {0x04, "L1D_CACHE", PMU_EVENT_ARCHITECTURAL},
+    {0x05, "L1D_TLB_REFILL", PMU_EVENT_ARCHITECTURAL},
+    {0x06, "LD_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x07, "ST_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x08, "INST_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x09, "EXC_TAKEN", PMU_EVENT_ARCHITECTURAL},
+    {0x0A, "EXC_RETURN", PMU_EVENT_ARCHITECTURAL},
+    {0x0B, "CID_WRITE_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x0C, "PC_WRITE_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x0D, "BR_IMMED_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x0E, "BR_RETURN_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x0F, "UNALIGNED_LDST_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x10, "BR_MIS_PRED", PMU_EVENT_ARCHITECTURAL},
+    {0x11, "CPU_CYCLES", PMU_EVENT_ARCHITECTURAL},
+    {0x12, "BR_PRED", PMU_EVENT_ARCHITECTURAL},
+    {0x13, "MEM_ACCESS", PMU_EVENT_ARCHITECTURAL},
+    {0x14, "L1I_CACHE", PMU_EVENT_ARCHITECTURAL},
+    {0x15, "L1D_CACHE_WB", PMU_EVENT_ARCHITECTURAL},
+    {0x16, "L2D_CACHE", PMU_EVENT_ARCHITECTURAL},
+    {0x17, "L2D_CACHE_REFILL", PMU_EVENT_ARCHITECTURAL},
+    {0x18, "L2D_CACHE_WB", PMU_EVENT_ARCHITECTURAL},
+    {0x19, "BUS_ACCESS", PMU_EVENT_ARCHITECTURAL},
+    {0x1A, "MEMORY_ERROR", PMU_EVENT_ARCHITECTURAL},
+    {0x1B, "INST_SPEC", PMU_EVENT_ARCHITECTURAL},
+    {0x1C, "TTBR_WRITE_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x1D, "BUS_CYCLES", PMU_EVENT_ARCHITECTURAL},
+    {0x1F, "L1D_CACHE_ALLOCATE", PMU_EVENT_ARCHITECTURAL},
+    {0x20, "L2D_CACHE_ALLOCATE", PMU_EVENT_ARCHITECTURAL},
+    {0x21, "BR_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x22, "BR_MIS_PRED_RETIRED", PMU_EVENT_ARCHITECTURAL},
+    {0x23, "STALL_FRONTEND", PMU_EVENT_PMUV3P1},
+    {0x24, "STALL_BACKEND", PMU_EVENT_PMUV3P1},
+    {0x25, "L1D_TLB", PMU_EVENT_PMUV3P1},
+    {0x26, "L1I_TLB", PMU_EVENT_PMUV3P1},
+    {0x29, "L3D_CACHE_ALLOCATE", PMU_EVENT_PMUV3P1},
+    {0x2A, "L3D_CACHE_REFILL", PMU_EVENT_PMUV3P1},
+    {0x2B, "L3D_CACHE", PMU_EVENT_PMUV3P1},
+    {0x2D, "L2D_TLB_REFILL", PMU_EVENT_PMUV3P1},
+    {0x2F, "L2D_TLB", PMU_EVENT_PMUV3P1},
+    {0x34, "DTLB_WALK", PMU_EVENT_PMUV3P1},
+    {0x35, "ITLB_WALK", PMU_EVENT_PMUV3P1},
+    {0x36, "LL_CACHE_RD", PMU_EVENT_PMUV3P1},
+    {0x37, "LL_CACHE_MISS_RD", PMU_EVENT_PMUV3P1},
+
+    {0x40, "L1D_CACHE_RD", PMU_EVENT_RECOMMENDED},
+    {0x41, "L1D_CACHE_WR", PMU_EVENT_RECOMMENDED},
+    {0x42, "L1D_CACHE_REFILL_RD", PMU_EVENT_RECOMMENDED},
+    {0x43, "L1D_CACHE_REFILL_WR", PMU_EVENT_RECOMMENDED},
+    {0x4C, "L1D_TLB_REFILL_RD", PMU_EVENT_RECOMMENDED},
+    {0x4D, "L1D_TLB_REFILL_WR", PMU_EVENT_RECOMMENDED},
+    {0x50, "L2D_CACHE_RD", PMU_EVENT_RECOMMENDED},
+    {0x51, "L2D_CACHE_WR", PMU_EVENT_RECOMMENDED},
+    {0x52, "L2D_CACHE_REFILL_RD", PMU_EVENT_RECOMMENDED},
+    {0x53, "L2D_CACHE_REFILL_WR", PMU_EVENT_RECOMMENDED},
+    {0x60, "BUS_ACCESS_RD", PMU_EVENT_RECOMMENDED},
+    {0x61, "BUS_ACCESS_WR", PMU_EVENT_RECOMMENDED},
+    {0x70, "LD_SPEC", PMU_EVENT_RECOMMENDED},
+    {0x71, "ST_SPEC", PMU_EVENT_RECOMMENDED},
+    {0x73, "DP_SPEC", PMU_EVENT_RECOMMENDED},
+    {0x74, "ASE_SPEC", PMU_EVENT_RECOMMENDED},
+    {0x75, "VFP_SPEC", PMU_EVENT_RECOMMENDED},
+
+    {0xC0, "EXT_MEM_REQ", PMU_EVENT_CORTEX_A53},
+    {0xC1, "EXT_MEM_REQ_NC", PMU_EVENT_CORTEX_A53},
+    {0xC2, "PREFETCH_LINEFILL", PMU_EVENT_CORTEX_A53},
+    {0xC3, "PREFETCH_LINEFILL_DROP", PMU_EVENT_CORTEX_A53},
+};
+
+/** Cores implementing the common events of the Armv8.1 PMU
+ *
+ * The Cortex-A53, A57, A72 and A73 only implement the Armv8.0 common events.
+ */
+const uint32_t pmuv3p1_event_parts[] = {
+    0xd05, /* Cortex-A55 */
+    0xd06, /* Cortex-A65 */
+    0xd0a, /* Cortex-A75 */
+    0xd0b, /* Cortex-A76 */
+    0xd0c, /* Neoverse-N1 */
+    0xd0d, /* Cortex-A77 */
+    0xd0e, /* Cortex-A76AE */
+    0xd41, /* Cortex-A78 */
+    0xd44, /* Cortex-X1 */
+    0xd46, /* Cortex-A510 */
+    0xd47, /* Cortex-A710 */
+    0xd48, /* Cortex-X2 */
+};
+
+/** Cores implementing the recommended implementation defined events */
+const uint32_t recommended_event_parts[] = {
+    0xd05, /* Cortex-A55 */
+    0xd07, /* Cortex-A57 */
+    0xd08, /* Cortex-A72 */
+    0xd09, /* Cortex-A73 */
+    0xd0a, /* Cortex-A75 */
+    0xd0b, /* Cortex-A76 */
+    0xd0d, /* Cortex-A77 */
+    0xd41, /* Cortex-A78 */
+    0xd44, /* Cortex-X1 */
+    0xd46, /* Cortex-A510 */
+    0xd47, /* Cortex-A710 */
+    0xd48, /* Cortex-X2 */
+};
+
+template <size_t N>
+bool is_arm_part(const uint32_t (&parts)[N], uint32_t implementer, uint32_t part)
+{
+	if (implementer != implementer_arm)
+	{
+		return false;
+	}
+	for (const uint32_t listed_part : parts)
+	{
+		if (listed_part == part)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool is_available(PMUEventAvailability availability, uint32_t implementer, uint32_t part)
+{
+	switch (availability)
+	{
+		case PMU_EVENT_ARCHITECTURAL:
+			return true;
+		case PMU_EVENT_PMUV3P1:
+			return is_arm_part(pmuv3p1_event_parts, implementer, part);
+		case PMU_EVENT_RECOMMENDED:
+			return is_arm_part(recommended_event_parts, implementer, part);
+		case PMU_EVENT_CORTEX_A53:
+			return implementer == implementer_arm && (part == 0xd03 || part == 0xd04);
+	}
+	return false;
+}
+
+const char *const hw_cache_names[] = {"L1D", "L1I", "LL", "DTLB", "ITLB", "BPU", "NODE"};
+const char *const hw_cache_op_names[]     = {"READ", "WRITE", "PREFETCH"};
+const char *const hw_cache_result_names[] = {"ACCESS", "MISS"};
+
+template <typename T, size_t N>
+constexpr size_t array_size(const T (&)[N])
+{
+	return N;
+}
+}        // namespace
+
+bool find_pmu_event(const std::string &name, uint32_t implementer, uint32_t part, PMUEvent &event)
+{
+	for (const auto &raw_event : raw_events)
+	{
+		if (name == raw_event.name && is_available(raw_event.availability, implementer, part))
+		{
+			event.name   = name;
+			event.type   = PERF_TYPE_RAW;
+			event.config = raw_event.number;
+			return true;
+		}
+	}
+
+	for (size_t cache = 0; cache < array_size(hw_cache_names); ++cache)
+	{
+		for (size_t op = 0; op < array_size(hw_cache_op_names); ++op)
+		{
+			for (size_t result = 0; result < array_size(hw_cache_result_names); ++result)
+			{
+				const uint64_t config = pmu_hw_cache_config(cache, op, result);
+				if (name == pmu_hw_cache_event_name(config))
+				{
+					event.name   = name;
+					event.type   = PERF_TYPE_HW_CACHE;
+					event.config = config;
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+bool find_pmu_event(const std::string &name, PMUEvent &event)
+{
+	const std::vector<CPUInfo> cpus = get_cpu_info();
+
+	if (cpus.empty())
+	{
+		return find_pmu_event(name, 0, 0, event);
+	}
+
+	return find_pmu_event(name, cpus.front().implementer, cpus.front().part, event);
+}
+
+std::vector<std::string> pmu_event_names(uint32_t implementer, uint32_t part)
+{
+	std::vector<std::string> names;
+
+	for (const auto &raw_event : raw_events)
+	{
+		if (is_available(raw_event.availability, implementer, part))
+		{
+			names.push_back(raw_event.name);
+		}
+	}
+
+	for (size_t cache = 0; cache < array_size(hw_cache_names); ++cache)
+	{
+		for (size_t op = 0; op < array_size(hw_cache_op_names); ++op)
+		{
+			for (size_t result = 0; result < array_size(hw_cache_result_names); ++result)
+			{
+				names.push_back(pmu_hw_cache_event_name(pmu_hw_cache_config(cache, op, result)));
+			}
+		}
+	}
+
+	return names;
+}
+
+const char *pmu_raw_event_name(uint64_t config)
+{
+	for (const auto &raw_event : raw_events)
+	{
+		if (raw_event.number == config)
+		{
+			return raw_event.name;
+		}
+	}
+
+	return nullptr;
+}
+
+std::string pmu_hw_cache_event_name(uint64_t config)
+{
+	const uint64_t cache  = config & 0xff;
+	const uint64_t op     = (config >> 8) & 0xff;
+	const uint64_t result = (config >> 16) & 0xff;
+
+	if (cache >= array_size(hw_cache_names) || op >= array_size(hw_cache_op_names) || result >= array_size(hw_cache_result_names))
+	{
+		return "UNKNOWN CACHE EVENT";
+	}
+
+	return std::string(hw_cache_names[cache]) + "_" + hw_cache_op_names[op] + "_" + hw_cache_result_names[result];
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <linux/perf_event.h>
+#include <string>
+#include <vector>
+
+/** Event counted by the PMU. */
+struct PMUEvent
+{
+	std::string name{};                   /**< Name of the event in the measurements. */
+	uint64_t    config{0};                /**< Event identifier, as passed to perf_event_open. */
+	uint32_t    type{PERF_TYPE_HARDWARE}; /**< Event type, e.g. PERF_TYPE_RAW for Armv8 event numbers. */
+};
+
+/** Build the config of a PERF_TYPE_HW_CACHE event.
+ *
+ * @param[in] cache  Cache, e.g. PERF_COUNT_HW_CACHE_L1D.
+ * @param[in] op     Operation, e.g. PERF_COUNT_HW_CACHE_OP_READ.
+ * @param[in] result Result, e.g. PERF_COUNT_HW_CACHE_RESULT_MISS.
+ *
+ * @return the event config.
+ */
+constexpr uint64_t pmu_hw_cache_config(uint64_t cache, uint64_t op, uint64_t result)
+{
+	return cache | (op << 8) | (result << 16);
+}
+
+/** Find an event by name.
+ *
+ * Names are the Armv8 PMU event mnemonics, e.g. "L1D_CACHE_REFILL" or
+ * "STALL_BACKEND", counted as PERF_TYPE_RAW events, or generic cache events
+ * such as "L1D_READ_MISS", counted as PERF_TYPE_HW_CACHE events. Events that
+ * are only implemented by some cores are only found for these cores.
+ *
+ * @param[in]  name        Event name.
+ * @param[in]  implementer MIDR implementer of the core the event is counted on, see @ref CPUInfo.
+ * @param[in]  part        MIDR part number of the core the event is counted on.
+ * @param[out] event       Event, named @p name.
+ *
+ * @return true if the event is known for this core.
+ */
+bool find_pmu_event(const std::string &name, uint32_t implementer, uint32_t part, PMUEvent &event);
+
+/** Find an event by name, for the first online core.
+ *
+ * @param[in]  name  Event name.
+ * @param[out] event Event, named @p name.
+ *
+ * @return true if the event is known for this core.
+ */
+bool find_pmu_event(const std::string &name, PMUEvent &event);
+
+/** Get the names of the events a core implements.
+ *
+ * @param[in] implementer MIDR implementer of the core.
+ * @param[in] part        MIDR part number of the core.
+ *
+ * @return the event names, raw events first.
+ */
+std::vector<std::string> pmu_event_names(uint32_t implementer, uint32_t part);
+
+/** Get the name of a raw event.
+ *
+ * @param[in] config Event number.
+ *
+ * @return the Armv8 mnemonic of the event, or nullptr if it isn't known.
+ */
+const char *pmu_raw_event_name(uint64_t config);
+
+/** Get the name of a PERF_TYPE_HW_CACHE event.
+ *
+ * @param[in] config Event config, see @ref pmu_hw_cache_config.
+ *
+ * @return the name of the event, e.g. "L1D_READ_MISS".
+ */
+std::string pmu_hw_cache_event_name(uint64_t config);
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "pmu_multiplexer.h"
+
+#include <algorithm>
+
+PMUMultiplexer::PMUMultiplexer(const std::vector<PMUEvent> &events, size_t group_size) :
+    _events(events),
+    _counts(events.size(), 0),
+    _time(events.size(), 0),
+    _values(events.size())
+{
+	group_size = std::max<size_t>(group_size, 1);
+
+	for (size_t first = 0; first < _events.size(); first += group_size)
+	{
+		Group group;
+
+		for (size_t event = first; event < std::min(first + group_size, _events.size()); ++event)
+		{
+			std::unique_ptr<PMU> pmu(new PMU());
+			pmu->set_event_type(_events[event].type);
+
+			if (group.pmus.empty())
+			{
+				pmu->open_leader(_events[event].config);
+			}
+			else
+			{
+				pmu->open(_events[event].config, *group.pmus.front());
+			}
+
+			group.pmus.push_back(std::move(pmu));
+			group.events.push_back(event);
+		}
+
+		group.open = std::all_of(group.pmus.begin(), group.pmus.end(), [](const std::unique_ptr<PMU> &pmu) {
+			return pmu->is_open();
+		});
+
+		if (!group.open)
+		{
+			HWCPIPE_LOG("Failed to open PMU event group %zu, its events won't be counted.", _groups.size());
+		}
+		else
+		{
+			// Groups only count while they are the active one
+			group.pmus.front()->disable_group();
+
+			// Only the groups that opened take a window, so the windows add up to the measurement
+			_rotation.push_back(_groups.size());
+		}
+
+		_groups.push_back(std::move(group));
+	}
+}
+
+std::string PMUMultiplexer::id() const
+{
+	return "PMU Multiplexer";
+}
+
+void PMUMultiplexer::start()
+{
+	std::fill(_counts.begin(), _counts.end(), 0);
+	std::fill(_time.begin(), _time.end(), 0);
+	_total_time = 0;
+	_active     = 0;
+	_running    = true;
+
+	if (!_rotation.empty())
+	{
+		enable(_groups[_rotation[_active]]);
+	}
+}
+
+void PMUMultiplexer::enable(Group &group)
+{
+	if (!group.open)
+	{
+		return;
+	}
+
+	group.pmus.front()->enable_group();
+
+	try
+	{
+		group.pmus.front()->get_group_values(group.baseline);
+	}
+	catch (const std::runtime_error &)
+	{
+		// Without a baseline the window is skipped
+		group.baseline.values.clear();
+	}
+}
+
+void PMUMultiplexer::rotate()
+{
+	if (!_running || _rotation.empty())
+	{
+		return;
+	}
+
+	accumulate(_groups[_rotation[_active]]);
+
+	_active = (_active + 1) % _rotation.size();
+
+	enable(_groups[_rotation[_active]]);
+}
+
+void PMUMultiplexer::stop()
+{
+	if (!_running || _rotation.empty())
+	{
+		return;
+	}
+
+	accumulate(_groups[_rotation[_active]]);
+	_running = false;
+
+	for (size_t event = 0; event < _events.size(); ++event)
+	{
+		PMUMultiplexedValue &value = _values[event];
+
+		value.raw        = _counts[event];
+		value.value      = _time[event] > 0 ? static_cast<double>(_counts[event]) * _total_time / _time[event] : 0.0;
+		value.confidence = _total_time > 0 ? std::min(static_cast<double>(_time[event]) / _total_time, 1.0) : 0.0;
+	}
+}
+
+void PMUMultiplexer::accumulate(Group &group)
+{
+	if (!group.open)
+	{
+		return;
+	}
+
+	try
+	{
+		group.pmus.front()->get_group_values(group.current);
+	}
+	catch (const std::runtime_error &)
+	{
+		group.pmus.front()->disable_group();
+		return;
+	}
+
+	group.pmus.front()->disable_group();
+
+	if (group.baseline.values.empty() || group.current.values.size() != group.baseline.values.size())
+	{
+		return;
+	}
+
+	// No other group is enabled meanwhile, so the enabled times of the groups add up to the measurement
+	_total_time += group.current.time_enabled - group.baseline.time_enabled;
+	const uint64_t running = group.current.time_running - group.baseline.time_running;
+
+	for (size_t i = 0; i < group.current.values.size() && i < group.events.size(); ++i)
+	{
+		_counts[group.events[i]] += group.current.values[i] - group.baseline.values[i];
+		_time[group.events[i]] += running;
+	}
+}
+
+size_t PMUMultiplexer::group_count() const
+{
+	return _rotation.size();
+}
+
+const std::vector<PMUMultiplexedValue> &PMUMultiplexer::values() const
+{
+	return _values;
+}
+
+void PMUMultiplexer::snapshot(MeasurementsSnapshot &snapshot) const
+{
+	if (!snapshot.check_layout(2 * _events.size()))
+	{
+		for (const auto &event : _events)
+		{
+			snapshot.add(event.name, "events", false);
+			snapshot.add(event.name + " confidence", "", true);
+		}
+	}
+
+	for (size_t event = 0; event < _events.size(); ++event)
+	{
+		snapshot.set(2 * event, static_cast<long long>(_values[event].value));
+		snapshot.set(2 * event + 1, _values[event].confidence);
+	}
+}
+
+Instrument::MeasurementsMap PMUMultiplexer::measurements() const
+{
+	MeasurementsSnapshot snapshot;
+	this->snapshot(snapshot);
+	return snapshot.to_map();
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "instrument.h"
+#include "pmu.h"
+#include "pmu_events.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/** Estimated count of a multiplexed event. */
+struct PMUMultiplexedValue
+{
+	double   value{0.0};      /**< Count scaled to the whole measurement. */
+	uint64_t raw{0};          /**< Events actually counted. */
+	double   confidence{0.0}; /**< Fraction of the measurement the event was counted for, between 0 and 1. */
+};
+
+/** Count more events than the PMU has counters by rotating groups of events.
+ *
+ * The events are split into groups that fit the hardware counters. Only one
+ * group counts at a time, and @ref rotate switches to the next one, so the
+ * caller decides the sampling windows, e.g. one frame per group. On stop,
+ * the counts of each event are scaled by the total time over the time its
+ * group was actually running, which also corrects for any multiplexing done
+ * by the kernel within a window.
+ *
+ * The confidence of a value is the fraction of the measurement it was
+ * counted for. Short measurements, or workloads that vary from one window to
+ * the next, extrapolate from little data and should be read with that in mind.
+ */
+class PMUMultiplexer : public Instrument
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] events     Events to count.
+	 * @param[in] group_size Maximum number of events counted together, at most the number of programmable counters.
+	 */
+	explicit PMUMultiplexer(const std::vector<PMUEvent> &events, size_t group_size = 6);
+
+	std::string     id() const override;
+	void            start() override;
+	void            stop() override;
+	MeasurementsMap measurements() const override;
+	void            snapshot(MeasurementsSnapshot &snapshot) const override;
+
+	/** Switch to the next group of events.
+	 *
+	 * Call it at the end of every sampling window, between @ref start and @ref stop.
+	 */
+	void rotate();
+
+	/** Number of groups the events are rotated through.
+	 *
+	 * Groups that failed to open are left out of the rotation, and their
+	 * events read 0 with a confidence of 0.
+	 *
+	 * @return the number of groups that opened.
+	 */
+	size_t group_count() const;
+
+	/** Get the latest values of the events.
+	 *
+	 * @return the values, in the order of the events passed to the constructor.
+	 */
+	const std::vector<PMUMultiplexedValue> &values() const;
+
+  private:
+	/** Events counted together */
+	struct Group
+	{
+		std::vector<std::unique_ptr<PMU>> pmus{};
+		std::vector<size_t>               events{};   /**< Index of the event of each counter. */
+		PMUGroupValues                    baseline{}; /**< Group values when the group was last enabled. */
+		PMUGroupValues                    current{};
+		bool                              open{false};
+	};
+
+	void enable(Group &group);
+	void accumulate(Group &group);
+
+	std::vector<PMUEvent>            _events;
+	std::vector<Group>               _groups{};
+	std::vector<size_t>              _rotation{}; /**< Groups that opened, in rotation order. */
+	size_t                           _active{0};  /**< Position of the counting group in @ref _rotation. */
+	bool                             _running{false};
+	std::vector<uint64_t>            _counts{};  /**< Events counted since start. */
+	std::vector<uint64_t>            _time{};    /**< Time each event was actually counted since start, in ns. */
+	uint64_t                         _total_time{0}; /**< Time all the groups were enabled since start, in ns. */
+	std::vector<PMUMultiplexedValue> _values{};
+};
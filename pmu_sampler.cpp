@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "pmu_sampler.h"
+
+#include "cpu_info.h"
+
+#include <algorithm>
+#include <asm/unistd.h>
+#include <cstring>
+#include <dlfcn.h>
+#include <link.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+namespace
+{
+constexpr int      poll_timeout_ms = 100;
+constexpr size_t   max_record_size = 1 << 16;
+constexpr size_t   max_callchain   = 128;
+constexpr uint64_t default_period  = 1000000;
+
+size_t round_up_power_of_two(size_t value)
+{
+	size_t result = 1;
+	while (result < value)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+template <typename T>
+const uint8_t *read_field(const uint8_t *p, const uint8_t *end, T &value)
+{
+	if (p == nullptr || end - p < static_cast<ptrdiff_t>(sizeof(T)))
+	{
+		return nullptr;
+	}
+	memcpy(&value, p, sizeof(T));
+	return p + sizeof(T);
+}
+
+/** Name the code at an address, as "symbol", or "object+0xoffset" for unexported code */
+std::string symbol_name(uint64_t address)
+{
+	Dl_info info;
+	bool    in_symbol;
+
+#if defined(__GLIBC__)
+	// dladdr returns the nearest exported symbol below the address, check the address is within it
+	void *entry = nullptr;
+	if (dladdr1(reinterpret_cast<void *>(address), &info, &entry, RTLD_DL_SYMENT) == 0)
+	{
+		return std::string();
+	}
+	const ElfW(Sym) *symbol = static_cast<const ElfW(Sym) *>(entry);
+	in_symbol = info.dli_sname != nullptr && symbol != nullptr &&
+	            (symbol->st_size == 0 || address - reinterpret_cast<uint64_t>(info.dli_saddr) < symbol->st_size);
+#else
+	// Without the symbol size, code of a static or hidden function is credited to the exported symbol below it
+	if (dladdr(reinterpret_cast<void *>(address), &info) == 0)
+	{
+		return std::string();
+	}
+	in_symbol = info.dli_sname != nullptr;
+#endif
+
+	if (in_symbol)
+	{
+		return info.dli_sname;
+	}
+
+	if (info.dli_fname != nullptr)
+	{
+		char offset[32];
+		snprintf(offset, sizeof(offset), "+0x%llx",
+		         static_cast<unsigned long long>(address - reinterpret_cast<uint64_t>(info.dli_fbase)));
+		return std::string(info.dli_fname) + offset;
+	}
+
+	return std::string();
+}
+}        // namespace
+
+PMUSampler::PMUSampler(const PMUSamplerConfig &config, PMUCounterMode mode) :
+    _config(config)
+{
+	_config.ring_pages = round_up_power_of_two(std::max<size_t>(_config.ring_pages, 1));
+	_mapping_size      = (1 + _config.ring_pages) * sysconf(_SC_PAGESIZE);
+	_wrapped_record.reserve(max_record_size);
+	_callchain.reserve(max_callchain + 1);
+
+	switch (mode)
+	{
+		case PMUCounterMode::Process:
+		case PMUCounterMode::Thread:
+			open(0, -1);
+			break;
+		case PMUCounterMode::PerThread:
+			for (const auto &thread : get_threads())
+			{
+				open(thread.tid, -1);
+			}
+			break;
+		case PMUCounterMode::PerCPU:
+			for (const auto &cpu : get_cpu_info())
+			{
+				open(-1, cpu.id);
+			}
+			break;
+	}
+}
+
+PMUSampler::~PMUSampler()
+{
+	stop();
+	close();
+}
+
+void PMUSampler::open(pid_t tid, int cpu)
+{
+	const long page_size = sysconf(_SC_PAGESIZE);
+
+	perf_event_attr attr{};
+	attr.size   = sizeof(perf_event_attr);
+	attr.type   = _config.type;
+	attr.config = _config.config;
+
+	if (_config.frequency > 0)
+	{
+		attr.freq        = 1;
+		attr.sample_freq = _config.frequency;
+	}
+	else
+	{
+		attr.sample_period = _config.period > 0 ? _config.period : default_period;
+	}
+
+	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID;
+	if (_config.callchain)
+	{
+		attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+		attr.exclude_callchain_kernel = 1;
+	}
+
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+	// Wake the reader up when a quarter of the ring is used, it also polls periodically
+	attr.watermark        = 1;
+	attr.wakeup_watermark = static_cast<uint32_t>(_config.ring_pages * page_size / 4);
+
+	Target target;
+	target.fd = syscall(__NR_perf_event_open, &attr, tid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+	if (target.fd < 0)
+	{
+		HWCPIPE_LOG("perf_event_open failed for sampling: %s", std::to_string(errno).c_str());
+		return;
+	}
+
+	// Mapping the ring writable lets the reader move data_tail, otherwise the kernel overwrites unread samples
+	void *mapping = mmap(nullptr, _mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, target.fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		HWCPIPE_LOG("Failed to map PMU sample ring buffer: %s", std::to_string(errno).c_str());
+		::close(target.fd);
+		return;
+	}
+
+	target.page = static_cast<perf_event_mmap_page *>(mapping);
+
+	// Older kernels don't report the data area, it then starts after the header page
+	const uint64_t data_offset = target.page->data_offset != 0 ? target.page->data_offset : page_size;
+	target.data_size           = target.page->data_size != 0 ? target.page->data_size : _config.ring_pages * page_size;
+	target.data                = static_cast<const uint8_t *>(mapping) + data_offset;
+
+	_targets.push_back(target);
+}
+
+void PMUSampler::close()
+{
+	for (auto &target : _targets)
+	{
+		munmap(target.page, _mapping_size);
+		::close(target.fd);
+	}
+	_targets.clear();
+}
+
+bool PMUSampler::is_open() const
+{
+	return !_targets.empty();
+}
+
+void PMUSampler::start()
+{
+	if (_reader_thread.joinable() || _targets.empty())
+	{
+		return;
+	}
+
+	if (pipe(_stop_pipe) != 0)
+	{
+		HWCPIPE_LOG("Failed to create the PMU sampler pipe: %s", std::to_string(errno).c_str());
+		return;
+	}
+
+	for (auto &target : _targets)
+	{
+		ioctl(target.fd, PERF_EVENT_IOC_RESET, 0);
+		if (ioctl(target.fd, PERF_EVENT_IOC_ENABLE, 0) == -1)
+		{
+			HWCPIPE_LOG("Failed to enable PMU sampling: %s", std::to_string(errno).c_str());
+		}
+	}
+
+	_reader_thread = std::thread(&PMUSampler::reader_loop, this);
+}
+
+void PMUSampler::stop()
+{
+	if (!_reader_thread.joinable())
+	{
+		return;
+	}
+
+	for (auto &target : _targets)
+	{
+		ioctl(target.fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	const char stop_request = 0;
+	if (write(_stop_pipe[1], &stop_request, 1) != 1)
+	{
+		HWCPIPE_LOG("Failed to stop the PMU sampler thread.");
+	}
+	_reader_thread.join();
+
+	::close(_stop_pipe[0]);
+	::close(_stop_pipe[1]);
+	_stop_pipe[0] = -1;
+	_stop_pipe[1] = -1;
+}
+
+void PMUSampler::clear()
+{
+	std::lock_guard<std::mutex> lock(_histogram_mutex);
+	_histogram.clear();
+	_sample_count = 0;
+	_lost_count   = 0;
+}
+
+void PMUSampler::reader_loop()
+{
+	std::vector<pollfd> fds(_targets.size() + 1);
+	for (size_t i = 0; i < _targets.size(); ++i)
+	{
+		fds[i].fd     = _targets[i].fd;
+		fds[i].events = POLLIN;
+	}
+	fds.back().fd     = _stop_pipe[0];
+	fds.back().events = POLLIN;
+
+	for (;;)
+	{
+		poll(fds.data(), fds.size(), poll_timeout_ms);
+
+		for (auto &target : _targets)
+		{
+			drain(target);
+		}
+
+		// The events are disabled before the stop request, so the rings were drained for the last time
+		if (fds.back().revents & POLLIN)
+		{
+			return;
+		}
+	}
+}
+
+void PMUSampler::drain(Target &target)
+{
+	const uint64_t head = __atomic_load_n(&target.page->data_head, __ATOMIC_ACQUIRE);
+	uint64_t       tail = target.page->data_tail;
+	const uint64_t mask = target.data_size - 1;
+
+	while (tail < head)
+	{
+		// Records are 8 byte aligned, so a header never wraps around the end of the ring
+		const uint64_t    offset = tail & mask;
+		perf_event_header header;
+		memcpy(&header, target.data + offset, sizeof(header));
+
+		if (header.size < sizeof(header) || header.size > head - tail)
+		{
+			break;
+		}
+
+		const uint8_t *record = target.data + offset;
+		if (offset + header.size > target.data_size)
+		{
+			const size_t first = target.data_size - offset;
+			_wrapped_record.resize(header.size);
+			memcpy(_wrapped_record.data(), record, first);
+			memcpy(_wrapped_record.data() + first, target.data, header.size - first);
+			record = _wrapped_record.data();
+		}
+
+		switch (header.type)
+		{
+			case PERF_RECORD_SAMPLE:
+				decode_sample(record, header.size);
+				break;
+			case PERF_RECORD_LOST:
+			{
+				// Layout: header, id, lost
+				uint64_t lost = 0;
+				if (read_field(record + sizeof(header) + sizeof(uint64_t), record + header.size, lost) != nullptr)
+				{
+					_lost_count += lost;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+
+		tail += header.size;
+	}
+
+	__atomic_store_n(&target.page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+void PMUSampler::decode_sample(const uint8_t *record, size_t size)
+{
+	const uint8_t *end = record + size;
+	const uint8_t *p   = record + sizeof(perf_event_header);
+
+	// Layout: ip, pid, tid, then nr and ips[nr] if the callchain is sampled
+	uint64_t ip  = 0;
+	uint32_t pid = 0;
+	uint32_t tid = 0;
+	p            = read_field(p, end, ip);
+	p            = read_field(p, end, pid);
+	p            = read_field(p, end, tid);
+	if (p == nullptr)
+	{
+		return;
+	}
+
+	_callchain.clear();
+	_callchain.push_back(ip);
+
+	uint64_t nr = 0;
+	if (_config.callchain && (p = read_field(p, end, nr)) != nullptr)
+	{
+		for (uint64_t i = 0; i < nr && _callchain.size() <= max_callchain; ++i)
+		{
+			uint64_t frame = 0;
+			if ((p = read_field(p, end, frame)) == nullptr)
+			{
+				break;
+			}
+
+			// Skip the PERF_CONTEXT_* markers, and count recursive frames once
+			if (frame >= static_cast<uint64_t>(PERF_CONTEXT_MAX) ||
+			    std::find(_callchain.begin(), _callchain.end(), frame) != _callchain.end())
+			{
+				continue;
+			}
+			_callchain.push_back(frame);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(_histogram_mutex);
+
+	_histogram[ip].self++;
+	for (const uint64_t address : _callchain)
+	{
+		_histogram[address].total++;
+	}
+	_sample_count++;
+}
+
+std::vector<PMUHotspot> PMUSampler::hotspots(size_t max_count) const
+{
+	std::vector<PMUHotspot> hotspots;
+
+	{
+		std::lock_guard<std::mutex> lock(_histogram_mutex);
+
+		hotspots.reserve(_histogram.size());
+		for (const auto &entry : _histogram)
+		{
+			if (entry.second.self == 0)
+			{
+				continue;
+			}
+
+			PMUHotspot hotspot;
+			hotspot.address = entry.first;
+			hotspot.self    = entry.second.self;
+			hotspot.total   = entry.second.total;
+			hotspots.push_back(hotspot);
+		}
+	}
+
+	const size_t count = std::min(max_count, hotspots.size());
+	std::partial_sort(hotspots.begin(), hotspots.begin() + count, hotspots.end(),
+	                  [](const PMUHotspot &a, const PMUHotspot &b) {
+		                  return a.self != b.self ? a.self > b.self : a.address < b.address;
+	                  });
+	hotspots.resize(count);
+
+	for (auto &hotspot : hotspots)
+	{
+		hotspot.symbol = symbol_name(hotspot.address);
+	}
+
+	return hotspots;
+}
+
+uint64_t PMUSampler::sample_count() const
+{
+	return _sample_count;
+}
+
+uint64_t PMUSampler::lost_count() const
+{
+	return _lost_count;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "pmu_counter.h"
+
+#include <atomic>
+#include <cstdint>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/** Configuration of a @ref PMUSampler. */
+struct PMUSamplerConfig
+{
+	uint32_t type{PERF_TYPE_HARDWARE};         /**< Type of the event sampled on overflow. */
+	uint64_t config{PERF_COUNT_HW_CPU_CYCLES}; /**< Event sampled on overflow, e.g. PERF_COUNT_HW_CACHE_MISSES. */
+	uint64_t frequency{1000};                  /**< Samples per second, the kernel adjusts the period to match. 0 to use @ref period. */
+	uint64_t period{0};                        /**< Events between two samples, used if @ref frequency is 0. */
+	bool     callchain{true};                  /**< Record the user callchain of each sample. */
+	size_t   ring_pages{16};                   /**< Pages of the ring buffer of each target, rounded up to a power of two. */
+};
+
+/** Code address the samples fell in. */
+struct PMUHotspot
+{
+	uint64_t    address{0}; /**< Sampled instruction address. */
+	std::string symbol{};   /**< Symbol containing the address, if it could be resolved. */
+	uint64_t    self{0};    /**< Samples taken at this address. */
+	uint64_t    total{0};   /**< Samples with this address in their callchain, itself included. */
+};
+
+/** Sample the instruction pointer of the CPU on PMU counter overflow.
+ *
+ * Each target gets an event that interrupts every period and writes a sample
+ * (instruction pointer, thread and user callchain) into a ring buffer mapped
+ * by the process. A background thread decodes the records in place as they
+ * arrive and builds a histogram of the hot code addresses, so no external
+ * profiler is needed.
+ *
+ * If the ring buffer fills faster than it is drained the kernel drops
+ * samples; they are reported by @ref lost_count.
+ */
+class PMUSampler
+{
+  public:
+	/** Constructor
+	 *
+	 * In Process and Thread modes only the calling thread is sampled, as the
+	 * kernel doesn't map the samples of inherited children. PerThread mode
+	 * samples the threads the process has when constructed, and PerCPU mode
+	 * samples every process and usually needs perf_event_paranoid to be 0 or
+	 * lower.
+	 *
+	 * @param[in] config Sampled event and rate.
+	 * @param[in] mode   What the sampled events are attached to.
+	 */
+	explicit PMUSampler(const PMUSamplerConfig &config = PMUSamplerConfig(), PMUCounterMode mode = PMUCounterMode::Process);
+
+	/** Default destructor, stops sampling. */
+	~PMUSampler();
+
+	/** Prevent instances of this class from being copy constructed */
+	PMUSampler(const PMUSampler &) = delete;
+	/** Prevent instances of this class from being copied */
+	PMUSampler &operator=(const PMUSampler &) = delete;
+
+	/** Start sampling and decoding. */
+	void start();
+
+	/** Stop sampling, once the pending samples are decoded. */
+	void stop();
+
+	/** Forget the samples collected so far. */
+	void clear();
+
+	/** Get the hottest addresses.
+	 *
+	 * Symbols are resolved with dladdr, so only the symbols exported by the
+	 * loaded objects are found. dladdr returns the nearest exported symbol
+	 * below an address: with glibc the address is checked against the size
+	 * of that symbol, and code outside any exported symbol (static or hidden
+	 * functions) is named "object+0xoffset". Other C libraries don't report
+	 * the size, so that code is credited to the exported symbol below it.
+	 *
+	 * @param[in] max_count Number of addresses to return.
+	 *
+	 * @return the addresses with the most samples, hottest first.
+	 */
+	std::vector<PMUHotspot> hotspots(size_t max_count) const;
+
+	/** Number of samples decoded.
+	 *
+	 * @return the samples added to the histogram.
+	 */
+	uint64_t sample_count() const;
+
+	/** Number of samples the kernel dropped because a ring buffer was full.
+	 *
+	 * @return the samples lost.
+	 */
+	uint64_t lost_count() const;
+
+	/** Check whether any target could be sampled.
+	 *
+	 * @return true if at least one event and its ring buffer were opened.
+	 */
+	bool is_open() const;
+
+  private:
+	/** Event and ring buffer of one thread or CPU */
+	struct Target
+	{
+		int                   fd{-1};
+		perf_event_mmap_page *page{nullptr};
+		const uint8_t *       data{nullptr};
+		uint64_t              data_size{0};
+	};
+
+	/** Samples of one address */
+	struct Counts
+	{
+		uint64_t self{0};
+		uint64_t total{0};
+	};
+
+	void open(pid_t tid, int cpu);
+	void close();
+	void reader_loop();
+	void drain(Target &target);
+	void decode_sample(const uint8_t *record, size_t size);
+
+	PMUSamplerConfig                     _config;
+	std::vector<Target>                  _targets{};
+	size_t                               _mapping_size{0};
+	std::thread                          _reader_thread{};
+	int                                  _stop_pipe[2]{-1, -1};
+	std::vector<uint8_t>                 _wrapped_record{}; /**< Records that wrap around the end of a ring are reassembled here. */
+	std::vector<uint64_t>                _callchain{};      /**< Distinct addresses of the callchain being decoded. */
+	mutable std::mutex                   _histogram_mutex{};
+	std::unordered_map<uint64_t, Counts> _histogram{};
+	std::atomic<uint64_t>                _sample_count{0};
+	std::atomic<uint64_t>                _lost_count{0};
+};
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "regression.h"
+
+#include "trace.h"
+
+// hwc_names.hpp relies on the fixed width integer types being declared
+#include <cstdint>
+
+#include "hwc_names.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+void append_samples(CounterSamples &samples, const MeasurementsSnapshot &snapshot)
+{
+	for (MeasurementsSnapshot::Id id = 0; id < snapshot.size(); ++id)
+	{
+		const Measurement::Value &value = snapshot.value(id);
+		samples[snapshot.name(id)].push_back(value.is_floating_point ? value.v.floating_point : static_cast<double>(value.v.integer));
+	}
+}
+
+namespace
+{
+/** Counter of a Mali dump and where its values are */
+struct TraceCounter
+{
+	std::string         name;
+	std::vector<size_t> offsets; /**< Offset of the counter in each block it is summed over. */
+};
+
+/** Lay the counters of a Mali dump out from the trace header */
+std::vector<TraceCounter> mali_trace_counters(const TraceHeader &header)
+{
+	const mali_userspace::CounterMapping *product = nullptr;
+	for (const mali_userspace::CounterMapping &mapping : mali_userspace::products)
+	{
+		if (mapping.product_id == header.names_lut_id)
+		{
+			product = &mapping;
+		}
+	}
+
+	if (product == nullptr || header.block_size != mali_userspace::MALI_NAME_BLOCK_SIZE)
+	{
+		throw std::runtime_error("Unknown GPU in the trace header.");
+	}
+
+	// Dumps hold the job manager, tiler, L2 slices, then one block per shader core bit
+	std::vector<size_t> jm{0};
+	std::vector<size_t> tiler{1};
+	std::vector<size_t> mmu;
+	std::vector<size_t> shader;
+	for (uint32_t slice = 0; slice < header.num_l2_slices; ++slice)
+	{
+		mmu.push_back(2 + slice);
+	}
+	for (uint32_t bit = 0; bit < 64; ++bit)
+	{
+		if ((header.core_mask >> bit) & 1)
+		{
+			shader.push_back(2 + header.num_l2_slices + bit);
+		}
+	}
+
+	const std::vector<size_t> *blocks[] = {&jm, &tiler, &shader, &mmu};
+
+	std::vector<TraceCounter> counters;
+	for (int block = mali_userspace::MALI_NAME_BLOCK_JM; block <= mali_userspace::MALI_NAME_BLOCK_MMU; ++block)
+	{
+		const char *const *names = &product->names_lut[mali_userspace::MALI_NAME_BLOCK_SIZE * block];
+
+		// The first 4 counters of a block are its header
+		for (int i = 4; i < mali_userspace::MALI_NAME_BLOCK_SIZE; ++i)
+		{
+			const char *name      = names[i];
+			const char *separator = strchr(name, '_');
+			if (name[0] == '\0' || separator == nullptr)
+			{
+				continue;
+			}
+
+			TraceCounter counter{separator + 1, {}};
+			for (size_t block_index : *blocks[block])
+			{
+				counter.offsets.push_back(block_index * mali_userspace::MALI_NAME_BLOCK_SIZE + i);
+			}
+			counters.push_back(std::move(counter));
+		}
+	}
+
+	return counters;
+}
+
+/** Median of a set of values, reordering them */
+double median(std::vector<double> &values)
+{
+	const size_t middle = values.size() / 2;
+	std::nth_element(values.begin(), values.begin() + middle, values.end());
+	const double upper = values[middle];
+
+	if (values.size() % 2 != 0)
+	{
+		return upper;
+	}
+
+	return (upper + *std::max_element(values.begin(), values.begin() + middle)) / 2.0;
+}
+
+/** Two-sided p-value of the Mann-Whitney U test, with the normal approximation corrected for ties */
+double mann_whitney_p_value(const std::vector<double> &a, const std::vector<double> &b)
+{
+	const size_t n1 = a.size();
+	const size_t n2 = b.size();
+	const size_t n  = n1 + n2;
+
+	std::vector<std::pair<double, bool>> values;
+	values.reserve(n);
+	for (double value : a)
+	{
+		values.emplace_back(value, true);
+	}
+	for (double value : b)
+	{
+		values.emplace_back(value, false);
+	}
+	std::sort(values.begin(), values.end());
+
+	// Rank sum of the first set, tied values get their average rank
+	double rank_sum_a = 0.0;
+	double tie_term   = 0.0;
+	for (size_t i = 0; i < n;)
+	{
+		size_t j = i;
+		while (j < n && values[j].first == values[i].first)
+		{
+			++j;
+		}
+
+		const double rank = (i + 1 + j) / 2.0;
+		for (size_t k = i; k < j; ++k)
+		{
+			if (values[k].second)
+			{
+				rank_sum_a += rank;
+			}
+		}
+
+		const double ties = static_cast<double>(j - i);
+		tie_term += ties * ties * ties - ties;
+		i = j;
+	}
+
+	const double u    = rank_sum_a - n1 * (n1 + 1) / 2.0;
+	const double mean = n1 * n2 / 2.0;
+	const double var  = n1 * n2 / 12.0 * ((n + 1) - tie_term / (static_cast<double>(n) * (n - 1)));
+	if (var <= 0.0)
+	{
+		return 1.0;
+	}
+
+	const double z = std::max(std::fabs(u - mean) - 0.5, 0.0) / std::sqrt(var);
+	return std::erfc(z / std::sqrt(2.0));
+}
+
+/** Seed of a counter, so that its bootstrap doesn't depend on the thread it runs on */
+uint64_t counter_seed(uint64_t seed, const std::string &name)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull ^ seed;
+	for (char c : name)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool is_gated(const std::string &name, const std::vector<std::string> &gated)
+{
+	std::string lower(name);
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+	for (const std::string &part : gated)
+	{
+		std::string lower_part(part);
+		std::transform(lower_part.begin(), lower_part.end(), lower_part.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+		if (lower.find(lower_part) != std::string::npos)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Compare one counter, with scratch buffers reused across the counters of a thread */
+void compare_counter(const std::vector<double> &baseline, const std::vector<double> &candidate, const RegressionConfig &config,
+                     CounterComparison &result, std::vector<double> &scratch, std::vector<double> &differences)
+{
+	result.baseline_count  = baseline.size();
+	result.candidate_count = candidate.size();
+
+	scratch.assign(baseline.begin(), baseline.end());
+	result.baseline_median = median(scratch);
+	scratch.assign(candidate.begin(), candidate.end());
+	result.candidate_median = median(scratch);
+
+	result.difference      = result.candidate_median - result.baseline_median;
+	result.relative_change = result.baseline_median != 0.0 ? result.difference / std::fabs(result.baseline_median) : 0.0;
+	result.p_value         = mann_whitney_p_value(baseline, candidate);
+
+	std::mt19937_64 generator(counter_seed(config.seed, result.name));
+	differences.resize(std::max<size_t>(config.resamples, 1));
+	for (double &difference : differences)
+	{
+		std::uniform_int_distribution<size_t> pick_baseline(0, baseline.size() - 1);
+		scratch.resize(baseline.size());
+		for (double &value : scratch)
+		{
+			value = baseline[pick_baseline(generator)];
+		}
+		const double baseline_median = median(scratch);
+
+		std::uniform_int_distribution<size_t> pick_candidate(0, candidate.size() - 1);
+		scratch.resize(candidate.size());
+		for (double &value : scratch)
+		{
+			value = candidate[pick_candidate(generator)];
+		}
+		difference = median(scratch) - baseline_median;
+	}
+
+	// Percentile interval of the resampled differences
+	std::sort(differences.begin(), differences.end());
+	const double alpha     = 1.0 - config.confidence;
+	const size_t last      = differences.size() - 1;
+	result.difference_low  = differences[static_cast<size_t>(std::floor(alpha / 2.0 * last))];
+	result.difference_high = differences[static_cast<size_t>(std::ceil((1.0 - alpha / 2.0) * last))];
+
+	result.gated = is_gated(result.name, config.gated);
+}
+
+/** Adjust the p-values for the number of counters compared, with the Benjamini-Hochberg procedure */
+void adjust_p_values(std::vector<CounterComparison> &comparisons)
+{
+	std::vector<size_t> order(comparisons.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return comparisons[a].p_value < comparisons[b].p_value; });
+
+	double adjusted = 1.0;
+	for (size_t rank = order.size(); rank > 0; --rank)
+	{
+		CounterComparison &comparison = comparisons[order[rank - 1]];
+		adjusted                      = std::min(adjusted, comparison.p_value * order.size() / rank);
+		comparison.adjusted_p_value   = adjusted;
+	}
+}
+
+void conclude(const RegressionConfig &config, CounterComparison &result)
+{
+	const double alpha   = 1.0 - config.confidence;
+	const double p_value = config.control_false_discoveries ? result.adjusted_p_value : result.p_value;
+
+	result.significant = p_value < alpha && (result.difference_low > 0.0 || result.difference_high < 0.0);
+
+	const bool large_enough = std::fabs(result.relative_change) >= config.min_relative_change ||
+	                          (result.baseline_median == 0.0 && result.difference != 0.0);
+	if (result.significant && large_enough)
+	{
+		result.verdict = result.difference > 0.0 ? RegressionVerdict::Regressed : RegressionVerdict::Improved;
+	}
+}
+}        // namespace
+
+CounterSamples read_trace_samples(const std::string &path)
+{
+	TraceReader                        reader(path);
+	CounterSamples                     samples;
+	std::vector<TraceCounter>          mali_counters;
+	std::vector<std::vector<double> *> mali_samples;
+	TraceRecord                        record;
+
+	while (reader.next(record))
+	{
+		if (record.block == TRACE_BLOCK_MALI_DUMP)
+		{
+			if (mali_counters.empty())
+			{
+				mali_counters = mali_trace_counters(reader.header());
+				for (const TraceCounter &counter : mali_counters)
+				{
+					mali_samples.push_back(&samples[counter.name]);
+				}
+			}
+
+			for (size_t i = 0; i < mali_counters.size(); ++i)
+			{
+				double sum = 0.0;
+				for (size_t offset : mali_counters[i].offsets)
+				{
+					sum += offset < record.values.size() ? static_cast<double>(record.values[offset]) : 0.0;
+				}
+				mali_samples[i]->push_back(sum);
+			}
+		}
+		else if (record.block == TRACE_BLOCK_PMU_GROUP)
+		{
+			for (size_t i = 0; i < record.values.size(); ++i)
+			{
+				samples["PMU group value " + std::to_string(i)].push_back(static_cast<double>(record.values[i]));
+			}
+		}
+	}
+
+	return samples;
+}
+
+std::vector<CounterComparison> compare_runs(const CounterSamples &baseline, const CounterSamples &candidate, const RegressionConfig &config)
+{
+	std::vector<CounterComparison>                                                   comparisons;
+	std::vector<std::pair<const std::vector<double> *, const std::vector<double> *>> inputs;
+
+	for (const auto &counter : baseline)
+	{
+		const auto other = candidate.find(counter.first);
+		if (other == candidate.end() || counter.second.empty() || other->second.empty())
+		{
+			continue;
+		}
+
+		CounterComparison comparison;
+		comparison.name = counter.first;
+		comparisons.push_back(std::move(comparison));
+		inputs.emplace_back(&counter.second, &other->second);
+	}
+
+	// Workers take the next counter until there are none left, counters cost their sample count
+	std::atomic<size_t> next{0};
+	const auto          worker = [&]() {
+		std::vector<double> scratch;
+		std::vector<double> differences;
+		for (size_t i = next++; i < comparisons.size(); i = next++)
+		{
+			compare_counter(*inputs[i].first, *inputs[i].second, config, comparisons[i], scratch, differences);
+		}
+	};
+
+	size_t thread_count = config.threads != 0 ? config.threads : std::max(std::thread::hardware_concurrency(), 1u);
+	thread_count        = std::min(thread_count, comparisons.size());
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < thread_count; ++i)
+	{
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	adjust_p_values(comparisons);
+	for (CounterComparison &comparison : comparisons)
+	{
+		conclude(config, comparison);
+	}
+
+	return comparisons;
+}
+
+bool has_regression(const std::vector<CounterComparison> &comparisons)
+{
+	return std::any_of(comparisons.begin(), comparisons.end(), [](const CounterComparison &comparison) {
+		return comparison.gated && comparison.verdict == RegressionVerdict::Regressed;
+	});
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurements_snapshot.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/** Samples of each counter of a run, keyed by counter name. */
+using CounterSamples = std::map<std::string, std::vector<double>>;
+
+/** Add the measurements of one iteration to the samples of a run.
+ *
+ * @param[in,out] samples  Samples of the run.
+ * @param[in]     snapshot Measurements of the iteration.
+ */
+void append_samples(CounterSamples &samples, const MeasurementsSnapshot &snapshot);
+
+/** Read the samples of each counter from a trace written by @ref TraceWriter.
+ *
+ * Every Mali dump is a sample: the counters are named after the GPU of the
+ * trace header, without the product prefix (e.g. "GPU_ACTIVE"), and the
+ * shader core and L2 slice values are summed. The values of PMU group reads
+ * are named "PMU group value 0", "PMU group value 1"...
+ *
+ * @param[in] path Path of the trace.
+ *
+ * @return the samples of each counter.
+ */
+CounterSamples read_trace_samples(const std::string &path);
+
+/** Configuration of @ref compare_runs. */
+struct RegressionConfig
+{
+	double                   confidence{0.95};                                                             /**< Confidence level of the intervals, and 1 - the significance level of the test. */
+	double                   min_relative_change{0.02};                                                    /**< Smallest relative change of the median that is reported as a regression or improvement. */
+	size_t                   resamples{2000};                                                              /**< Bootstrap resamples of each counter. */
+	uint64_t                 seed{0x5eed};                                                                 /**< Seed of the bootstrap, the results don't depend on the thread count. */
+	size_t                   threads{0};                                                                   /**< Threads comparing the counters, 0 for one per CPU. */
+	bool                     control_false_discoveries{true};                                              /**< Test the p-values adjusted for the number of counters, so that comparing hundreds of counters doesn't flag some by chance. */
+	std::vector<std::string> gated{"cycles", "instructions", "external", "stall", "l2_ext", "gpu_active"}; /**< Case insensitive parts of the names of the counters that gate a build. */
+};
+
+/** Outcome of the comparison of one counter, assuming lower is better, as for cycles, traffic and stalls. */
+enum class RegressionVerdict
+{
+	Unchanged, /**< No significant change, or a change smaller than the threshold. */
+	Regressed, /**< Significant increase. */
+	Improved,  /**< Significant decrease. */
+};
+
+/** Comparison of the samples of one counter in two runs. */
+struct CounterComparison
+{
+	std::string       name{};                                   /**< Name of the counter. */
+	size_t            baseline_count{0};                        /**< Number of samples of the baseline run. */
+	size_t            candidate_count{0};                       /**< Number of samples of the candidate run. */
+	double            baseline_median{0.0};                     /**< Median of the baseline run. */
+	double            candidate_median{0.0};                    /**< Median of the candidate run. */
+	double            difference{0.0};                          /**< Candidate median minus baseline median. */
+	double            difference_low{0.0};                      /**< Lower bound of the bootstrap confidence interval of @ref difference. */
+	double            difference_high{0.0};                     /**< Upper bound of the bootstrap confidence interval of @ref difference. */
+	double            relative_change{0.0};                     /**< @ref difference over the baseline median, 0 if the baseline median is 0. */
+	double            p_value{1.0};                             /**< Two-sided p-value of the Mann-Whitney U test. */
+	double            adjusted_p_value{1.0};                    /**< @ref p_value adjusted for the number of counters compared (Benjamini-Hochberg). */
+	bool              significant{false};                       /**< The test rejects equality and the interval excludes 0. */
+	bool              gated{false};                             /**< The counter is one of @ref RegressionConfig::gated. */
+	RegressionVerdict verdict{RegressionVerdict::Unchanged};
+};
+
+/** Compare the samples of two runs, counter by counter.
+ *
+ * For each counter found in both runs, the Mann-Whitney U test tells
+ * whether the candidate distribution moved, and a bootstrap of the
+ * difference of the medians gives its confidence interval. Both are
+ * distribution free, so skewed counters such as stall cycles are handled.
+ * The counters are spread over several threads.
+ *
+ * @param[in] baseline  Samples of the reference run.
+ * @param[in] candidate Samples of the run to check.
+ * @param[in] config    (Optional) Confidence, threshold and gated counters.
+ *
+ * @return one comparison per counter, in name order.
+ */
+std::vector<CounterComparison> compare_runs(const CounterSamples &baseline, const CounterSamples &candidate, const RegressionConfig &config = RegressionConfig());
+
+/** Check whether a gated counter regressed, e.g. to fail a CI job.
+ *
+ * @param[in] comparisons Result of @ref compare_runs.
+ *
+ * @return true if at least one gated counter regressed.
+ */
+bool has_regression(const std::vector<CounterComparison> &comparisons);
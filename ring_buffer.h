@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/** Lock-free ring buffer shared by one producer thread and one consumer thread.
+ *
+ * Slots are allocated up front and filled in place, so neither side
+ * allocates or blocks once the ring is constructed.
+ */
+template <typename T>
+class SPSCRingBuffer
+{
+  public:
+	/** Constructor
+     *
+     * @param[in] capacity Number of slots, rounded up to a power of two.
+     */
+	explicit SPSCRingBuffer(size_t capacity);
+
+	/** Prevent instances of this class from being copy constructed */
+	SPSCRingBuffer(const SPSCRingBuffer &) = delete;
+	/** Prevent instances of this class from being copied */
+	SPSCRingBuffer &operator=(const SPSCRingBuffer &) = delete;
+
+	/** Get the next slot to write. Producer only.
+     *
+     * @return The slot to fill, or nullptr if the ring is full.
+     */
+	T *write_slot();
+
+	/** Publish the slot returned by @ref write_slot. Producer only. */
+	void push();
+
+	/** Get the oldest published slot. Consumer only.
+     *
+     * @return The slot to read, or nullptr if the ring is empty.
+     */
+	T *front();
+
+	/** Release the slot returned by @ref front. Consumer only. */
+	void pop();
+
+	/** Number of slots currently published.
+     *
+     * @return the number of slots waiting to be consumed.
+     */
+	size_t size() const;
+
+	/** Number of slots of the ring.
+     *
+     * @return the capacity of the ring.
+     */
+	size_t capacity() const;
+
+  private:
+	/** Index padded to a cache line so the producer and consumer don't share one */
+	struct PaddedIndex
+	{
+		std::atomic<size_t> value{0};
+		char                padding[64 - sizeof(std::atomic<size_t>)];
+	};
+
+	static size_t round_up_power_of_two(size_t value);
+
+	std::vector<T> _slots;
+	size_t         _mask;
+	PaddedIndex    _head{}; /**< Next slot written by the producer. */
+	PaddedIndex    _tail{}; /**< Next slot read by the consumer. */
+};
+
+template <typename T>
+SPSCRingBuffer<T>::SPSCRingBuffer(size_t capacity) :
+    _slots(round_up_power_of_two(capacity)),
+    _mask(_slots.size() - 1)
+{
+}
+
+template <typename T>
+size_t SPSCRingBuffer<T>::round_up_power_of_two(size_t value)
+{
+	size_t result = 1;
+	while (result < value)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+template <typename T>
+T *SPSCRingBuffer<T>::write_slot()
+{
+	const size_t head = _head.value.load(std::memory_order_relaxed);
+
+	if (head - _tail.value.load(std::memory_order_acquire) == _slots.size())
+	{
+		return nullptr;
+	}
+
+	return &_slots[head & _mask];
+}
+
+template <typename T>
+void SPSCRingBuffer<T>::push()
+{
+	_head.value.store(_head.value.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename T>
+T *SPSCRingBuffer<T>::front()
+{
+	const size_t tail = _tail.value.load(std::memory_order_relaxed);
+
+	if (tail == _head.value.load(std::memory_order_acquire))
+	{
+		return nullptr;
+	}
+
+	return &_slots[tail & _mask];
+}
+
+template <typename T>
+void SPSCRingBuffer<T>::pop()
+{
+	_tail.value.store(_tail.value.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename T>
+size_t SPSCRingBuffer<T>::size() const
+{
+	return _head.value.load(std::memory_order_acquire) - _tail.value.load(std::memory_order_acquire);
+}
+
+template <typename T>
+size_t SPSCRingBuffer<T>::capacity() const
+{
+	return _slots.size();
+}
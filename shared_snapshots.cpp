@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "shared_snapshots.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+
+SharedSnapshots::SharedSnapshots(size_t max_references) :
+    // The current snapshot and the one being written come on top of the ones the readers hold
+    _node_count(max_references + 2),
+    _nodes(new Node[_node_count])
+{
+}
+
+bool SharedSnapshots::publish(const HWCPipeSample &sample)
+{
+	Node *const current = _current.load();
+
+	for (size_t i = 0; i < _node_count; ++i)
+	{
+		Node *const node = &_nodes[(_next_node + i) % _node_count];
+
+		// A reader that pinned the node after it stopped being current sees it isn't current and lets it go
+		if (node == current || node->references.load() != 0)
+		{
+			continue;
+		}
+
+		node->snapshot.sample = sample;
+		node->snapshot.epoch  = _epoch.load(std::memory_order_relaxed) + 1;
+
+		_current.store(node);
+		_epoch.store(node->snapshot.epoch, std::memory_order_release);
+		_next_node = (_next_node + i + 1) % _node_count;
+		return true;
+	}
+
+	_skipped.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+SharedSnapshots::Reference SharedSnapshots::latest() const
+{
+	for (;;)
+	{
+		Node *const node = _current.load();
+		if (node == nullptr)
+		{
+			return Reference();
+		}
+
+		// Pin the node, then check that the writer didn't start reusing it in the meantime
+		node->references.fetch_add(1);
+		if (_current.load() == node)
+		{
+			return Reference(node);
+		}
+		node->references.fetch_sub(1);
+	}
+}
+
+SharedSampler::SharedSampler(HWCPipe &pipe, uint64_t interval_ns, size_t max_references) :
+    _pipe(pipe),
+    _interval_ns(interval_ns),
+    _snapshots(max_references)
+{
+}
+
+SharedSampler::~SharedSampler()
+{
+	stop();
+}
+
+void SharedSampler::start()
+{
+	if (_running)
+	{
+		throw std::runtime_error("Shared sampler already started.");
+	}
+
+	if (pipe2(_stop_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		throw std::runtime_error("Failed to create the shared sampler pipe.");
+	}
+
+	_running = true;
+	_worker  = std::thread(&SharedSampler::worker_loop, this);
+}
+
+void SharedSampler::stop()
+{
+	if (!_running)
+	{
+		return;
+	}
+
+	_running = false;
+
+	const char wake = 0;
+	if (write(_stop_pipe[1], &wake, 1) != 1)
+	{
+		HWCPIPE_LOG("Failed to wake the shared sampler thread.");
+	}
+	_worker.join();
+
+	close(_stop_pipe[0]);
+	close(_stop_pipe[1]);
+	_stop_pipe[0] = -1;
+	_stop_pipe[1] = -1;
+}
+
+void SharedSampler::worker_loop()
+{
+	timespec interval;
+	interval.tv_sec  = static_cast<time_t>(_interval_ns / 1000000000ull);
+	interval.tv_nsec = static_cast<long>(_interval_ns % 1000000000ull);
+
+	pollfd poll_fd;
+	poll_fd.fd     = _stop_pipe[0];
+	poll_fd.events = POLLIN;
+
+	try
+	{
+		bool stopping = false;
+		while (!stopping)
+		{
+			_pipe.start();
+			stopping = ppoll(&poll_fd, 1, &interval, nullptr) > 0 || !_running;
+			_pipe.stop();
+
+			_snapshots.publish(_pipe.sample());
+		}
+	}
+	catch (const std::runtime_error &error)
+	{
+		HWCPIPE_LOG("Shared sampler stopped: %s", error.what());
+	}
+}
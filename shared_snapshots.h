@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "hwcpipe.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+/** Immutable measurements, tagged with the publication they come from. */
+struct EpochSnapshot
+{
+	uint64_t      epoch{0}; /**< Publication count, increasing by one at each publication. */
+	HWCPipeSample sample{}; /**< Measurements of the publication. */
+};
+
+/** Share the latest measurements of one writer thread with any number of reader threads.
+ *
+ * Publications are written into a pool of snapshots and published by
+ * swapping a pointer, in the spirit of RCU: a reader pins the snapshot that
+ * is current with a reference count and reads it in place, while the writer
+ * fills one that no reader holds. Neither side takes a lock or waits for
+ * the other, and the snapshot a reader holds never changes.
+ *
+ * If every snapshot of the pool is held, the publication is skipped rather
+ * than waiting for the readers.
+ */
+class SharedSnapshots
+{
+  private:
+	/** Snapshot of the pool */
+	struct Node
+	{
+		std::atomic<uint32_t> references{0}; /**< Number of readers holding the snapshot. */
+		EpochSnapshot         snapshot{};
+	};
+
+  public:
+	/** Reference to a published snapshot, which stays valid and unchanged while it is held. */
+	class Reference
+	{
+	  public:
+		/** Default constructor: an empty reference. */
+		Reference() = default;
+
+		/** Prevent instances of this class from being copy constructed */
+		Reference(const Reference &) = delete;
+		/** Prevent instances of this class from being copied */
+		Reference &operator=(const Reference &) = delete;
+		/** Allow instances of this class to be move constructed */
+		Reference(Reference &&other) :
+		    _node(other._node)
+		{
+			other._node = nullptr;
+		}
+		/** Allow instances of this class to be moved */
+		Reference &operator=(Reference &&other)
+		{
+			if (this != &other)
+			{
+				release();
+				_node       = other._node;
+				other._node = nullptr;
+			}
+			return *this;
+		}
+
+		/** Let the writer reuse the snapshot. */
+		~Reference()
+		{
+			release();
+		}
+
+		/** Let the writer reuse the snapshot before the reference goes out of scope. */
+		void release()
+		{
+			if (_node != nullptr)
+			{
+				_node->references.fetch_sub(1);
+				_node = nullptr;
+			}
+		}
+
+		/** Check whether the reference holds a snapshot.
+		 *
+		 * @return false if nothing was published yet.
+		 */
+		bool valid() const
+		{
+			return _node != nullptr;
+		}
+
+		/** Accessor for the snapshot, only if @ref valid. */
+		const EpochSnapshot &operator*() const
+		{
+			return _node->snapshot;
+		}
+
+		/** Accessor for the snapshot, only if @ref valid. */
+		const EpochSnapshot *operator->() const
+		{
+			return &_node->snapshot;
+		}
+
+	  private:
+		friend class SharedSnapshots;
+
+		explicit Reference(Node *node) :
+		    _node(node)
+		{
+		}
+
+		Node *_node{nullptr};
+	};
+
+	/** Constructor
+	 *
+	 * @param[in] max_references Number of references the readers may hold at once, e.g. one per worker thread.
+	 */
+	explicit SharedSnapshots(size_t max_references = 8);
+
+	/** Prevent instances of this class from being copy constructed */
+	SharedSnapshots(const SharedSnapshots &) = delete;
+	/** Prevent instances of this class from being copied */
+	SharedSnapshots &operator=(const SharedSnapshots &) = delete;
+
+	/** Publish measurements. Writer thread only.
+	 *
+	 * Once the pool is warm, copying the sample doesn't allocate.
+	 *
+	 * @param[in] sample Measurements to publish.
+	 *
+	 * @return false if every snapshot was held by the readers and the publication was skipped.
+	 */
+	bool publish(const HWCPipeSample &sample);
+
+	/** Get the latest published snapshot. Any thread.
+	 *
+	 * @return a reference to the latest snapshot, not valid if nothing was published yet.
+	 */
+	Reference latest() const;
+
+	/** Epoch of the latest publication. Any thread.
+	 *
+	 * @return the epoch of the latest snapshot, 0 if nothing was published yet.
+	 */
+	uint64_t epoch() const
+	{
+		return _epoch.load(std::memory_order_acquire);
+	}
+
+	/** Number of publications skipped because every snapshot was held.
+	 *
+	 * @return the number of skipped publications.
+	 */
+	uint64_t skipped() const
+	{
+		return _skipped.load(std::memory_order_relaxed);
+	}
+
+  private:
+	size_t                      _node_count;
+	std::unique_ptr<Node[]>     _nodes;
+	mutable std::atomic<Node *> _current{nullptr};
+	std::atomic<uint64_t>       _epoch{0};
+	std::atomic<uint64_t>       _skipped{0};
+	size_t                      _next_node{0}; /**< Node the writer tries first, so that the pool is used in turn. */
+};
+
+/** Sample a HWCPipe session on a dedicated thread and share its measurements.
+ *
+ * The thread is the only one using the instruments of the session, and so
+ * the hardware counter fds: it measures consecutive intervals and
+ * publishes each sample, which worker threads read through
+ * @ref snapshots without blocking the sampler or each other.
+ *
+ * Publishing copies the sample between the stop() of an interval and the
+ * start() of the next one, and that gap isn't measured: the begin_ns and
+ * end_ns of the samples tell which time each one covers.
+ */
+class SharedSampler
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] pipe           Session to sample. It must not be used by other threads while sampling.
+	 * @param[in] interval_ns    Length of each sampled interval, in nanoseconds.
+	 * @param[in] max_references Number of references the readers may hold at once.
+	 */
+	SharedSampler(HWCPipe &pipe, uint64_t interval_ns, size_t max_references = 8);
+
+	/** Default destructor, stops sampling. */
+	~SharedSampler();
+
+	/** Prevent instances of this class from being copy constructed */
+	SharedSampler(const SharedSampler &) = delete;
+	/** Prevent instances of this class from being copied */
+	SharedSampler &operator=(const SharedSampler &) = delete;
+
+	/** Start the sampling thread. */
+	void start();
+
+	/** Stop the sampling thread, once the current interval is published. */
+	void stop();
+
+	/** Accessor for the shared measurements.
+	 *
+	 * @return the snapshots published by the thread.
+	 */
+	const SharedSnapshots &snapshots() const
+	{
+		return _snapshots;
+	}
+
+  private:
+	void worker_loop();
+
+	HWCPipe &         _pipe;
+	uint64_t          _interval_ns;
+	SharedSnapshots   _snapshots;
+	std::thread       _worker{};
+	int               _stop_pipe[2]{-1, -1};
+	std::atomic<bool> _running{false};
+};
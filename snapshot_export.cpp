@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "snapshot_export.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+constexpr char export_magic[8] = {'H', 'W', 'C', 'E', 'X', 'P', 'R', 'T'};
+constexpr int  max_read_attempts = 16;
+
+uint64_t monotonic_time_ns()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + static_cast<uint64_t>(time.tv_nsec);
+}
+
+size_t slot_size(size_t capacity)
+{
+	return sizeof(snapshot_export::Slot) + capacity * sizeof(snapshot_export::Value);
+}
+
+snapshot_export::Entry *entries(void *region)
+{
+	return reinterpret_cast<snapshot_export::Entry *>(static_cast<uint8_t *>(region) + sizeof(snapshot_export::Header));
+}
+
+const snapshot_export::Entry *entries(const void *region)
+{
+	return reinterpret_cast<const snapshot_export::Entry *>(static_cast<const uint8_t *>(region) + sizeof(snapshot_export::Header));
+}
+
+size_t slot_offset(size_t capacity, uint32_t slot)
+{
+	return sizeof(snapshot_export::Header) + capacity * sizeof(snapshot_export::Entry) + slot * slot_size(capacity);
+}
+
+/** Copy a string into a fixed size field, truncating it if needed */
+void copy_string(char *field, size_t size, const std::string &str)
+{
+	const size_t length = std::min(str.size(), size - 1);
+	memcpy(field, str.data(), length);
+	memset(field + length, 0, size - length);
+}
+}        // namespace
+
+size_t snapshot_export::region_size(size_t capacity)
+{
+	return slot_offset(capacity, EXPORT_SLOTS);
+}
+
+SnapshotExporter::SnapshotExporter(const std::string &path, size_t capacity, uint64_t min_interval_ns) :
+    _capacity(capacity),
+    _min_interval_ns(min_interval_ns),
+    _size(snapshot_export::region_size(capacity))
+{
+	const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Failed to open the export region " + path + ".");
+	}
+
+	if (ftruncate(fd, static_cast<off_t>(_size)) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Failed to size the export region " + path + ".");
+	}
+
+	_region = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (_region == MAP_FAILED)
+	{
+		_region = nullptr;
+		throw std::runtime_error("Failed to map the export region " + path + ".");
+	}
+
+	// Readers check the magic last, once the region is laid out
+	memset(_region, 0, _size);
+	_header  = new (_region) snapshot_export::Header();
+	_entries = entries(_region);
+
+	_header->version  = snapshot_export::EXPORT_VERSION;
+	_header->capacity = static_cast<uint32_t>(_capacity);
+	_header->layout_sequence.store(0, std::memory_order_relaxed);
+	_header->active_slot.store(0, std::memory_order_relaxed);
+
+	for (uint32_t slot = 0; slot < snapshot_export::EXPORT_SLOTS; ++slot)
+	{
+		new (static_cast<uint8_t *>(_region) + slot_offset(_capacity, slot)) snapshot_export::Slot();
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(_header->magic, export_magic, sizeof(export_magic));
+}
+
+SnapshotExporter::~SnapshotExporter()
+{
+	if (_region != nullptr)
+	{
+		munmap(_region, _size);
+	}
+}
+
+bool SnapshotExporter::publish(const MeasurementsSnapshot &snapshot, uint64_t timestamp_ns)
+{
+	const MeasurementsSnapshot *snapshots[] = {&snapshot};
+	return publish(snapshots, 1, timestamp_ns);
+}
+
+bool SnapshotExporter::publish(const MeasurementsSnapshot *const *snapshots, size_t count, uint64_t timestamp_ns)
+{
+	const uint64_t now = monotonic_time_ns();
+	if (_min_interval_ns > 0 && _publish_count > 0 && now - _last_publish_ns < _min_interval_ns)
+	{
+		return false;
+	}
+	_last_publish_ns = now;
+
+	if (!layout_matches(snapshots, count))
+	{
+		write_layout(snapshots, count);
+	}
+
+	// Write the slot readers aren't pointed at, then point them at it
+	const uint32_t slot_index = _header->active_slot.load(std::memory_order_relaxed) ^ 1;
+	uint8_t *const slot_data  = static_cast<uint8_t *>(_region) + slot_offset(_capacity, slot_index);
+	auto *const    slot       = reinterpret_cast<snapshot_export::Slot *>(slot_data);
+	auto *const    values     = reinterpret_cast<snapshot_export::Value *>(slot_data + sizeof(snapshot_export::Slot));
+
+	const uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+	slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->layout_sequence = _header->layout_sequence.load(std::memory_order_relaxed);
+	slot->timestamp_ns    = timestamp_ns != 0 ? timestamp_ns : now;
+	slot->publish_count   = ++_publish_count;
+
+	size_t index = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		for (MeasurementsSnapshot::Id id = 0; id < snapshots[i]->size() && index < _capacity; ++id, ++index)
+		{
+			const Measurement::Value &value = snapshots[i]->value(id);
+			if (value.is_floating_point)
+			{
+				values[index].floating_point = value.v.floating_point;
+			}
+			else
+			{
+				values[index].integer = value.v.integer;
+			}
+		}
+	}
+
+	slot->sequence.store(sequence + 2, std::memory_order_release);
+	_header->active_slot.store(slot_index, std::memory_order_release);
+
+	return true;
+}
+
+bool SnapshotExporter::layout_matches(const MeasurementsSnapshot *const *snapshots, size_t count) const
+{
+	size_t index = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		for (MeasurementsSnapshot::Id id = 0; id < snapshots[i]->size() && index < _capacity; ++id, ++index)
+		{
+			const snapshot_export::Entry &entry = _entries[index];
+			if (index >= _header->count ||
+			    entry.is_floating_point != static_cast<uint32_t>(snapshots[i]->value(id).is_floating_point) ||
+			    strncmp(entry.name, snapshots[i]->name(id).c_str(), snapshot_export::EXPORT_NAME_SIZE - 1) != 0 ||
+			    strncmp(entry.unit, snapshots[i]->unit(id).c_str(), snapshot_export::EXPORT_UNIT_SIZE - 1) != 0)
+			{
+				return false;
+			}
+		}
+	}
+
+	return index == _header->count && _publish_count > 0;
+}
+
+void SnapshotExporter::write_layout(const MeasurementsSnapshot *const *snapshots, size_t count)
+{
+	const uint32_t sequence = _header->layout_sequence.load(std::memory_order_relaxed);
+	_header->layout_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	size_t index = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		for (MeasurementsSnapshot::Id id = 0; id < snapshots[i]->size() && index < _capacity; ++id, ++index)
+		{
+			snapshot_export::Entry &entry = _entries[index];
+			copy_string(entry.name, sizeof(entry.name), snapshots[i]->name(id));
+			copy_string(entry.unit, sizeof(entry.unit), snapshots[i]->unit(id));
+			entry.is_floating_point = snapshots[i]->value(id).is_floating_point ? 1 : 0;
+		}
+	}
+	_header->count = static_cast<uint32_t>(index);
+
+	_header->layout_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+SnapshotExportReader::SnapshotExportReader(const std::string &path)
+{
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Failed to open the export region " + path + ".");
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(snapshot_export::Header))
+	{
+		close(fd);
+		throw std::runtime_error("Invalid export region " + path + ".");
+	}
+
+	_size        = static_cast<size_t>(info.st_size);
+	void *region = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (region == MAP_FAILED)
+	{
+		throw std::runtime_error("Failed to map the export region " + path + ".");
+	}
+
+	_region = region;
+	_header = static_cast<const snapshot_export::Header *>(_region);
+
+	if (memcmp(_header->magic, export_magic, sizeof(export_magic)) != 0 || _header->version != snapshot_export::EXPORT_VERSION ||
+	    snapshot_export::region_size(_header->capacity) > _size)
+	{
+		munmap(const_cast<void *>(_region), _size);
+		throw std::runtime_error("Invalid export region " + path + ".");
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+SnapshotExportReader::~SnapshotExportReader()
+{
+	munmap(const_cast<void *>(_region), _size);
+}
+
+void SnapshotExportReader::read_layout(MeasurementsSnapshot &snapshot)
+{
+	const snapshot_export::Entry *const layout = entries(_region);
+	const uint32_t                      count  = std::min(_header->count, _header->capacity);
+
+	snapshot.clear();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		snapshot.add(std::string(layout[i].name, strnlen(layout[i].name, snapshot_export::EXPORT_NAME_SIZE)),
+		             std::string(layout[i].unit, strnlen(layout[i].unit, snapshot_export::EXPORT_UNIT_SIZE)),
+		             layout[i].is_floating_point != 0);
+	}
+}
+
+bool SnapshotExportReader::read(MeasurementsSnapshot &snapshot, uint64_t &timestamp_ns)
+{
+	const size_t capacity = _header->capacity;
+
+	for (int attempt = 0; attempt < max_read_attempts; ++attempt)
+	{
+		const uint32_t layout_sequence = _header->layout_sequence.load(std::memory_order_acquire);
+		if (layout_sequence & 1)
+		{
+			continue;
+		}
+
+		if (layout_sequence != _layout_sequence || snapshot.empty())
+		{
+			read_layout(snapshot);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_header->layout_sequence.load(std::memory_order_relaxed) != layout_sequence)
+			{
+				snapshot.clear();
+				continue;
+			}
+			_layout_sequence = layout_sequence;
+		}
+
+		// The header is shared with another process, don't index out of the region if it is corrupted
+		const uint32_t slot_index = _header->active_slot.load(std::memory_order_acquire);
+		if (slot_index > 1)
+		{
+			continue;
+		}
+
+		const uint8_t *const slot_data = static_cast<const uint8_t *>(_region) + slot_offset(capacity, slot_index);
+		const auto *const    slot      = reinterpret_cast<const snapshot_export::Slot *>(slot_data);
+		const auto *const    values    = reinterpret_cast<const snapshot_export::Value *>(slot_data + sizeof(snapshot_export::Slot));
+
+		const uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+		if ((sequence & 1) || slot->layout_sequence != layout_sequence)
+		{
+			continue;
+		}
+
+		const uint64_t publish_count = slot->publish_count;
+		const uint64_t timestamp     = slot->timestamp_ns;
+		for (MeasurementsSnapshot::Id id = 0; id < snapshot.size(); ++id)
+		{
+			if (snapshot.value(id).is_floating_point)
+			{
+				snapshot.set(id, values[id].floating_point);
+			}
+			else
+			{
+				snapshot.set(id, values[id].integer);
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->sequence.load(std::memory_order_relaxed) != sequence)
+		{
+			continue;
+		}
+
+		if (publish_count == 0)
+		{
+			return false;
+		}
+
+		_publish_count = publish_count;
+		timestamp_ns   = timestamp;
+		return true;
+	}
+
+	return false;
+}
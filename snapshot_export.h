@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "measurements_snapshot.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/** Layout of the shared memory region written by a @ref SnapshotExporter.
+ *
+ * The region starts with a header, followed by the names of the measurements
+ * (capacity entries) and two value slots (each a slot header followed by
+ * capacity values). The names are only rewritten when the measurements
+ * change; the values are written to the slot readers aren't pointed at, then
+ * that slot is published, so readers seldom have to retry. Both the names
+ * and each slot are protected by a sequence counter: it is odd while they
+ * are written, and a reader whose copy saw the counter change retries.
+ */
+namespace snapshot_export
+{
+enum
+{
+	EXPORT_VERSION   = 1,
+	EXPORT_NAME_SIZE = 56, /**< Maximum name length, including the terminating null character. */
+	EXPORT_UNIT_SIZE = 20, /**< Maximum unit length, including the terminating null character. */
+	EXPORT_SLOTS     = 2,
+};
+
+/** Name of a measurement */
+struct Entry
+{
+	char     name[EXPORT_NAME_SIZE];
+	char     unit[EXPORT_UNIT_SIZE];
+	uint32_t is_floating_point;
+};
+
+/** Header of the region */
+struct Header
+{
+	char                  magic[8];        /**< "HWCEXPRT" */
+	uint32_t              version;         /**< EXPORT_VERSION */
+	uint32_t              capacity;        /**< Maximum number of measurements. */
+	std::atomic<uint32_t> layout_sequence; /**< Sequence counter of the names. */
+	uint32_t              count;           /**< Number of measurements. */
+	std::atomic<uint32_t> active_slot;     /**< Slot holding the latest values. */
+	uint32_t              reserved;
+};
+
+/** Value of a measurement, its type is given by its @ref Entry */
+union Value
+{
+	long long int integer;
+	double        floating_point;
+};
+
+/** Values of one publication, followed by the values of the measurements */
+struct Slot
+{
+	std::atomic<uint32_t> sequence;        /**< Sequence counter of the slot. */
+	uint32_t              layout_sequence; /**< Names the values belong to. */
+	uint64_t              timestamp_ns;    /**< Time of the values, CLOCK_MONOTONIC. */
+	uint64_t              publish_count;   /**< Number of publications so far. */
+};
+
+/** Size of the region for a capacity.
+ *
+ * @param[in] capacity Maximum number of measurements.
+ *
+ * @return the size of the region, in bytes.
+ */
+size_t region_size(size_t capacity);
+}        // namespace snapshot_export
+
+/** Publish measurement snapshots to shared memory, for agents running in other processes.
+ *
+ * The region is a file mapped by both sides, e.g. in /dev/shm or
+ * /data/local/tmp. Publishing writes the values in place into the slot
+ * readers aren't pointed at, then points them at it: it neither allocates,
+ * takes a lock nor makes a syscall, so it can be called every frame from
+ * the thread polling the counters. Readers never block the writer; they
+ * copy the latest values with a @ref SnapshotExportReader.
+ */
+class SnapshotExporter
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] path            File backing the region, created if needed.
+	 * @param[in] capacity        Maximum number of measurements published, the others are dropped.
+	 * @param[in] min_interval_ns Minimum time between two publications, in nanoseconds. 0 publishes every call.
+	 */
+	explicit SnapshotExporter(const std::string &path, size_t capacity = 256, uint64_t min_interval_ns = 0);
+
+	/** Unmap the region, the file is left for the readers. */
+	~SnapshotExporter();
+
+	/** Prevent instances of this class from being copy constructed */
+	SnapshotExporter(const SnapshotExporter &) = delete;
+	/** Prevent instances of this class from being copied */
+	SnapshotExporter &operator=(const SnapshotExporter &) = delete;
+
+	/** Publish the measurements of several instruments.
+	 *
+	 * Measurements are published in order, e.g. the CPU snapshot then the GPU
+	 * snapshot. The names are only rewritten when they change.
+	 *
+	 * @param[in] snapshots    Snapshots to publish.
+	 * @param[in] count        Number of snapshots.
+	 * @param[in] timestamp_ns Time of the measurements, CLOCK_MONOTONIC. 0 for now.
+	 *
+	 * @return false if the publication was skipped by the rate limit.
+	 */
+	bool publish(const MeasurementsSnapshot *const *snapshots, size_t count, uint64_t timestamp_ns = 0);
+
+	/** Publish the measurements of one instrument.
+	 *
+	 * @param[in] snapshot     Snapshot to publish.
+	 * @param[in] timestamp_ns Time of the measurements, CLOCK_MONOTONIC. 0 for now.
+	 *
+	 * @return false if the publication was skipped by the rate limit.
+	 */
+	bool publish(const MeasurementsSnapshot &snapshot, uint64_t timestamp_ns = 0);
+
+  private:
+	bool layout_matches(const MeasurementsSnapshot *const *snapshots, size_t count) const;
+	void write_layout(const MeasurementsSnapshot *const *snapshots, size_t count);
+
+	size_t                   _capacity;
+	uint64_t                 _min_interval_ns;
+	uint64_t                 _last_publish_ns{0};
+	uint64_t                 _publish_count{0};
+	size_t                   _size{0};
+	void *                   _region{nullptr};
+	snapshot_export::Header *_header{nullptr};
+	snapshot_export::Entry * _entries{nullptr};
+};
+
+/** Read the measurements published by a @ref SnapshotExporter. */
+class SnapshotExportReader
+{
+  public:
+	/** Constructor
+	 *
+	 * @param[in] path File backing the region.
+	 */
+	explicit SnapshotExportReader(const std::string &path);
+
+	/** Unmap the region. */
+	~SnapshotExportReader();
+
+	/** Prevent instances of this class from being copy constructed */
+	SnapshotExportReader(const SnapshotExportReader &) = delete;
+	/** Prevent instances of this class from being copied */
+	SnapshotExportReader &operator=(const SnapshotExportReader &) = delete;
+
+	/** Copy the latest published measurements.
+	 *
+	 * The snapshot is laid out again only when the published names changed.
+	 *
+	 * @param[in,out] snapshot     Snapshot receiving the measurements.
+	 * @param[out]    timestamp_ns Time of the measurements, CLOCK_MONOTONIC.
+	 *
+	 * @return false if nothing was published yet, or the writer kept rewriting the values while they were copied.
+	 */
+	bool read(MeasurementsSnapshot &snapshot, uint64_t &timestamp_ns);
+
+	/** Number of publications so far.
+	 *
+	 * @return the publication count of the latest values read.
+	 */
+	uint64_t publish_count() const
+	{
+		return _publish_count;
+	}
+
+  private:
+	void read_layout(MeasurementsSnapshot &snapshot);
+
+	size_t                         _size{0};
+	const void *                   _region{nullptr};
+	const snapshot_export::Header *_header{nullptr};
+	uint32_t                       _layout_sequence{0};
+	uint64_t                       _publish_count{0};
+};
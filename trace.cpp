@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "trace.h"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+/** Largest block identifier, so that a corrupted trace can't make the reader allocate without bound */
+constexpr uint64_t max_block = 1024;
+
+/** Largest number of values of a record, well above a Mali dump of the largest GPU, for the same reason */
+constexpr uint64_t max_values = 1024 * 1024;
+
+/** Map signed differences to unsigned integers so that small negative ones stay short */
+inline uint64_t zigzag_encode(uint64_t delta)
+{
+	return (delta << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+}
+
+inline uint64_t zigzag_decode(uint64_t value)
+{
+	return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+void write_all(int fd, const uint8_t *data, size_t size)
+{
+	while (size > 0)
+	{
+		const ssize_t written = ::write(fd, data, size);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			throw std::runtime_error("Failed to write trace file: " + std::to_string(errno));
+		}
+
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+}
+}        // namespace
+
+TraceWriter::TraceWriter(const std::string &path, const TraceHeader &header, size_t buffer_size) :
+    _buffer_size(buffer_size)
+{
+	_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);        // NOLINT
+
+	if (_fd < 0)
+	{
+		throw std::runtime_error("Failed to open trace file " + path + ".");
+	}
+
+	// Avoid reallocating when a record crosses the flush threshold
+	_buffer.reserve(_buffer_size + 4096);
+	write_all(_fd, reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+}
+
+TraceWriter::~TraceWriter()
+{
+	try
+	{
+		flush();
+	}
+	catch (const std::runtime_error &)
+	{
+	}
+
+	close(_fd);
+}
+
+void TraceWriter::write(uint32_t block, uint64_t timestamp, const uint32_t *values, size_t count)
+{
+	write_record(block, timestamp, values, count);
+}
+
+void TraceWriter::write(uint32_t block, uint64_t timestamp, const uint64_t *values, size_t count)
+{
+	write_record(block, timestamp, values, count);
+}
+
+template <typename T>
+void TraceWriter::write_record(uint32_t block, uint64_t timestamp, const T *values, size_t count)
+{
+	if (block >= max_block)
+	{
+		throw std::runtime_error("Invalid trace block.");
+	}
+
+	if (count > max_values)
+	{
+		throw std::runtime_error("Trace record too large.");
+	}
+
+	if (block >= _last_values.size())
+	{
+		_last_values.resize(block + 1);
+	}
+
+	std::vector<uint64_t> &last = _last_values[block];
+	last.resize(count, 0);
+
+	put_varint(zigzag_encode(timestamp - _last_timestamp));
+	put_varint(block);
+	put_varint(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		// Differences are computed modulo 2^64, the decoder wraps them back
+		put_varint(zigzag_encode(static_cast<uint64_t>(values[i]) - last[i]));
+		last[i] = values[i];
+	}
+
+	_last_timestamp = timestamp;
+
+	if (_buffer.size() >= _buffer_size)
+	{
+		flush();
+	}
+}
+
+void TraceWriter::put_varint(uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		_buffer.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	_buffer.push_back(static_cast<uint8_t>(value));
+}
+
+void TraceWriter::flush()
+{
+	write_all(_fd, _buffer.data(), _buffer.size());
+	_buffer.clear();
+}
+
+TraceReader::TraceReader(const std::string &path) :
+    _buffer(64 * 1024)
+{
+	_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);        // NOLINT
+
+	if (_fd < 0)
+	{
+		throw std::runtime_error("Failed to open trace file " + path + ".");
+	}
+
+	uint8_t *header = reinterpret_cast<uint8_t *>(&_header);
+	for (size_t i = 0; i < sizeof(_header); ++i)
+	{
+		if (!get_byte(header[i]))
+		{
+			close(_fd);
+			throw std::runtime_error("Truncated trace header.");
+		}
+	}
+
+	if (memcmp(_header.magic, TraceHeader().magic, sizeof(_header.magic)) != 0 || _header.version != TraceHeader().version)
+	{
+		close(_fd);
+		throw std::runtime_error("Unsupported trace file.");
+	}
+}
+
+TraceReader::~TraceReader()
+{
+	close(_fd);
+}
+
+const TraceHeader &TraceReader::header() const
+{
+	return _header;
+}
+
+bool TraceReader::next(TraceRecord &record)
+{
+	uint64_t timestamp_delta;
+	uint64_t block;
+	uint64_t count;
+
+	if (!get_varint(timestamp_delta) || !get_varint(block) || !get_varint(count) || block >= max_block || count > max_values)
+	{
+		return false;
+	}
+
+	if (block >= _last_values.size())
+	{
+		_last_values.resize(block + 1);
+	}
+
+	std::vector<uint64_t> &last = _last_values[block];
+	last.resize(count, 0);
+	record.values.resize(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint64_t delta;
+		if (!get_varint(delta))
+		{
+			return false;
+		}
+
+		last[i] += zigzag_decode(delta);
+		record.values[i] = last[i];
+	}
+
+	_last_timestamp += zigzag_decode(timestamp_delta);
+	record.timestamp = _last_timestamp;
+	record.block     = static_cast<uint32_t>(block);
+
+	return true;
+}
+
+bool TraceReader::get_byte(uint8_t &byte)
+{
+	if (_position == _end)
+	{
+		ssize_t result;
+		do
+		{
+			result = read(_fd, _buffer.data(), _buffer.size());
+		} while (result < 0 && errno == EINTR);
+
+		if (result <= 0)
+		{
+			return false;
+		}
+
+		_position = 0;
+		_end      = static_cast<size_t>(result);
+	}
+
+	byte = _buffer[_position++];
+	return true;
+}
+
+bool TraceReader::get_varint(uint64_t &value)
+{
+	value = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7)
+	{
+		uint8_t byte;
+		if (!get_byte(byte))
+		{
+			return false;
+		}
+
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2017-2019 ARM Limited.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Identifiers of the blocks of values stored in a trace. */
+enum TraceBlock : uint32_t
+{
+	TRACE_BLOCK_MALI_DUMP = 0, /**< Whole raw Mali hardware counter dump. */
+	TRACE_BLOCK_PMU_GROUP = 1, /**< Values of a PMU event group read, see @ref PMUGroupValues. */
+	TRACE_BLOCK_USER      = 16 /**< First identifier free for application defined blocks. */
+};
+
+/** Header at the start of a trace file, describing the GPU the dumps come from. */
+struct TraceHeader
+{
+	char     magic[8]{'H', 'W', 'C', 'T', 'R', 'A', 'C', 'E'};
+	uint32_t version{1};
+	uint32_t gpu_id{0};        /**< Raw GPU id, as reported by kbase. */
+	uint32_t hw_ver{0};        /**< Hardware counter reader version. */
+	uint32_t num_cores{0};     /**< Number of shader cores. */
+	uint32_t num_l2_slices{0}; /**< Number of L2 cache slices. */
+	uint32_t names_lut_id{0};  /**< Product id of the counter names table the dumps are laid out for. */
+	uint64_t core_mask{0};     /**< Shader core mask. */
+	uint32_t block_size{0};    /**< Number of counters of a hardware counter block. */
+	uint32_t reserved{0};
+};
+
+static_assert(sizeof(TraceHeader) == 48, "The trace header layout must not depend on the compiler.");
+
+/** One record read back from a trace. */
+struct TraceRecord
+{
+	uint64_t              timestamp{0}; /**< Timestamp of the record, in nanoseconds. */
+	uint32_t              block{0};     /**< Block identifier, see @ref TraceBlock. */
+	std::vector<uint64_t> values{};     /**< Values of the block. */
+};
+
+/** Append-only binary writer of counter samples.
+ *
+ * Each record stores a timestamp, a block identifier and the block values.
+ * Timestamps are stored as the difference to the previous record and values
+ * as the difference to the previous record of the same block, both as
+ * variable length integers. Counters that don't change, such as the unused
+ * and disabled counters of a Mali dump, take a single byte.
+ *
+ * Records are encoded into a buffer that is written to the file when full,
+ * so recording a sample doesn't make a syscall.
+ */
+class TraceWriter
+{
+  public:
+	/** Create a trace file and write its header.
+	 *
+	 * @param[in] path        Path of the file, truncated if it exists.
+	 * @param[in] header      Trace header.
+	 * @param[in] buffer_size Number of bytes buffered before writing to the file.
+	 */
+	TraceWriter(const std::string &path, const TraceHeader &header, size_t buffer_size = 64 * 1024);
+
+	/** Prevent instances of this class from being copy constructed */
+	TraceWriter(const TraceWriter &) = delete;
+	/** Prevent instances of this class from being copied */
+	TraceWriter &operator=(const TraceWriter &) = delete;
+
+	/** Flush the buffered records and close the file. */
+	~TraceWriter();
+
+	/** Record 32-bit values, such as a Mali dump.
+	 *
+	 * @param[in] block     Block identifier, see @ref TraceBlock.
+	 * @param[in] timestamp Timestamp of the values, in nanoseconds.
+	 * @param[in] values    Values to record.
+	 * @param[in] count     Number of values.
+	 */
+	void write(uint32_t block, uint64_t timestamp, const uint32_t *values, size_t count);
+
+	/** Record 64-bit values, such as a PMU group read.
+	 *
+	 * @param[in] block     Block identifier, see @ref TraceBlock.
+	 * @param[in] timestamp Timestamp of the values, in nanoseconds.
+	 * @param[in] values    Values to record.
+	 * @param[in] count     Number of values.
+	 */
+	void write(uint32_t block, uint64_t timestamp, const uint64_t *values, size_t count);
+
+	/** Write the buffered records to the file. */
+	void flush();
+
+  private:
+	template <typename T>
+	void write_record(uint32_t block, uint64_t timestamp, const T *values, size_t count);
+	void put_varint(uint64_t value);
+
+	int                                _fd{-1};
+	size_t                             _buffer_size;
+	std::vector<uint8_t>               _buffer{};
+	uint64_t                           _last_timestamp{0};
+	std::vector<std::vector<uint64_t>> _last_values{}; /**< Previous values of each block. */
+};
+
+/** Reader of the files written by @ref TraceWriter. */
+class TraceReader
+{
+  public:
+	/** Open a trace file and read its header.
+	 *
+	 * @param[in] path Path of the file.
+	 */
+	explicit TraceReader(const std::string &path);
+
+	/** Prevent instances of this class from being copy constructed */
+	TraceReader(const TraceReader &) = delete;
+	/** Prevent instances of this class from being copied */
+	TraceReader &operator=(const TraceReader &) = delete;
+
+	/** Close the file. */
+	~TraceReader();
+
+	/** Get the header of the trace.
+	 *
+	 * @return the trace header.
+	 */
+	const TraceHeader &header() const;
+
+	/** Read the next record.
+	 *
+	 * @param[out] record Decoded record. Its vector is reused, so reading a trace of fixed size blocks doesn't allocate.
+	 *
+	 * @return false at the end of the trace, or if the last record was truncated or corrupted.
+	 */
+	bool next(TraceRecord &record);
+
+  private:
+	bool get_byte(uint8_t &byte);
+	bool get_varint(uint64_t &value);
+
+	int                                _fd{-1};
+	TraceHeader                        _header{};
+	std::vector<uint8_t>               _buffer;
+	size_t                             _position{0};
+	size_t                             _end{0};
+	uint64_t                           _last_timestamp{0};
+	std::vector<std::vector<uint64_t>> _last_values{};
+};